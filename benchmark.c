@@ -1,4 +1,8 @@
+#define _POSIX_C_SOURCE 199309L
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "rset.h"
@@ -6,112 +10,487 @@
 #ifdef __MACH__
 # include <mach/mach_time.h>
 #else
-# error Unsupported system
+# include <time.h>
 #endif
 
-const int times = 2048;
+/**
+ * Every benchmark is run against every workload. A workload is a pair of sets
+ * with the same cardinality and distribution. Results are printed as CSV:
+ *
+ *     benchmark,distribution,cardinality,type,ns_per_op,items_per_s,bytes_per_item
+ *
+ * ns_per_op is the best time seen for a single operation, items_per_s is the
+ * number of items the operation touches per second (e.g. both operands for
+ * set operations), and bytes_per_item is the exported size of the first
+ * operand divided by its cardinality.
+ */
+
+const static unsigned cardinalities[] = {
+    64,           // sparse array
+    4000, 4200,   // around the array/bitset cut-off
+    32768,        // half-full bitset
+    61000, 62000, // around the bitset/inverted array cut-off
+    65000         // dense inverted array
+};
+
+const static char *distributions[] = { "uniform", "clustered", "ranges" };
+
+const static unsigned probe_count = 1024;
+const static unsigned range_count = 256;
+const static unsigned small_count = 16;
+const static unsigned max_reps = 2000;
+const static uint64_t min_elapsed = 2000000;
 
-uint64_t nanoseconds()
+typedef struct {
+    const char *distribution;
+    unsigned cardinality;
+    rset_t *a;
+    rset_t *b;
+    rset_t *small;
+    rset_t *result;
+    uint16_t items[65536];
+    uint16_t probes[1024];
+    uint16_t ranges[256][2];
+    uint32_t output[65536];
+    unsigned char serialized[16 + 2 * 4608];
+    unsigned serialized_length;
+} workload_t;
+
+typedef enum {
+    ITEMS_PER_OP, // each op touches a single item
+    ITEMS_IN_SET, // each op touches every item in the first operand
+    ITEMS_IN_BOTH // each op touches every item in both operands
+} items_t;
+
+typedef struct {
+    const char *name;
+    void (*setup)(workload_t *workload);
+    unsigned (*run)(workload_t *workload);
+    items_t items;
+} benchmark_t;
+
+static uint64_t nanoseconds()
 {
 #ifdef __MACH__
-    return mach_absolute_time();
+    static mach_timebase_info_data_t timebase;
+    if (!timebase.denom)
+        mach_timebase_info(&timebase);
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
 #endif
 }
 
-#define BENCH_START \
-    { \
-        uint64_t start, elapsed, best_time = -1; \
-        for (int i = 0; i < times; i++) { \
-            start = nanoseconds();
+static uint32_t random_state = 1;
 
-#define BENCH_END(info) \
-            elapsed = nanoseconds() - start; \
-            if (elapsed < best_time) \
-                best_time = elapsed; \
-        } \
-        printf(info ": %llu ns\n", best_time); \
+static uint32_t random_next()
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static void shuffle(uint16_t *items, unsigned count)
+{
+    for (unsigned i = count; i > 1; i--) {
+        unsigned j = random_next() % i;
+        uint16_t swap = items[i - 1];
+        items[i - 1] = items[j];
+        items[j] = swap;
     }
+}
 
-int main()
+static rset_t *generate(const char *distribution, unsigned cardinality,
+                        uint16_t *items)
+{
+    // Pick `cardinality` distinct items following the distribution, write
+    // them to `items` in random order and return them as a set.
+    static bool present[65536];
+    memset(present, 0, sizeof(present));
+    unsigned count = 0;
+    if (!strcmp(distribution, "uniform")) {
+        for (unsigned i = 0; i < 65536; i++)
+            items[i] = i;
+        shuffle(items, 65536);
+        count = cardinality;
+    } else {
+        // Clusters are 256 wide and half full; ranges are fully populated
+        // and between 64 and 4096 items long.
+        bool clustered = !strcmp(distribution, "clustered");
+        while (count < cardinality) {
+            unsigned start = random_next() & 0xFFFF;
+            unsigned length = clustered ? 256 : 64 + random_next() % 4032;
+            for (unsigned i = start; i < start + length && i < 65536; i++) {
+                if (present[i] || (clustered && random_next() & 1))
+                    continue;
+                present[i] = true;
+                items[count++] = i;
+                if (count == cardinality)
+                    break;
+            }
+        }
+        shuffle(items, count);
+    }
+    rset_t *set = rset_new();
+    assert(set && rset_add_many(set, items, count));
+    assert(rset_cardinality(set) == cardinality);
+    return set;
+}
+
+static void workload_init(workload_t *workload, const char *distribution,
+                          unsigned cardinality)
 {
-    rset_t *set = rset_import(NULL, 4096);
-    rset_t *set_b = rset_import(NULL, 4096);
-    rset_t *result = rset_import(NULL, 4096);
-    assert(set && result);
-
-    rset_truncate(set);
-    for (unsigned i = 0; i < 32768; i++)
-        assert(rset_add(set, i * 2));
-    BENCH_START
-    assert(rset_contains(set, 10000));
-    BENCH_END("Contains bitset")
-
-    rset_truncate(set);
-    for (unsigned i = 0; i < 4095; i++)
-        assert(rset_add(set, i));
-    BENCH_START
-    assert(rset_contains(set, 4000));
-    BENCH_END("Contains array")
-
-    rset_truncate(set);
-    for (unsigned i = 0; i < 32768; i++)
-        assert(rset_add(set, i * 2));
-    BENCH_START
-    rset_invert(set, result);
-    assert(rset_cardinality(result) == 32768);
-    BENCH_END("Invert bitset")
-
-    rset_truncate(set);
-    for (unsigned i = 0; i < 4095; i++)
-        assert(rset_add(set, i * 2));
-    BENCH_START
-    rset_invert(set, result);
-    assert(rset_cardinality(result) == 61441);
-    BENCH_END("Invert array")
-
-    rset_truncate(set);
-    for (unsigned i = 0; i < 4095; i++) {
-        assert(rset_add(set, i * 2));
-        assert(rset_add(set_b, i * 3));
+    workload->distribution = distribution;
+    workload->cardinality = cardinality;
+    workload->b = generate(distribution, cardinality, workload->items);
+    workload->a = generate(distribution, cardinality, workload->items);
+    workload->result = rset_new();
+    workload->small = rset_new();
+    assert(workload->result && workload->small);
+    for (unsigned i = 0; i < small_count; i++)
+        assert(rset_add(workload->small, random_next()));
+    for (unsigned i = 0; i < probe_count; i++)
+        workload->probes[i] = random_next();
+    for (unsigned i = 0; i < range_count; i++) {
+        unsigned start = random_next() & 0xFFFF;
+        workload->ranges[i][0] = start;
+        workload->ranges[i][1] = start + random_next() % (65536 - start);
     }
-    BENCH_START
-    rset_intersection(set, set_b, result);
-    assert(rset_cardinality(result) == 1365);
-    BENCH_END("Intersection with arrays")
-
-    rset_truncate(set);
-    rset_truncate(set_b);
-    for (unsigned i = 0; i < 20000; i++) {
-        assert(rset_add(set, i * 2));
-        assert(rset_add(set_b, i * 3));
+}
+
+static void workload_clear(workload_t *workload)
+{
+    rset_free(workload->a);
+    rset_free(workload->b);
+    rset_free(workload->small);
+    rset_free(workload->result);
+}
+
+static void setup_empty(workload_t *workload)
+{
+    rset_truncate(workload->result);
+}
+
+static void setup_copy(workload_t *workload)
+{
+    rset_free(workload->result);
+    workload->result = rset_copy(workload->a);
+    assert(workload->result);
+}
+
+static void setup_complement(workload_t *workload)
+{
+    assert(rset_invert(workload->a, workload->result));
+}
+
+static void setup_compressed(workload_t *workload)
+{
+    workload->serialized_length = rset_serialize(workload->a,
+                                                 workload->serialized,
+                                                 RSET_COMPRESS);
+}
+
+static unsigned run_add(workload_t *workload)
+{
+    for (unsigned i = 0; i < workload->cardinality; i++)
+        rset_add(workload->result, workload->items[i]);
+    return workload->cardinality;
+}
+
+static unsigned run_add_many(workload_t *workload)
+{
+    rset_add_many(workload->result, workload->items, workload->cardinality);
+    return 1;
+}
+
+static unsigned run_remove(workload_t *workload)
+{
+    for (unsigned i = 0; i < workload->cardinality; i++)
+        rset_remove(workload->result, workload->items[i]);
+    return workload->cardinality;
+}
+
+static unsigned run_contains(workload_t *workload)
+{
+    unsigned found = 0;
+    for (unsigned i = 0; i < probe_count; i++)
+        found += rset_contains(workload->a, workload->probes[i]);
+    assert(found <= probe_count);
+    return probe_count;
+}
+
+static unsigned run_add_range(workload_t *workload)
+{
+    for (unsigned i = 0; i < range_count; i++)
+        rset_add_range(workload->result, workload->ranges[i][0],
+                       workload->ranges[i][0] + 64);
+    return range_count;
+}
+
+static unsigned run_remove_range(workload_t *workload)
+{
+    for (unsigned i = 0; i < range_count; i++)
+        rset_remove_range(workload->result, workload->ranges[i][0],
+                          workload->ranges[i][0] + 64);
+    return range_count;
+}
+
+static unsigned run_range_cardinality(workload_t *workload)
+{
+    unsigned cardinality = 0;
+    for (unsigned i = 0; i < range_count; i++)
+        cardinality += rset_range_cardinality(workload->a,
+                                              workload->ranges[i][0],
+                                              workload->ranges[i][1]);
+    assert(cardinality <= range_count * 65536);
+    return range_count;
+}
+
+static unsigned run_rank(workload_t *workload)
+{
+    unsigned rank = 0;
+    for (unsigned i = 0; i < probe_count; i++)
+        rank += rset_rank(workload->a, workload->probes[i]);
+    assert(rank <= probe_count * 65536);
+    return probe_count;
+}
+
+static unsigned run_select(workload_t *workload)
+{
+    uint16_t item;
+    for (unsigned i = 0; i < probe_count; i++)
+        assert(rset_select(workload->a,
+                           workload->probes[i] % workload->cardinality,
+                           &item));
+    return probe_count;
+}
+
+static unsigned run_iterate(workload_t *workload)
+{
+    rset_iterator_t iterator;
+    rset_iterator_init(&iterator, workload->a);
+    uint16_t item;
+    unsigned count = 0;
+    while (rset_iterator_next(&iterator, &item))
+        count++;
+    assert(count == workload->cardinality);
+    return 1;
+}
+
+static unsigned run_to_array(workload_t *workload)
+{
+    rset_to_array32(workload->a, 0, workload->output);
+    return 1;
+}
+
+static unsigned run_intersection(workload_t *workload)
+{
+    rset_intersection(workload->a, workload->b, workload->result);
+    return 1;
+}
+
+static unsigned run_intersection_small(workload_t *workload)
+{
+    rset_intersection(workload->small, workload->a, workload->result);
+    return 1;
+}
+
+static unsigned run_union(workload_t *workload)
+{
+    rset_union(workload->a, workload->b, workload->result);
+    return 1;
+}
+
+static unsigned run_difference(workload_t *workload)
+{
+    rset_difference(workload->a, workload->b, workload->result);
+    return 1;
+}
+
+static unsigned run_xor(workload_t *workload)
+{
+    rset_xor(workload->a, workload->b, workload->result);
+    return 1;
+}
+
+static unsigned run_and_inplace(workload_t *workload)
+{
+    rset_and_inplace(workload->result, workload->b);
+    return 1;
+}
+
+static unsigned run_or_inplace(workload_t *workload)
+{
+    rset_or_inplace(workload->result, workload->b);
+    return 1;
+}
+
+static unsigned run_intersection_cardinality(workload_t *workload)
+{
+    unsigned cardinality = rset_intersection_cardinality(workload->a,
+                                                         workload->b);
+    assert(cardinality <= workload->cardinality);
+    return 1;
+}
+
+static unsigned run_jaccard(workload_t *workload)
+{
+    double similarity = rset_jaccard(workload->a, workload->b);
+    assert(similarity >= 0 && similarity <= 1);
+    return 1;
+}
+
+static unsigned run_intersects(workload_t *workload)
+{
+    // Disjoint sets are the worst case, since there's no early exit.
+    rset_intersects(workload->a, workload->result);
+    return 1;
+}
+
+static unsigned run_invert(workload_t *workload)
+{
+    rset_invert(workload->a, workload->result);
+    return 1;
+}
+
+static unsigned run_equals(workload_t *workload)
+{
+    assert(rset_equals(workload->a, workload->result));
+    return 1;
+}
+
+static unsigned run_import_export(workload_t *workload)
+{
+    rset_t *set = rset_import(rset_export(workload->a),
+                              rset_length(workload->a));
+    assert(set);
+    rset_free(set);
+    return 1;
+}
+
+static unsigned run_serialize_checked(workload_t *workload)
+{
+    static unsigned char buffer[16 + 2 * 4608 + 4];
+    unsigned length = rset_serialize(workload->a, buffer, RSET_CHECKSUM);
+    rset_t *set = rset_import_checked(buffer, length);
+    assert(set);
+    rset_free(set);
+    return 1;
+}
+
+static unsigned run_import_compressed(workload_t *workload)
+{
+    rset_t *set = rset_import_checked(workload->serialized,
+                                      workload->serialized_length);
+    assert(set);
+    rset_free(set);
+    return 1;
+}
+
+static unsigned run_pool_copy(workload_t *workload)
+{
+    static rset_pool_t *pool;
+    if (!pool)
+        assert((pool = rset_pool_new()));
+    rset_allocator_t allocator = rset_pool_allocator(pool);
+    rset_set_allocator(&allocator);
+    rset_t *set = rset_copy(workload->a);
+    assert(set);
+    rset_free(set);
+    rset_set_allocator(NULL);
+    return 1;
+}
+
+static unsigned run_optimize(workload_t *workload)
+{
+    rset_optimize(workload->result);
+    return 1;
+}
+
+const static benchmark_t benchmarks[] = {
+    { "add", setup_empty, run_add, ITEMS_PER_OP },
+    { "add_many", setup_empty, run_add_many, ITEMS_IN_SET },
+    { "remove", setup_copy, run_remove, ITEMS_PER_OP },
+    { "contains", NULL, run_contains, ITEMS_PER_OP },
+    { "add_range", setup_copy, run_add_range, ITEMS_PER_OP },
+    { "remove_range", setup_copy, run_remove_range, ITEMS_PER_OP },
+    { "range_cardinality", NULL, run_range_cardinality, ITEMS_PER_OP },
+    { "rank", NULL, run_rank, ITEMS_PER_OP },
+    { "select", NULL, run_select, ITEMS_PER_OP },
+    { "iterate", NULL, run_iterate, ITEMS_IN_SET },
+    { "to_array", NULL, run_to_array, ITEMS_IN_SET },
+    { "intersection", NULL, run_intersection, ITEMS_IN_BOTH },
+    { "intersection_small", NULL, run_intersection_small, ITEMS_IN_SET },
+    { "union", NULL, run_union, ITEMS_IN_BOTH },
+    { "difference", NULL, run_difference, ITEMS_IN_BOTH },
+    { "xor", NULL, run_xor, ITEMS_IN_BOTH },
+    { "and_inplace", setup_copy, run_and_inplace, ITEMS_IN_BOTH },
+    { "or_inplace", setup_copy, run_or_inplace, ITEMS_IN_BOTH },
+    { "intersection_cardinality", NULL, run_intersection_cardinality,
+      ITEMS_IN_BOTH },
+    { "jaccard", NULL, run_jaccard, ITEMS_IN_BOTH },
+    { "intersects", setup_complement, run_intersects, ITEMS_IN_SET },
+    { "invert", NULL, run_invert, ITEMS_IN_SET },
+    { "equals", setup_copy, run_equals, ITEMS_IN_SET },
+    { "import_export", NULL, run_import_export, ITEMS_IN_SET },
+    { "pool_copy", NULL, run_pool_copy, ITEMS_IN_SET },
+    { "serialize_checked", NULL, run_serialize_checked, ITEMS_IN_SET },
+    { "import_compressed", setup_compressed, run_import_compressed, ITEMS_IN_SET },
+    { "optimize", setup_copy, run_optimize, ITEMS_IN_SET }
+};
+
+const static char *type_names[] = { "array", "bitset", "inverted", "run" };
+
+static void bench(const benchmark_t *benchmark, workload_t *workload)
+{
+    // Keep the best time per op, running until enough time has been spent
+    // timing the benchmark (or the rep limit is hit).
+    double best = -1;
+    uint64_t total = 0;
+    for (unsigned rep = 0; rep < max_reps && total < min_elapsed; rep++) {
+        if (benchmark->setup)
+            benchmark->setup(workload);
+        uint64_t start = nanoseconds();
+        unsigned ops = benchmark->run(workload);
+        uint64_t elapsed = nanoseconds() - start;
+        total += elapsed;
+        double per_op = (double)elapsed / ops;
+        if (best < 0 || per_op < best)
+            best = per_op;
     }
-    BENCH_START
-    rset_intersection(set, set_b, result);
-    assert(rset_cardinality(result) == 6667);
-    BENCH_END("Intersection with bitsets")
-
-    BENCH_START
-    rset_truncate(set);
-    for (unsigned i = 0; i < 65536; i++)
-        assert(rset_add(set, i));
-    assert(rset_cardinality(set) == 65536);
-    BENCH_END("Fill ascending")
-
-    BENCH_START
-    rset_truncate(set);
-    for (int i = 65535; i >= 0; i--)
-        assert(rset_add(set, i));
-    assert(rset_cardinality(set) == 65536);
-    BENCH_END("Fill descending")
-
-    BENCH_START
-    rset_truncate(set);
-    for (unsigned i = 0; i < 32768; i++)
-        assert(rset_add(set, i));
-    for (unsigned i = 65535; i >= 32768; i--)
-        assert(rset_add(set, i));
-    assert(rset_cardinality(set) == 65536);
-    BENCH_END("Fill optimal")
 
+    double items = 1;
+    if (benchmark->items == ITEMS_IN_SET)
+        items = rset_cardinality(workload->a);
+    else if (benchmark->items == ITEMS_IN_BOTH)
+        items = rset_cardinality(workload->a) + rset_cardinality(workload->b);
+    const uint16_t *header = rset_export(workload->a);
+    printf("%s,%s,%u,%s,%.2f,%.0f,%.3f\n", benchmark->name,
+           workload->distribution, workload->cardinality,
+           type_names[header[0]], best, best > 0 ? items * 1e9 / best : 0,
+           (double)rset_length(workload->a) / workload->cardinality);
+}
+
+int main()
+{
+    static workload_t workload;
+    unsigned cardinality_count = sizeof(cardinalities) / sizeof(*cardinalities);
+    unsigned distribution_count = sizeof(distributions) /
+                                  sizeof(*distributions);
+    unsigned benchmark_count = sizeof(benchmarks) / sizeof(*benchmarks);
+
+    printf("benchmark,distribution,cardinality,type,ns_per_op,items_per_s,"
+           "bytes_per_item\n");
+    for (unsigned d = 0; d < distribution_count; d++) {
+        for (unsigned c = 0; c < cardinality_count; c++) {
+            workload_init(&workload, distributions[d], cardinalities[c]);
+            for (unsigned b = 0; b < benchmark_count; b++)
+                bench(&benchmarks[b], &workload);
+            workload_clear(&workload);
+        }
+    }
     return 0;
 }
@@ -0,0 +1,385 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "rbatch.h"
+
+const static unsigned chunks_per_thread = 16;
+const static size_t call_cost = 64;
+const static size_t cache_line = 64;
+
+/**
+ * The chunks a thread has left are the range [next, end), packed into one
+ * word so that the owner can take a chunk from the front and thieves can
+ * take half of them from the back with a single compare-and-swap. Each queue
+ * has a cache line to itself.
+ */
+
+typedef struct {
+    uint64_t range;
+    rbatch_pool_t *pool;
+    unsigned index;
+} __attribute__ ((aligned(64))) rbatch_queue_t;
+
+typedef bool (*rbatch_operation_t)(const rset_t *, const rset_t *, rset_t *);
+
+const static rbatch_operation_t operations[] = {
+    rset_intersection, rset_union, rset_difference, rset_xor
+};
+
+static uint64_t rbatch_range(uint32_t next, uint32_t end)
+{
+    return (uint64_t)end << 32 | next;
+}
+
+static bool rbatch_take(rbatch_queue_t *queue, size_t *chunk)
+{
+    uint64_t range = __atomic_load_n(&queue->range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t next = (uint32_t)range, end = range >> 32;
+        if (next >= end)
+            return false;
+        if (__atomic_compare_exchange_n(&queue->range, &range,
+                                        rbatch_range(next + 1, end), true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *chunk = next;
+            return true;
+        }
+    }
+}
+
+static bool rbatch_steal(rbatch_pool_t *pool, unsigned thief, size_t *chunk)
+{
+    // Take the back half of the first non-empty queue, keep the first chunk
+    // of it and make the rest the thief's queue, where it can be stolen in
+    // turn. The thief's queue is empty, so nobody else writes to it.
+    rbatch_queue_t *queues = pool->queues;
+    for (unsigned i = 1; i < pool->thread_count; i++) {
+        rbatch_queue_t *victim = &queues[(thief + i) % pool->thread_count];
+        uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+        for (;;) {
+            uint32_t next = (uint32_t)range, end = range >> 32;
+            if (next >= end)
+                break;
+            uint32_t middle = end - (end - next + 1) / 2;
+            if (__atomic_compare_exchange_n(&victim->range, &range,
+                                            rbatch_range(next, middle), true,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&queues[thief].range,
+                                 rbatch_range(middle + 1, end),
+                                 __ATOMIC_RELEASE);
+                *chunk = middle;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void rbatch_work(rbatch_pool_t *pool, unsigned index)
+{
+    rbatch_queue_t *queue = &((rbatch_queue_t *)pool->queues)[index];
+    bool failed = false;
+    size_t chunk;
+    while (rbatch_take(queue, &chunk) || rbatch_steal(pool, index, &chunk))
+        for (size_t i = pool->chunks[chunk]; i < pool->chunks[chunk + 1]; i++)
+            failed |= !pool->run(pool->context, i);
+    if (failed)
+        __atomic_store_n(&pool->failed, true, __ATOMIC_RELAXED);
+}
+
+static void *rbatch_thread(void *argument)
+{
+    rbatch_queue_t *queue = argument;
+    rbatch_pool_t *pool = queue->pool;
+    unsigned generation = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == generation && !pool->stopping)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->stopping)
+            break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        rbatch_work(pool, queue->index);
+        pthread_mutex_lock(&pool->lock);
+        if (!--pool->active)
+            pthread_cond_signal(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+rbatch_pool_t *rbatch_pool_new(unsigned threads)
+{
+    if (!threads) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? online : 1;
+    }
+    rbatch_pool_t *pool = malloc(sizeof(rbatch_pool_t));
+    if (!pool)
+        return NULL;
+    pool->threads = malloc(sizeof(pthread_t) * threads);
+    if (!pool->threads ||
+        posix_memalign(&pool->queues, cache_line,
+                       sizeof(rbatch_queue_t) * threads)) {
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->submit, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->generation = 0;
+    pool->active = 0;
+    pool->stopping = false;
+
+    // The submitting thread works on the first queue.
+    rbatch_queue_t *queues = pool->queues;
+    pool->thread_count = 1;
+    for (unsigned i = 0; i < threads; i++) {
+        queues[i].range = 0;
+        queues[i].pool = pool;
+        queues[i].index = i;
+    }
+    for (unsigned i = 1; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, rbatch_thread,
+                           &queues[i])) {
+            rbatch_pool_free(pool);
+            return NULL;
+        }
+        pool->thread_count++;
+    }
+    return pool;
+}
+
+void rbatch_pool_free(rbatch_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned i = 1; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->submit);
+    free(pool->queues);
+    free(pool->threads);
+    free(pool);
+}
+
+static size_t rbatch_cost(size_t (*cost)(void *context, size_t index),
+                          void *context, size_t index)
+{
+    // Every call has a fixed cost on top of its estimate, so that chunks of
+    // tiny jobs don't grow without bound.
+    return call_cost + (cost ? cost(context, index) : 0);
+}
+
+static unsigned rbatch_split(rbatch_pool_t *pool, size_t count,
+                             size_t (*cost)(void *context, size_t index),
+                             void *context, size_t *chunks)
+{
+    // Cut a chunk whenever its cost reaches 1/chunks_per_thread of a
+    // thread's share, so that there are at most chunks_per_thread chunks per
+    // thread (plus one for the remainder).
+    size_t total = 0, limit = pool->thread_count * chunks_per_thread;
+    for (size_t i = 0; i < count; i++)
+        total += rbatch_cost(cost, context, i);
+    size_t target = (total + limit - 1) / limit, sum = 0;
+    unsigned chunk_count = 0;
+    chunks[0] = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += rbatch_cost(cost, context, i);
+        if (sum >= target) {
+            chunks[++chunk_count] = i + 1;
+            sum = 0;
+        }
+    }
+    if (chunks[chunk_count] != count)
+        chunks[++chunk_count] = count;
+    return chunk_count;
+}
+
+bool rbatch_run(rbatch_pool_t *pool, size_t count,
+                bool (*run)(void *context, size_t index),
+                size_t (*cost)(void *context, size_t index), void *context)
+{
+    // Make the calls one at a time if there's nothing to spread, or if
+    // there's no memory to split the batch, since every call must be made.
+    size_t *chunks = NULL;
+    if (pool->thread_count > 1 && count > 1)
+        chunks = malloc(sizeof(size_t) *
+                        (pool->thread_count * chunks_per_thread + 2));
+    if (!chunks) {
+        bool success = true;
+        for (size_t i = 0; i < count; i++)
+            success &= run(context, i);
+        return success;
+    }
+    unsigned chunk_count = rbatch_split(pool, count, cost, context, chunks);
+
+    pthread_mutex_lock(&pool->submit);
+    pthread_mutex_lock(&pool->lock);
+    pool->run = run;
+    pool->context = context;
+    pool->chunks = chunks;
+    pool->failed = false;
+    rbatch_queue_t *queues = pool->queues;
+    for (unsigned i = 0; i < pool->thread_count; i++)
+        __atomic_store_n(&queues[i].range,
+                         rbatch_range(chunk_count * i / pool->thread_count,
+                                      chunk_count * (i + 1) /
+                                      pool->thread_count),
+                         __ATOMIC_RELAXED);
+    pool->generation++;
+    pool->active = pool->thread_count - 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    rbatch_work(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    bool success = !pool->failed;
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->submit);
+    free(chunks);
+    return success;
+}
+
+typedef struct {
+    rbatch_operation_t operation;
+    const rbatch_job_t *jobs;
+} rbatch_apply_t;
+
+static bool rbatch_apply_job(void *context, size_t index)
+{
+    rbatch_apply_t *apply = context;
+    const rbatch_job_t *job = &apply->jobs[index];
+    return apply->operation(job->a, job->b, job->result);
+}
+
+static size_t rbatch_job_cost(void *context, size_t index)
+{
+    // Set operations are roughly linear in the size of their inputs, which
+    // is about 8KB for a bitset and two bytes per item for an array.
+    const rbatch_job_t *job = &((rbatch_apply_t *)context)->jobs[index];
+    return rset_length(job->a) + rset_length(job->b);
+}
+
+bool rbatch_apply(rbatch_pool_t *pool, rbatch_op_t op,
+                  const rbatch_job_t *jobs, size_t count)
+{
+    rbatch_apply_t apply = { operations[op], jobs };
+    return rbatch_run(pool, count, rbatch_apply_job, rbatch_job_cost, &apply);
+}
+
+typedef struct {
+    rbatch_operation_t operation;
+    const rset_t *set;
+    const rset_t **sets;
+    rset_t **results;
+    unsigned *cardinalities;
+} rbatch_one_t;
+
+static bool rbatch_apply_one_job(void *context, size_t index)
+{
+    rbatch_one_t *one = context;
+    return one->operation(one->set, one->sets[index], one->results[index]);
+}
+
+static bool rbatch_cardinality_job(void *context, size_t index)
+{
+    rbatch_one_t *one = context;
+    one->cardinalities[index] = rset_intersection_cardinality(one->set,
+                                                              one->sets[index]);
+    return true;
+}
+
+static size_t rbatch_one_cost(void *context, size_t index)
+{
+    rbatch_one_t *one = context;
+    return rset_length(one->set) + rset_length(one->sets[index]);
+}
+
+bool rbatch_apply_one(rbatch_pool_t *pool, rbatch_op_t op, const rset_t *set,
+                      const rset_t **sets, rset_t **results, size_t count)
+{
+    rbatch_one_t one = { operations[op], set, sets, results, NULL };
+    return rbatch_run(pool, count, rbatch_apply_one_job, rbatch_one_cost,
+                      &one);
+}
+
+void rbatch_intersection_cardinality(rbatch_pool_t *pool, const rset_t *set,
+                                     const rset_t **sets,
+                                     unsigned *cardinalities, size_t count)
+{
+    rbatch_one_t one = { NULL, set, sets, NULL, cardinalities };
+    rbatch_run(pool, count, rbatch_cardinality_job, rbatch_one_cost, &one);
+}
+
+typedef struct {
+    const rset_t **sets;
+    size_t *bounds;
+    rset_t *partials;
+} rbatch_union_t;
+
+static bool rbatch_union_job(void *context, size_t index)
+{
+    rbatch_union_t *union_ = context;
+    size_t first = union_->bounds[index];
+    return rset_union_many(union_->sets + first,
+                           union_->bounds[index + 1] - first,
+                           &union_->partials[index]);
+}
+
+bool rbatch_union_many(rbatch_pool_t *pool, const rset_t **sets, size_t n,
+                       rset_t *out)
+{
+    // Split the sets into one group per thread, of about the same total
+    // size, union each group into a partial result and union the partial
+    // results.
+    size_t groups = pool->thread_count < n / 2 ? pool->thread_count : n / 2;
+    if (groups < 2)
+        return rset_union_many(sets, n, out);
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += rset_length(sets[i]);
+    size_t *bounds = malloc(sizeof(size_t) * (groups + 1));
+    rset_t *partials = malloc(sizeof(rset_t) * groups);
+    const rset_t **results = malloc(sizeof(rset_t *) * groups);
+    size_t initialized = 0;
+    bool success = bounds && partials && results;
+    while (success && initialized < groups) {
+        results[initialized] = &partials[initialized];
+        success = rset_init(&partials[initialized]);
+        initialized += success;
+    }
+    if (success) {
+        size_t group = 1, sum = 0;
+        bounds[0] = 0;
+        for (size_t i = 0; i < n && group < groups; i++) {
+            sum += rset_length(sets[i]);
+            if (sum * groups >= total * group)
+                bounds[group++] = i + 1;
+        }
+        while (group <= groups)
+            bounds[group++] = n;
+        rbatch_union_t union_ = { sets, bounds, partials };
+        success = rbatch_run(pool, groups, rbatch_union_job, NULL, &union_) &&
+                  rset_union_many(results, groups, out);
+    }
+    for (size_t i = 0; i < initialized; i++)
+        rset_destroy(&partials[i]);
+    free(results);
+    free(partials);
+    free(bounds);
+    return success;
+}
@@ -0,0 +1,138 @@
+#ifndef rbatch_H_
+#define rbatch_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "rset.h"
+
+/**
+ * Batches of independent set operations spread over a pool of threads.
+ *
+ * A batch is split into chunks of consecutive jobs of roughly equal cost,
+ * where the cost of a job is estimated from the size of its sets, so that a
+ * chunk holds a few large bitset operations or a great many small array
+ * operations. Each thread starts with an equal share of the chunks and, once
+ * it runs out, steals half of the chunks that another thread has left.
+ *
+ * The thread that submits a batch works on it too, and returns once the
+ * whole batch is done. Batches submitted to the same pool from several
+ * threads run one after the other. The allocator (see `rset_set_allocator`)
+ * is called from every thread of the pool, so it must be thread-safe.
+ */
+
+typedef struct {
+    pthread_t *threads;
+    void *queues;
+    unsigned thread_count;
+    pthread_mutex_t submit;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    unsigned generation;
+    unsigned active;
+    bool stopping;
+    bool (*run)(void *context, size_t index);
+    void *context;
+    size_t *chunks;
+    bool failed;
+} rbatch_pool_t;
+
+typedef enum {
+    RBATCH_INTERSECTION,
+    RBATCH_UNION,
+    RBATCH_DIFFERENCE,
+    RBATCH_XOR
+} rbatch_op_t;
+
+/**
+ * A binary operation on two sets, e.g. `rset_intersection(a, b, result)`.
+ * The result must not be an input of any other job in the batch.
+ */
+
+typedef struct {
+    const rset_t *a;
+    const rset_t *b;
+    rset_t *result;
+} rbatch_job_t;
+
+/**
+ * Create a pool with the specified number of threads, including the thread
+ * that submits each batch, or one per online CPU if `threads` is 0.
+ *
+ * Returns NULL if the threads can't be created.
+ */
+
+rbatch_pool_t *rbatch_pool_new(unsigned threads);
+
+/**
+ * Stop the threads and free the pool. No batch may be running.
+ */
+
+void rbatch_pool_free(rbatch_pool_t *pool);
+
+/**
+ * Call `run(context, i)` for every `i` below `count`, spread over the pool.
+ * `cost(context, i)` estimates the relative cost of each call, e.g. in
+ * bytes touched; if `cost` is NULL every call is assumed to cost the same.
+ * `run` must not submit another batch to the same pool.
+ *
+ * Returns true if every call returned true and false otherwise. Every call
+ * is made either way.
+ */
+
+bool rbatch_run(rbatch_pool_t *pool, size_t count,
+                bool (*run)(void *context, size_t index),
+                size_t (*cost)(void *context, size_t index), void *context);
+
+/**
+ * Apply an operation to each job, i.e. `jobs[i].result = jobs[i].a op
+ * jobs[i].b`.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rbatch_apply(rbatch_pool_t *pool, rbatch_op_t op,
+                  const rbatch_job_t *jobs, size_t count);
+
+/**
+ * Apply an operation to a set and each of many sets, i.e.
+ * `results[i] = set op sets[i]`.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rbatch_apply_one(rbatch_pool_t *pool, rbatch_op_t op, const rset_t *set,
+                      const rset_t **sets, rset_t **results, size_t count);
+
+/**
+ * Compute the cardinality of the intersection of a set and each of many
+ * sets, i.e. `cardinalities[i] = rset_intersection_cardinality(set,
+ * sets[i])`.
+ */
+
+void rbatch_intersection_cardinality(rbatch_pool_t *pool, const rset_t *set,
+                                     const rset_t **sets,
+                                     unsigned *cardinalities, size_t count);
+
+/**
+ * Union many sets, like `rset_union_many`, by having each thread union a
+ * share of the sets and then unioning the partial results.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rbatch_union_many(rbatch_pool_t *pool, const rset_t **sets, size_t n,
+                       rset_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,620 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "rbitmap.h"
+
+#define NOINLINE __attribute__ ((noinline))
+#define UNLIKELY(x) __builtin_expect((x), 0)
+#define MAX(a, b) ((a > b) ? (a) : (b))
+#define MIN(a, b) ((a < b) ? (a) : (b))
+
+const static unsigned default_size = 4;
+const static unsigned growth_factor = 2;
+
+const static unsigned max_keys = 1 << 16;
+
+const static uint32_t magic = 0x504D4252; // "RBMP"
+const static unsigned header_size = 8;
+const static unsigned entry_size = 8;
+
+static inline uint16_t rbitmap_high(uint32_t item)
+{
+    return item >> 16;
+}
+
+static inline uint16_t rbitmap_low(uint32_t item)
+{
+    return item & 0xFFFF;
+}
+
+static bool rbitmap_init(rbitmap_t *bitmap, unsigned size)
+{
+    size = MAX(size, default_size);
+    bitmap->keys = malloc(sizeof(uint16_t) * size);
+    // The sets are zeroed, so that any set a batch didn't get to is NULL.
+    bitmap->sets = calloc(size, sizeof(rset_t *));
+    if (!bitmap->keys || !bitmap->sets) {
+        free(bitmap->keys);
+        free(bitmap->sets);
+        return false;
+    }
+    bitmap->count = 0;
+    bitmap->size = size;
+    return true;
+}
+
+static void rbitmap_clear(rbitmap_t *bitmap)
+{
+    for (unsigned i = 0; i < bitmap->count; i++)
+        rset_free(bitmap->sets[i]);
+    free(bitmap->keys);
+    free(bitmap->sets);
+}
+
+static void rbitmap_replace(rbitmap_t *bitmap, rbitmap_t *replacement)
+{
+    // Results are built in a separate bitmap and then swapped in, which
+    // allows the result to alias one of the operands.
+    rbitmap_clear(bitmap);
+    *bitmap = *replacement;
+}
+
+rbitmap_t *rbitmap_new()
+{
+    rbitmap_t *bitmap = malloc(sizeof(rbitmap_t));
+    if (!bitmap)
+        return NULL;
+    if (!rbitmap_init(bitmap, default_size)) {
+        free(bitmap);
+        return NULL;
+    }
+    return bitmap;
+}
+
+void rbitmap_free(rbitmap_t *bitmap)
+{
+    rbitmap_clear(bitmap);
+    free(bitmap);
+}
+
+static bool rbitmap_grow_to(rbitmap_t *bitmap, unsigned size)
+{
+    if (bitmap->size >= size)
+        return true;
+    uint16_t *keys = realloc(bitmap->keys, sizeof(uint16_t) * size);
+    if (!keys)
+        return false;
+    bitmap->keys = keys;
+    rset_t **sets = realloc(bitmap->sets, sizeof(rset_t *) * size);
+    if (!sets)
+        return false;
+    bitmap->sets = sets;
+    bitmap->size = size;
+    return true;
+}
+
+static bool NOINLINE rbitmap_grow(rbitmap_t *bitmap)
+{
+    unsigned size = bitmap->size * growth_factor;
+    if (size > max_keys)
+        size = max_keys;
+    return rbitmap_grow_to(bitmap, size);
+}
+
+static int rbitmap_find(const rbitmap_t *bitmap, uint16_t key)
+{
+    // Returns the index of the key, or -(insertion point + 1) if the key
+    // isn't present. Keys are usually added in ascending order, so check
+    // the last key before searching.
+    int first = 0, last = (int)bitmap->count - 1;
+    if (last < 0 || bitmap->keys[last] < key)
+        return -(last + 2);
+    while (first <= last) {
+        int middle = (first + last) / 2;
+        if (bitmap->keys[middle] == key)
+            return middle;
+        if (bitmap->keys[middle] < key)
+            first = middle + 1;
+        else
+            last = middle - 1;
+    }
+    return -(first + 1);
+}
+
+static bool rbitmap_insert(rbitmap_t *bitmap, unsigned index, uint16_t key,
+                           rset_t *set)
+{
+    if (UNLIKELY(bitmap->count == bitmap->size && !rbitmap_grow(bitmap)))
+        return false;
+    if (index < bitmap->count) {
+        memmove(bitmap->keys + index + 1, bitmap->keys + index,
+                (bitmap->count - index) * sizeof(uint16_t));
+        memmove(bitmap->sets + index + 1, bitmap->sets + index,
+                (bitmap->count - index) * sizeof(rset_t *));
+    }
+    bitmap->keys[index] = key;
+    bitmap->sets[index] = set;
+    bitmap->count++;
+    return true;
+}
+
+static bool rbitmap_append(rbitmap_t *bitmap, uint16_t key, rset_t *set)
+{
+    return rbitmap_insert(bitmap, bitmap->count, key, set);
+}
+
+uint64_t rbitmap_cardinality(const rbitmap_t *bitmap)
+{
+    uint64_t cardinality = 0;
+    for (unsigned i = 0; i < bitmap->count; i++)
+        cardinality += rset_cardinality(bitmap->sets[i]);
+    return cardinality;
+}
+
+bool rbitmap_add(rbitmap_t *bitmap, uint32_t item)
+{
+    int index = rbitmap_find(bitmap, rbitmap_high(item));
+    if (index >= 0)
+        return rset_add(bitmap->sets[index], rbitmap_low(item));
+    rset_t *set = rset_new();
+    if (!set)
+        return false;
+    if (!rset_add(set, rbitmap_low(item)) ||
+        !rbitmap_insert(bitmap, -index - 1, rbitmap_high(item), set)) {
+        rset_free(set);
+        return false;
+    }
+    return true;
+}
+
+bool rbitmap_contains(const rbitmap_t *bitmap, uint32_t item)
+{
+    int index = rbitmap_find(bitmap, rbitmap_high(item));
+    return index >= 0 && rset_contains(bitmap->sets[index], rbitmap_low(item));
+}
+
+uint64_t rbitmap_to_array(const rbitmap_t *bitmap, uint32_t *out)
+{
+    uint64_t count = 0;
+    for (unsigned i = 0; i < bitmap->count; i++)
+        count += rset_to_array32(bitmap->sets[i],
+                                 (uint32_t)bitmap->keys[i] << 16, out + count);
+    return count;
+}
+
+bool rbitmap_equals(const rbitmap_t *bitmap, const rbitmap_t *comparison)
+{
+    if (bitmap->count != comparison->count)
+        return false;
+    if (memcmp(bitmap->keys, comparison->keys,
+               bitmap->count * sizeof(uint16_t)))
+        return false;
+    for (unsigned i = 0; i < bitmap->count; i++)
+        if (!rset_equals(bitmap->sets[i], comparison->sets[i]))
+            return false;
+    return true;
+}
+
+bool rbitmap_truncate(rbitmap_t *bitmap)
+{
+    for (unsigned i = 0; i < bitmap->count; i++)
+        rset_free(bitmap->sets[i]);
+    bitmap->count = 0;
+    return true;
+}
+
+rbitmap_t *rbitmap_copy(const rbitmap_t *bitmap)
+{
+    rbitmap_t *copy = malloc(sizeof(rbitmap_t));
+    if (!copy)
+        return NULL;
+    if (!rbitmap_init(copy, bitmap->count)) {
+        free(copy);
+        return NULL;
+    }
+    for (unsigned i = 0; i < bitmap->count; i++) {
+        rset_t *set = rset_copy(bitmap->sets[i]);
+        if (!set) {
+            rbitmap_free(copy);
+            return NULL;
+        }
+        rbitmap_append(copy, bitmap->keys[i], set);
+    }
+    return copy;
+}
+
+bool rbitmap_invert(const rbitmap_t *bitmap, rbitmap_t *result)
+{
+    // Keys that aren't present in the bitmap become full containers, and
+    // keys that are present have their container inverted.
+    rbitmap_t inverted;
+    if (!rbitmap_init(&inverted, max_keys - bitmap->count))
+        return false;
+    for (unsigned key = 0, i = 0; key < max_keys; key++) {
+        rset_t *set = rset_new();
+        if (!set)
+            goto error;
+        if (i < bitmap->count && bitmap->keys[i] == key) {
+            if (!rset_invert(bitmap->sets[i++], set)) {
+                rset_free(set);
+                goto error;
+            }
+            if (!rset_cardinality(set)) {
+                rset_free(set);
+                continue;
+            }
+        } else {
+            rset_fill(set);
+        }
+        if (!rbitmap_append(&inverted, key, set)) {
+            rset_free(set);
+            goto error;
+        }
+    }
+    rbitmap_replace(result, &inverted);
+    return true;
+error:
+    rbitmap_clear(&inverted);
+    return false;
+}
+
+static bool rbitmap_run(rbatch_pool_t *pool, size_t count,
+                        bool (*run)(void *context, size_t index),
+                        size_t (*cost)(void *context, size_t index),
+                        void *context)
+{
+    // Containers are independent of each other, so every whole-bitmap
+    // operation is a loop over containers that can be handed to a pool.
+    if (pool)
+        return rbatch_run(pool, count, run, cost, context);
+    bool success = true;
+    for (size_t i = 0; i < count; i++)
+        success &= run(context, i);
+    return success;
+}
+
+typedef bool (*rbitmap_operation_t)(const rset_t *, const rset_t *, rset_t *);
+
+typedef struct {
+    rbitmap_operation_t operation;
+    const rset_t **a;
+    const rset_t **b;
+    rset_t **sets;
+    uint64_t cardinality;
+} rbitmap_merge_t;
+
+static unsigned rbitmap_match(const rbitmap_t *a, const rbitmap_t *b,
+                              bool unmatched, uint16_t *keys,
+                              rbitmap_merge_t *merge)
+{
+    // Pair up the containers of the two bitmaps by key. If `unmatched` is
+    // set, containers whose key is only in one of the bitmaps are paired with
+    // NULL, otherwise they're skipped.
+    unsigned count = 0, i = 0, j = 0;
+    while (i < a->count || j < b->count) {
+        const rset_t *set, *other = NULL;
+        uint16_t key;
+        if (j == b->count || (i < a->count && a->keys[i] < b->keys[j])) {
+            key = a->keys[i];
+            set = a->sets[i++];
+        } else if (i == a->count || b->keys[j] < a->keys[i]) {
+            key = b->keys[j];
+            set = b->sets[j++];
+        } else {
+            key = a->keys[i];
+            set = a->sets[i++];
+            other = b->sets[j++];
+        }
+        if (!other && !unmatched)
+            continue;
+        keys[count] = key;
+        merge->a[count] = set;
+        merge->b[count++] = other;
+    }
+    return count;
+}
+
+static bool rbitmap_merge_job(void *context, size_t index)
+{
+    rbitmap_merge_t *merge = context;
+    const rset_t *a = merge->a[index], *b = merge->b[index];
+    rset_t *set = b ? rset_new() : rset_copy(a);
+    merge->sets[index] = set;
+    return set && (!b || merge->operation(a, b, set));
+}
+
+static bool rbitmap_cardinality_job(void *context, size_t index)
+{
+    rbitmap_merge_t *merge = context;
+    __atomic_add_fetch(&merge->cardinality,
+                       rset_intersection_cardinality(merge->a[index],
+                                                     merge->b[index]),
+                       __ATOMIC_RELAXED);
+    return true;
+}
+
+static size_t rbitmap_merge_cost(void *context, size_t index)
+{
+    rbitmap_merge_t *merge = context;
+    const rset_t *b = merge->b[index];
+    return rset_length(merge->a[index]) + (b ? rset_length(b) : 0);
+}
+
+static bool rbitmap_merge(const rbitmap_t *a, const rbitmap_t *b,
+                          rbitmap_t *result, rbitmap_operation_t operation,
+                          bool unmatched, rbatch_pool_t *pool)
+{
+    // Match up the keys first so that each container of the result can be
+    // computed on its own, and then drop the containers that came out empty.
+    unsigned size = unmatched ? MIN(a->count + b->count, max_keys) :
+                                MIN(a->count, b->count);
+    rbitmap_t merged;
+    const rset_t **sources = malloc(sizeof(rset_t *) * 2 * MAX(size, 1));
+    if (!sources || !rbitmap_init(&merged, size)) {
+        free(sources);
+        return false;
+    }
+    rbitmap_merge_t merge = { operation, sources, sources + size, merged.sets,
+                              0 };
+    unsigned count = rbitmap_match(a, b, unmatched, merged.keys, &merge);
+    bool success = rbitmap_run(pool, count, rbitmap_merge_job,
+                               rbitmap_merge_cost, &merge);
+    free(sources);
+    for (unsigned i = 0; i < count; i++) {
+        rset_t *set = merged.sets[i];
+        if (success && rset_cardinality(set)) {
+            merged.keys[merged.count] = merged.keys[i];
+            merged.sets[merged.count++] = set;
+        } else if (set) {
+            rset_free(set);
+        }
+    }
+    if (!success) {
+        rbitmap_clear(&merged);
+        return false;
+    }
+    rbitmap_replace(result, &merged);
+    return true;
+}
+
+bool rbitmap_intersection(const rbitmap_t *a, const rbitmap_t *b,
+                          rbitmap_t *result)
+{
+    return rbitmap_merge(a, b, result, rset_intersection, false, NULL);
+}
+
+bool rbitmap_intersection_parallel(const rbitmap_t *a, const rbitmap_t *b,
+                                   rbitmap_t *result, rbatch_pool_t *pool)
+{
+    return rbitmap_merge(a, b, result, rset_intersection, false, pool);
+}
+
+bool rbitmap_union(const rbitmap_t *a, const rbitmap_t *b, rbitmap_t *result)
+{
+    return rbitmap_merge(a, b, result, rset_union, true, NULL);
+}
+
+bool rbitmap_union_parallel(const rbitmap_t *a, const rbitmap_t *b,
+                            rbitmap_t *result, rbatch_pool_t *pool)
+{
+    return rbitmap_merge(a, b, result, rset_union, true, pool);
+}
+
+static uint64_t rbitmap_count_intersection(const rbitmap_t *a,
+                                           const rbitmap_t *b,
+                                           rbatch_pool_t *pool)
+{
+    unsigned size = MIN(a->count, b->count);
+    const rset_t **sources = malloc(sizeof(rset_t *) * 2 * MAX(size, 1));
+    uint16_t *keys = malloc(sizeof(uint16_t) * MAX(size, 1));
+    rbitmap_merge_t merge = { NULL, sources, sources + size, NULL, 0 };
+    if (!sources || !keys ||
+        !rbitmap_run(pool, rbitmap_match(a, b, false, keys, &merge),
+                     rbitmap_cardinality_job, rbitmap_merge_cost, &merge)) {
+        // Fall back to counting a pair at a time.
+        merge.cardinality = 0;
+        for (unsigned i = 0, j = 0; i < a->count && j < b->count;) {
+            if (a->keys[i] < b->keys[j])
+                i++;
+            else if (b->keys[j] < a->keys[i])
+                j++;
+            else
+                merge.cardinality +=
+                    rset_intersection_cardinality(a->sets[i++], b->sets[j++]);
+        }
+    }
+    free(sources);
+    free(keys);
+    return merge.cardinality;
+}
+
+uint64_t rbitmap_intersection_cardinality(const rbitmap_t *a,
+                                          const rbitmap_t *b)
+{
+    return rbitmap_count_intersection(a, b, NULL);
+}
+
+uint64_t rbitmap_intersection_cardinality_parallel(const rbitmap_t *a,
+                                                   const rbitmap_t *b,
+                                                   rbatch_pool_t *pool)
+{
+    return rbitmap_count_intersection(a, b, pool);
+}
+
+static void rbitmap_store32(unsigned char *out, uint32_t value)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+}
+
+static uint32_t rbitmap_load32(const unsigned char *in)
+{
+    return in[0] | in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+typedef struct {
+    rset_t **sets;
+    uint64_t *offsets;
+    unsigned char *out;
+    const unsigned char *in;
+    unsigned flags;
+} rbitmap_serial_t;
+
+static size_t rbitmap_serial_cost(void *context, size_t index)
+{
+    return rset_length(((rbitmap_serial_t *)context)->sets[index]);
+}
+
+static bool rbitmap_length_job(void *context, size_t index)
+{
+    // Store each length one ahead, where the prefix sum turns it into the
+    // offset of the next container.
+    rbitmap_serial_t *serial = context;
+    serial->offsets[index + 1] = rset_serialized_length(serial->sets[index],
+                                                        serial->flags);
+    return true;
+}
+
+static bool rbitmap_serialize_job(void *context, size_t index)
+{
+    rbitmap_serial_t *serial = context;
+    rset_serialize(serial->sets[index], serial->out + serial->offsets[index],
+                   serial->flags);
+    return true;
+}
+
+uint64_t rbitmap_serialized_length(const rbitmap_t *bitmap, unsigned flags)
+{
+    uint64_t length = header_size + entry_size * bitmap->count;
+    for (unsigned i = 0; i < bitmap->count; i++)
+        length += rset_serialized_length(bitmap->sets[i], flags);
+    return length;
+}
+
+uint64_t rbitmap_serialize(const rbitmap_t *bitmap, void *out, unsigned flags)
+{
+    unsigned char *data = out, *entry = data + header_size;
+    rbitmap_store32(data, magic);
+    rbitmap_store32(data + 4, bitmap->count);
+    uint64_t length = header_size + entry_size * bitmap->count;
+    for (unsigned i = 0; i < bitmap->count; i++, entry += entry_size) {
+        unsigned set_length = rset_serialize(bitmap->sets[i], data + length,
+                                             flags);
+        rbitmap_store32(entry, bitmap->keys[i]);
+        rbitmap_store32(entry + 4, set_length);
+        length += set_length;
+    }
+    return length;
+}
+
+uint64_t rbitmap_serialize_parallel(const rbitmap_t *bitmap, void *out,
+                                    unsigned flags, rbatch_pool_t *pool)
+{
+    // Compute the length of every container first, so that their offsets
+    // are known and they can be serialized concurrently.
+    uint64_t *offsets = malloc(sizeof(uint64_t) * (bitmap->count + 1));
+    if (!offsets)
+        return 0;
+    rbitmap_serial_t serial = { bitmap->sets, offsets, out, NULL, flags };
+    if (!rbitmap_run(pool, bitmap->count, rbitmap_length_job,
+                     rbitmap_serial_cost, &serial)) {
+        free(offsets);
+        return 0;
+    }
+    unsigned char *entry = serial.out + header_size;
+    rbitmap_store32(serial.out, magic);
+    rbitmap_store32(serial.out + 4, bitmap->count);
+    offsets[0] = header_size + entry_size * bitmap->count;
+    for (unsigned i = 0; i < bitmap->count; i++, entry += entry_size) {
+        rbitmap_store32(entry, bitmap->keys[i]);
+        rbitmap_store32(entry + 4, offsets[i + 1]);
+        offsets[i + 1] += offsets[i];
+    }
+    uint64_t length = 0;
+    if (rbitmap_run(pool, bitmap->count, rbitmap_serialize_job,
+                    rbitmap_serial_cost, &serial))
+        length = offsets[bitmap->count];
+    free(offsets);
+    return length;
+}
+
+static bool rbitmap_import_job(void *context, size_t index)
+{
+    rbitmap_serial_t *serial = context;
+    uint64_t offset = serial->offsets[index];
+    rset_t *set = rset_import_checked(serial->in + offset,
+                                      serial->offsets[index + 1] - offset);
+    serial->sets[index] = set;
+    return set && rset_cardinality(set);
+}
+
+static size_t rbitmap_import_cost(void *context, size_t index)
+{
+    rbitmap_serial_t *serial = context;
+    return serial->offsets[index + 1] - serial->offsets[index];
+}
+
+static rbitmap_t *rbitmap_import_from(const void *buffer, uint64_t length,
+                                      rbatch_pool_t *pool)
+{
+    const unsigned char *data = buffer;
+    if (length < header_size || rbitmap_load32(data) != magic)
+        return NULL;
+    uint32_t count = rbitmap_load32(data + 4);
+    if (count > max_keys || (length - header_size) / entry_size < count)
+        return NULL;
+    rbitmap_t *bitmap = malloc(sizeof(rbitmap_t));
+    uint64_t *offsets = malloc(sizeof(uint64_t) * (count + 1));
+    if (!bitmap || !offsets || !rbitmap_init(bitmap, count)) {
+        free(bitmap);
+        free(offsets);
+        return NULL;
+    }
+
+    // Check the directory before importing any containers: keys must be
+    // ascending and the containers must exactly fill the rest of the buffer.
+    const unsigned char *entry = data + header_size;
+    offsets[0] = header_size + entry_size * count;
+    bool success = true;
+    for (uint32_t i = 0; success && i < count; i++, entry += entry_size) {
+        uint32_t key = rbitmap_load32(entry);
+        uint32_t set_length = rbitmap_load32(entry + 4);
+        success = key < max_keys && (!i || key > bitmap->keys[i - 1]) &&
+                  set_length <= length - offsets[i];
+        bitmap->keys[i] = key;
+        offsets[i + 1] = offsets[i] + set_length;
+    }
+    if (success && offsets[count] == length) {
+        // Containers must not be empty, since an empty container would
+        // have had its key removed.
+        rbitmap_serial_t serial = { bitmap->sets, offsets, NULL, data, 0 };
+        success = rbitmap_run(pool, count, rbitmap_import_job,
+                              rbitmap_import_cost, &serial);
+        bitmap->count = count;
+    } else {
+        success = false;
+    }
+    free(offsets);
+    if (!success) {
+        for (unsigned i = 0; i < bitmap->count; i++)
+            if (bitmap->sets[i])
+                rset_free(bitmap->sets[i]);
+        bitmap->count = 0;
+        rbitmap_free(bitmap);
+        return NULL;
+    }
+    return bitmap;
+}
+
+rbitmap_t *rbitmap_import(const void *buffer, uint64_t length)
+{
+    return rbitmap_import_from(buffer, length, NULL);
+}
+
+rbitmap_t *rbitmap_import_parallel(const void *buffer, uint64_t length,
+                                   rbatch_pool_t *pool)
+{
+    return rbitmap_import_from(buffer, length, pool);
+}
@@ -0,0 +1,212 @@
+#ifndef rbitmap_H_
+#define rbitmap_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "rset.h"
+#include "rbatch.h"
+
+/**
+ * A 32-bit roaring bitmap built on top of `rset_t` containers.
+ *
+ * Items are partitioned by their high 16 bits. The high bits are stored in a
+ * sorted array of keys and each key points at an `rset_t` that holds the low
+ * 16 bits of every item in the partition:
+ *
+ *     keys   |  k0  |  k1  |  k2  | ...
+ *     sets   |  s0  |  s1  |  s2  | ...
+ *
+ * Lookups binary search the (small, contiguous) key array and then defer to
+ * the container. Containers are never empty; a key is removed as soon as its
+ * container would become empty.
+ *
+ * Containers for different keys are independent, so the whole-bitmap
+ * operations have `_parallel` variants that match up the keys first and then
+ * run the container operations on a thread pool (see rbatch.h).
+ */
+
+typedef struct {
+    uint16_t *keys;
+    rset_t **sets;
+    unsigned count;
+    unsigned size;
+} rbitmap_t;
+
+/**
+ * Create a new bitmap.
+ */
+
+rbitmap_t *rbitmap_new(void);
+
+/**
+ * Free the specified bitmap.
+ */
+
+void rbitmap_free(rbitmap_t *bitmap);
+
+/**
+ * Get the cardinality of the bitmap.
+ */
+
+uint64_t rbitmap_cardinality(const rbitmap_t *bitmap);
+
+/**
+ * Add an item to the bitmap.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rbitmap_add(rbitmap_t *bitmap, uint32_t item);
+
+/**
+ * Check if the bitmap contains an item.
+ */
+
+bool rbitmap_contains(const rbitmap_t *bitmap, uint32_t item);
+
+/**
+ * Write the items in the bitmap to `out` in ascending order. `out` must have
+ * room for `rbitmap_cardinality(bitmap)` items.
+ *
+ * Returns the number of items written.
+ */
+
+uint64_t rbitmap_to_array(const rbitmap_t *bitmap, uint32_t *out);
+
+/**
+ * Check if two bitmaps are equal.
+ */
+
+bool rbitmap_equals(const rbitmap_t *bitmap, const rbitmap_t *comparison);
+
+/**
+ * Invert the bitmap and place the result in the `result` bitmap.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rbitmap_invert(const rbitmap_t *bitmap, rbitmap_t *result);
+
+/**
+ * Calculate the intersection of two bitmaps and place the result in
+ * the `result` bitmap.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rbitmap_intersection(const rbitmap_t *a, const rbitmap_t *b,
+                          rbitmap_t *result);
+
+/**
+ * Like `rbitmap_intersection`, but with the containers intersected on a
+ * thread pool.
+ */
+
+bool rbitmap_intersection_parallel(const rbitmap_t *a, const rbitmap_t *b,
+                                   rbitmap_t *result, rbatch_pool_t *pool);
+
+/**
+ * Calculate the union of two bitmaps and place the result in the `result`
+ * bitmap.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rbitmap_union(const rbitmap_t *a, const rbitmap_t *b, rbitmap_t *result);
+
+/**
+ * Like `rbitmap_union`, but with the containers unioned on a thread pool.
+ */
+
+bool rbitmap_union_parallel(const rbitmap_t *a, const rbitmap_t *b,
+                            rbitmap_t *result, rbatch_pool_t *pool);
+
+/**
+ * Calculate the cardinality of the intersection of two bitmaps without
+ * building it.
+ */
+
+uint64_t rbitmap_intersection_cardinality(const rbitmap_t *a,
+                                          const rbitmap_t *b);
+
+/**
+ * Like `rbitmap_intersection_cardinality`, but with the containers counted
+ * on a thread pool.
+ */
+
+uint64_t rbitmap_intersection_cardinality_parallel(const rbitmap_t *a,
+                                                   const rbitmap_t *b,
+                                                   rbatch_pool_t *pool);
+
+/**
+ * Get the length in bytes of the serialized bitmap, for `rbitmap_serialize`.
+ */
+
+uint64_t rbitmap_serialized_length(const rbitmap_t *bitmap, unsigned flags);
+
+/**
+ * Serialize the bitmap to `out`, which must have room for
+ * `rbitmap_serialized_length(bitmap, flags)` bytes. `flags` are passed to
+ * `rset_serialize` for every container. Every field is little-endian:
+ *
+ *     | magic | count | key | length | ... | container | ... |
+ *
+ * The bitmap starts with the four bytes "RBMP" and the 32-bit number of
+ * containers, followed by the 32-bit key and the length in bytes of each
+ * container and then the containers in the format of `rset_serialize`.
+ *
+ * Returns the number of bytes written.
+ */
+
+uint64_t rbitmap_serialize(const rbitmap_t *bitmap, void *out, unsigned flags);
+
+/**
+ * Like `rbitmap_serialize`, but with the containers serialized on a thread
+ * pool.
+ *
+ * Returns the number of bytes written, or 0 if the operation failed.
+ */
+
+uint64_t rbitmap_serialize_parallel(const rbitmap_t *bitmap, void *out,
+                                    unsigned flags, rbatch_pool_t *pool);
+
+/**
+ * Create a bitmap from a buffer written by `rbitmap_serialize`. Every
+ * container is checked as by `rset_import_checked`.
+ *
+ * Returns NULL if the buffer isn't a valid bitmap or if memory couldn't be
+ * allocated.
+ */
+
+rbitmap_t *rbitmap_import(const void *buffer, uint64_t length);
+
+/**
+ * Like `rbitmap_import`, but with the containers imported on a thread pool.
+ */
+
+rbitmap_t *rbitmap_import_parallel(const void *buffer, uint64_t length,
+                                   rbatch_pool_t *pool);
+
+/**
+ * Truncate the bitmap.
+ */
+
+bool rbitmap_truncate(rbitmap_t *bitmap);
+
+/**
+ * Make a copy of the bitmap.
+ */
+
+rbitmap_t *rbitmap_copy(const rbitmap_t *bitmap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
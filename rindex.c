@@ -0,0 +1,215 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rindex.h"
+
+#define UNLIKELY(x) __builtin_expect((x), 0)
+
+const static unsigned default_size = 64;
+const static unsigned growth_factor = 2;
+
+const static uint32_t magic = 0x58444952; // "RIDX"
+const static uint32_t version = 1;
+const static unsigned header_size = 8;
+const static unsigned footer_size = 16;
+const static unsigned alignment = 8;
+
+typedef struct {
+    uint64_t directory;
+    uint32_t count;
+    uint32_t magic;
+} rindex_footer_t;
+
+static bool rindex_little_endian()
+{
+    // The sets are stored in their in-memory layout so that they can be
+    // viewed in place, which is only possible if the host is little-endian.
+    return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+}
+
+static void rindex_write(rindex_writer_t *writer, const void *data,
+                         size_t length)
+{
+    if (length && fwrite(data, 1, length, writer->file) != length)
+        writer->failed = true;
+    writer->offset += length;
+}
+
+static void rindex_pad(rindex_writer_t *writer)
+{
+    static const unsigned char zeros[8];
+    rindex_write(writer, zeros, -writer->offset % alignment);
+}
+
+rindex_writer_t *rindex_writer_open(const char *path)
+{
+    if (!rindex_little_endian())
+        return NULL;
+    rindex_writer_t *writer = malloc(sizeof(rindex_writer_t));
+    if (!writer)
+        return NULL;
+    writer->entries = malloc(sizeof(rindex_entry_t) * default_size);
+    writer->file = fopen(path, "wb");
+    if (!writer->entries || !writer->file) {
+        if (writer->file)
+            fclose(writer->file);
+        free(writer->entries);
+        free(writer);
+        return NULL;
+    }
+    writer->count = 0;
+    writer->size = default_size;
+    writer->offset = 0;
+    writer->failed = false;
+    uint32_t header[2] = { magic, version };
+    rindex_write(writer, header, header_size);
+    return writer;
+}
+
+static bool rindex_writer_grow(rindex_writer_t *writer)
+{
+    uint32_t size = writer->size * growth_factor;
+    rindex_entry_t *entries = realloc(writer->entries,
+                                      sizeof(rindex_entry_t) * size);
+    if (!entries)
+        return false;
+    writer->entries = entries;
+    writer->size = size;
+    return true;
+}
+
+bool rindex_writer_add(rindex_writer_t *writer, uint32_t key,
+                       const rset_t *set)
+{
+    if (writer->count && writer->entries[writer->count - 1].key >= key)
+        return false;
+    if (UNLIKELY(writer->count == writer->size && !rindex_writer_grow(writer)))
+        return false;
+    rindex_entry_t *entry = &writer->entries[writer->count];
+    entry->key = key;
+    entry->length = rset_length(set);
+    entry->offset = writer->offset;
+    rindex_write(writer, rset_export(set), entry->length);
+    rindex_pad(writer);
+    if (writer->failed)
+        return false;
+    writer->count++;
+    return true;
+}
+
+bool rindex_writer_close(rindex_writer_t *writer)
+{
+    rindex_footer_t footer = { writer->offset, writer->count, magic };
+    rindex_write(writer, writer->entries,
+                 sizeof(rindex_entry_t) * writer->count);
+    rindex_write(writer, &footer, footer_size);
+    bool ok = !writer->failed;
+    if (fclose(writer->file))
+        ok = false;
+    free(writer->entries);
+    free(writer);
+    return ok;
+}
+
+rindex_t *rindex_open(const char *path)
+{
+    if (!rindex_little_endian())
+        return NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat info;
+    if (fstat(fd, &info) ||
+        (size_t)info.st_size < header_size + footer_size) {
+        close(fd);
+        return NULL;
+    }
+    size_t length = info.st_size;
+    void *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    // Only the header, the footer and the bounds of the directory are
+    // checked here. Each set is checked when it's looked up.
+    const uint32_t *header = data;
+    rindex_footer_t footer;
+    memcpy(&footer, (const unsigned char *)data + length - footer_size,
+           footer_size);
+    uint64_t end = length - footer_size;
+    if (header[0] != magic || header[1] != version || footer.magic != magic ||
+        footer.directory < header_size || footer.directory % alignment ||
+        footer.directory > end ||
+        (end - footer.directory) / sizeof(rindex_entry_t) != footer.count ||
+        (end - footer.directory) % sizeof(rindex_entry_t))
+        goto error;
+    rindex_t *index = malloc(sizeof(rindex_t));
+    if (!index)
+        goto error;
+    index->data = data;
+    index->length = length;
+    index->entries = (const rindex_entry_t *)((const unsigned char *)data +
+                                              footer.directory);
+    index->count = footer.count;
+    return index;
+error:
+    munmap(data, length);
+    return NULL;
+}
+
+void rindex_close(rindex_t *index)
+{
+    munmap((void *)index->data, index->length);
+    free(index);
+}
+
+uint32_t rindex_count(const rindex_t *index)
+{
+    return index->count;
+}
+
+static const rset_t *rindex_view(const rindex_t *index,
+                                 const rindex_entry_t *entry,
+                                 rset_view_t *view)
+{
+    // The directory is the end of the set data. The file is untrusted, so
+    // besides staying within the data the set must pass the checks of
+    // `rset_view`, which validates the items as well as the header (e.g. that
+    // runs end before 65536).
+    uint64_t end = (const unsigned char *)index->entries - index->data;
+    if (entry->offset < header_size || entry->offset > end ||
+        entry->length > end - entry->offset)
+        return NULL;
+    return rset_view(view, index->data + entry->offset, entry->length);
+}
+
+const rset_t *rindex_get(const rindex_t *index, uint32_t key,
+                         rset_view_t *view)
+{
+    uint32_t first = 0, last = index->count;
+    while (first < last) {
+        uint32_t middle = first + (last - first) / 2;
+        if (index->entries[middle].key < key)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    if (first == index->count || index->entries[first].key != key)
+        return NULL;
+    return rindex_view(index, &index->entries[first], view);
+}
+
+const rset_t *rindex_get_at(const rindex_t *index, uint32_t position,
+                            uint32_t *key, rset_view_t *view)
+{
+    if (position >= index->count)
+        return NULL;
+    *key = index->entries[position].key;
+    return rindex_view(index, &index->entries[position], view);
+}
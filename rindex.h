@@ -0,0 +1,132 @@
+#ifndef rindex_H_
+#define rindex_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "rset.h"
+
+/**
+ * An on-disk index of sets keyed by a 32-bit id (e.g. a term id).
+ *
+ * The file is written once by a streaming writer and then opened with mmap.
+ * Sets are stored in the layout produced by `rset_export` and are accessed
+ * in place through `rset_view`, so opening an index only maps the file and
+ * a lookup only touches the pages of the directory and the set it returns.
+ * Every field is little-endian:
+ *
+ *     | magic | version | set | set | ... | directory | footer |
+ *
+ * The file starts with the four bytes "RIDX" and a 32-bit version (1). Each
+ * set starts on an 8-byte boundary. The directory is an array of entries
+ * sorted by key, and the footer holds the 64-bit offset of the directory,
+ * the 32-bit number of entries and the magic again.
+ *
+ * Indexes can only be written and opened on little-endian hosts.
+ */
+
+typedef struct {
+    uint32_t key;
+    uint32_t length;
+    uint64_t offset;
+} rindex_entry_t;
+
+typedef struct {
+    const unsigned char *data;
+    size_t length;
+    const rindex_entry_t *entries;
+    uint32_t count;
+} rindex_t;
+
+/**
+ * A writer only keeps the directory in memory; each set is written out as
+ * soon as it's added.
+ */
+
+typedef struct {
+    FILE *file;
+    rindex_entry_t *entries;
+    uint32_t count;
+    uint32_t size;
+    uint64_t offset;
+    bool failed;
+} rindex_writer_t;
+
+/**
+ * Create an index file at `path`, replacing any existing file.
+ *
+ * Returns NULL if the file can't be created.
+ */
+
+rindex_writer_t *rindex_writer_open(const char *path);
+
+/**
+ * Append a set to the index. Keys must be added in ascending order.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rindex_writer_add(rindex_writer_t *writer, uint32_t key,
+                       const rset_t *set);
+
+/**
+ * Write the directory, close the file and free the writer.
+ *
+ * Returns false if any write failed, in which case the file is incomplete.
+ */
+
+bool rindex_writer_close(rindex_writer_t *writer);
+
+/**
+ * Open an index file. The file is mapped rather than read.
+ *
+ * Returns NULL if the file can't be mapped or isn't a valid index.
+ */
+
+rindex_t *rindex_open(const char *path);
+
+/**
+ * Unmap the index. Views returned by the index become invalid.
+ */
+
+void rindex_close(rindex_t *index);
+
+/**
+ * Get the number of sets in the index.
+ */
+
+uint32_t rindex_count(const rindex_t *index);
+
+/**
+ * Look up the set with the specified key, initializing `view` to wrap it in
+ * place.
+ *
+ * Returns the set, or NULL if the key isn't in the index or its set is
+ * corrupt.
+ */
+
+const rset_t *rindex_get(const rindex_t *index, uint32_t key,
+                         rset_view_t *view);
+
+/**
+ * Get the set at the specified position in key order, e.g. to iterate over
+ * every set in the index, and store its key in `key`.
+ *
+ * Returns the set, or NULL if the position is out of range or the set is
+ * corrupt.
+ */
+
+const rset_t *rindex_get_at(const rindex_t *index, uint32_t position,
+                            uint32_t *key, rset_view_t *view);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,6 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
-#include <smmintrin.h>
+#include <immintrin.h>
 
 #include "rset.h"
 
@@ -8,477 +8,4179 @@
 #define INLINE __attribute__ ((always_inline))
 #define UNLIKELY(x) __builtin_expect((x), 0)
 #define MAX(a, b) ((a > b) ? (a) : (b))
+#define MIN(a, b) ((a < b) ? (a) : (b))
+#define TARGET(isa) __attribute__ ((target(isa)))
 
 const static unsigned default_size = 8;
 const static unsigned growth_factor = 2;
 
+const static unsigned header_size = 4;
 const static unsigned max_cardinality = 1 << 16;
 const static unsigned low_cutoff = 1 << 12;
 const static unsigned high_cutoff = max_cardinality - low_cutoff;
 const static unsigned max_item = 0xFFFF;
 const static unsigned max_size = low_cutoff;
+const static unsigned hysteresis = low_cutoff / 8;
+const static unsigned max_capacity = max_size + hysteresis;
+const static unsigned bitset_words = max_cardinality / 64;
+const static unsigned gallop_factor = 32;
+
+enum {
+    OP_AND,
+    OP_OR,
+    OP_ANDNOT,
+    OP_XOR
+};
+
+/**
+ * The kernels that have SIMD implementations. The best implementation the
+ * CPU supports is picked once at startup (see rset_init_kernels), so the
+ * library itself is compiled for the baseline instruction set.
+ */
+
+/**
+ * Bitsets are stored and processed as 64-bit words. The header is four 16-bit
+ * words, so the items of a set start on an 8-byte boundary. The type may
+ * alias the 16-bit view of the buffer used for the header and for exports,
+ * and only assumes 2-byte alignment so that views of exported sets can wrap
+ * any buffer.
+ */
+
+typedef uint64_t __attribute__ ((may_alias, aligned(2))) bitset_word_t;
+
+typedef struct {
+    const uint16_t *(*intersection)(const uint16_t *a, size_t a_size,
+                                    const uint16_t *b, size_t b_size,
+                                    uint16_t *result);
+    const uint16_t *(*union_)(const uint16_t *a, size_t a_size,
+                              const uint16_t *b, size_t b_size,
+                              uint16_t *result);
+    unsigned (*bitset_op)(const bitset_word_t *a, const bitset_word_t *b,
+                          bitset_word_t *result, unsigned op);
+    void (*array_to_bitset)(const uint16_t *array, unsigned count,
+                            bitset_word_t *bitset);
+    uint16_t *(*bitset_extract16)(const bitset_word_t *bitset, uint16_t *out,
+                                  const uint16_t *end, uint64_t flip);
+    uint32_t *(*bitset_extract32)(const bitset_word_t *bitset, uint32_t *out,
+                                  const uint32_t *end, uint32_t offset);
+    size_t (*intersection_count)(const uint16_t *a, size_t a_size,
+                                 const uint16_t *b, size_t b_size);
+    unsigned (*bitset_and_count)(const bitset_word_t *a,
+                                 const bitset_word_t *b);
+    uint32_t (*crc32c)(uint32_t crc, const unsigned char *data,
+                       size_t length);
+    uint16_t (*unpack_array)(const unsigned char *packed, unsigned width,
+                             unsigned count, uint16_t *items, uint16_t next);
+} rset_kernels_t;
+
+static rset_kernels_t kernels;
+
+static unsigned INLINE rset_type(const rset_t *set)
+{
+    return set->buffer[0];
+}
+
+static unsigned INLINE rset_count(const rset_t *set)
+{
+    return set->buffer[1];
+}
+
+static uint16_t INLINE *rset_items(const rset_t *set)
+{
+    return set->buffer + header_size;
+}
+
+static bitset_word_t INLINE *rset_bitset(const rset_t *set)
+{
+    return (bitset_word_t *)rset_items(set);
+}
+
+static void INLINE rset_set_header(rset_t *set, unsigned type, unsigned count,
+                                   unsigned cardinality)
+{
+    set->buffer[0] = type;
+    set->buffer[1] = count;
+    set->buffer[2] = cardinality & 0xFFFF;
+    set->buffer[3] = cardinality >> 16;
+}
+
+unsigned rset_cardinality(const rset_t *set)
+{
+    return set->buffer[2] | (unsigned)set->buffer[3] << 16;
+}
 
 static bool INLINE rset_is_empty(const rset_t *set)
 {
     // There are 65536 possible items in the set (0-65535 inclusive) and then
-    // the set can be empty, so there are 65537 (2^16+1) possible states. Since
-    // the cardinality is stored in a uint16_t field with only 2^16 possible
-    // states, it's necessary to use some other means of representing either an
-    // empty set or a full set.
-    //
-    // An empty set is represented in 32-bits by storing a cardinality of two
-    // and then storing the maximum item in the first slot. Since the set uses
-    // a sorted array when cardinality < low_cutoff, there is no possible
-    // second item that could be greater than the item in the first slot, i.e.
-    // the state is invalid.
+    // the set can be empty, so there are 65537 (2^16+1) possible states. The
+    // cardinality is stored in 32-bits so both states can be represented
+    // directly. An empty set is an array with no items, and a full set is an
+    // inverted array with no items.
 
-    return set->buffer[0] == 2 && set->buffer[1] == max_item;
+    return rset_cardinality(set) == 0;
 }
 
 static bool INLINE rset_is_full(const rset_t *set)
 {
-    return set->buffer[0] == 0;
+    return rset_cardinality(set) == max_cardinality;
 }
 
 static bool INLINE rset_is_bitset(const rset_t *set)
 {
-    unsigned cardinality = *set->buffer;
-    return cardinality > low_cutoff && cardinality <= high_cutoff;
+    return rset_type(set) == RSET_BITSET;
 }
 
 static bool INLINE rset_is_array(const rset_t *set)
 {
-    unsigned cardinality = *set->buffer;
-    return cardinality <= low_cutoff;
+    return rset_type(set) == RSET_ARRAY;
 }
 
 static bool INLINE rset_is_inverted_array(const rset_t *set)
 {
-    unsigned cardinality = *set->buffer;
-    return cardinality > high_cutoff;
+    return rset_type(set) == RSET_INVERTED_ARRAY;
 }
 
-unsigned rset_cardinality(const rset_t *set)
+static bool INLINE rset_is_run(const rset_t *set)
 {
-    if (rset_is_full(set))
-        return max_cardinality;
-    if (rset_is_empty(set))
-        return 0;
-    return *set->buffer;
+    return rset_type(set) == RSET_RUN;
 }
 
 bool rset_truncate(rset_t *set)
 {
-    set->buffer[0] = 2;
-    set->buffer[1] = max_item;
+    rset_set_header(set, RSET_ARRAY, 0, 0);
     return true;
 }
 
 bool rset_fill(rset_t *set)
 {
-    set->buffer[0] = 0;
+    rset_set_header(set, RSET_INVERTED_ARRAY, 0, max_cardinality);
     return true;
 }
 
-rset_t *rset_import(const void *buffer, unsigned length)
+/**
+ * Every block the library allocates goes through the allocator, including
+ * temporary buffers. Blocks are freed and resized with their size so that
+ * allocators don't need to store it.
+ */
+
+static void *default_allocate(void *context, size_t size)
 {
-    rset_t *set = malloc(sizeof(rset_t));
-    if (!set)
-        return NULL;
-    unsigned size = length ? length : 1;
-    if (size > max_size)
-        size = max_size;
-    set->buffer = malloc(sizeof(uint16_t) * (1 + size));
-    if (!set->buffer) {
-        free(set);
-        return NULL;
-    }
-    set->size = size;
-    if (buffer && length)
-        memcpy(set->buffer, buffer, length);
-    else
-        rset_truncate(set);
-    return set;
+    (void)context;
+    return malloc(size);
 }
 
-rset_t *rset_new()
+static void *default_reallocate(void *context, void *pointer,
+                                size_t old_size, size_t size)
 {
-    return rset_import(NULL, default_size);
+    (void)context;
+    (void)old_size;
+    return realloc(pointer, size);
 }
 
-void rset_free(rset_t *set)
+static void default_deallocate(void *context, void *pointer, size_t size)
 {
-    free(set->buffer);
-    free(set);
+    (void)context;
+    (void)size;
+    free(pointer);
 }
 
-const void *rset_export(const rset_t *set)
+const static rset_allocator_t default_allocator = {
+    default_allocate, default_reallocate, default_deallocate, NULL
+};
+
+static rset_allocator_t allocator = {
+    default_allocate, default_reallocate, default_deallocate, NULL
+};
+
+void rset_set_allocator(const rset_allocator_t *custom)
 {
-    return set->buffer;
+    allocator = custom ? *custom : default_allocator;
 }
 
-rset_t *rset_copy(const rset_t *set)
+static void *rset_allocate(size_t size)
 {
-    return rset_import(rset_export(set), rset_length(set));
+    return allocator.allocate(allocator.context, size);
 }
 
-static unsigned INLINE rset_length_for(unsigned cardinality)
+static void *rset_reallocate(void *pointer, size_t old_size, size_t size)
 {
-    if (!cardinality)
-        cardinality = 1;
-    else if (cardinality >= high_cutoff)
-        cardinality = max_cardinality - cardinality;
-    else if (cardinality > low_cutoff)
-        cardinality = low_cutoff;
-    return sizeof(uint16_t) * cardinality;
+    return allocator.reallocate(allocator.context, pointer, old_size, size);
 }
 
-unsigned rset_length(const rset_t *set)
+static void rset_deallocate(void *pointer, size_t size)
 {
-    return sizeof(uint16_t) + rset_length_for(rset_cardinality(set));
+    allocator.deallocate(allocator.context, pointer, size);
 }
 
-static bool rset_grow_to(rset_t *set, unsigned size)
+/**
+ * The pool's size classes are the buffer sizes that sets grow through, from
+ * 4 to 4096 items and then max_capacity, so growing a set never wastes more
+ * than half its buffer. Blocks are carved out of 64KB chunks and freed
+ * blocks are kept on a free list per class. Larger blocks are allocated
+ * with malloc and kept on a list so that freeing the pool frees them too.
+ */
+
+const static unsigned pool_classes = 12;
+const static size_t pool_chunk_size = 1 << 16;
+
+typedef struct pool_block {
+    struct pool_block *next;
+} pool_block_t;
+
+typedef struct pool_large {
+    struct pool_large *prev;
+    struct pool_large *next;
+} pool_large_t;
+
+static unsigned pool_class(size_t size)
 {
-    if (set->size >= size)
-        return true;
-    uint16_t *buffer = realloc(set->buffer, sizeof(uint16_t) * (1 + size));
-    if (!buffer)
-        return false;
-    set->buffer = buffer;
-    set->size = size;
-    return true;
+    size_t items = size > sizeof(uint16_t) * header_size ?
+                   (size + 1) / sizeof(uint16_t) - header_size : 0;
+    if (items > max_capacity)
+        return pool_classes;
+    if (items <= 4)
+        return 0;
+    unsigned class = 32 - __builtin_clz((items - 1) >> 2);
+    return MIN(class, pool_classes - 1);
 }
 
-static bool NOINLINE rset_grow(rset_t *set)
+static size_t pool_class_size(unsigned class)
 {
-    unsigned size = set->size * growth_factor;
-    if (size > max_size)
-        size = max_size;
-    return rset_grow_to(set, size);
+    unsigned items = class == pool_classes - 1 ? max_capacity : 4U << class;
+    return sizeof(uint16_t) * (header_size + items);
 }
 
-static bool NOINLINE rset_convert_array_to_bitset(rset_t *set)
+static void pool_link(rset_pool_t *pool, pool_large_t *large)
 {
-    uint16_t *bitset = calloc(max_size, sizeof(uint16_t));
-    uint16_t *array = set->buffer + 1;
-    if (!bitset)
-        return false;
-    for (unsigned i = 0; i < max_size; i++)
-        bitset[array[i] >> 4] |= 1 << (array[i] & 0xF);
-    memcpy(array, bitset, max_size * sizeof(uint16_t));
-    free(bitset);
-    return true;
+    large->prev = NULL;
+    large->next = pool->large;
+    if (large->next)
+        large->next->prev = large;
+    pool->large = large;
 }
 
-static bool NOINLINE rset_convert_bitset_to_inverted_array(rset_t *set)
+static void pool_unlink(rset_pool_t *pool, pool_large_t *large)
 {
-    uint16_t *array = calloc(max_size, sizeof(uint16_t));
-    if (!array)
-        return false;
-    uint16_t *ptr = array, *bitset = set->buffer + 1;
-    for (unsigned bit = 0, i = 0; i < max_size; i++)
-        for (unsigned j = 0; j < 16; j++, bit++)
-            if (!(bitset[i] & (1 << j)))
-                *ptr++ = bit;
-    memcpy(bitset, array, max_size * sizeof(uint16_t));
-    free(array);
-    return true;
+    if (large->prev)
+        large->prev->next = large->next;
+    else
+        pool->large = large->next;
+    if (large->next)
+        large->next->prev = large->prev;
 }
 
-static bool INLINE rset_add_array(rset_t *set, uint16_t item)
+static bool NOINLINE pool_grow(rset_pool_t *pool)
 {
-    unsigned i, cardinality = *set->buffer;
-    if (cardinality && set->buffer[cardinality] < item) {
-        i = cardinality + 1;
-    } else {
-        for (i = 1; i <= cardinality; i++) {
-            if (set->buffer[i] < item)
-                continue;
-            if (set->buffer[i] == item)
-                return true;
-            break;
-        }
-    }
-    if (UNLIKELY(cardinality == set->size && !rset_grow(set)))
+    // The first block of each chunk links it to the previous chunk.
+    pool_block_t *chunk = malloc(pool_chunk_size);
+    if (!chunk)
         return false;
-    if (cardinality + 1 > i) {
-        memmove(set->buffer + i + 1,
-                set->buffer + i,
-                (cardinality + 1 - i) * sizeof(uint16_t));
-    }
-    set->buffer[i] = item;
-    *set->buffer += 1;
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->cursor = (unsigned char *)chunk + 2 * sizeof(pool_block_t);
+    pool->end = (unsigned char *)chunk + pool_chunk_size;
     return true;
 }
 
-static bool INLINE rset_add_bitset(rset_t *set, uint16_t item)
+static void *pool_allocate(void *context, size_t size)
 {
-    unsigned offset = (item >> 4) + 1;
-    unsigned bit = 1 << (item & 0xF);
-    if (!(set->buffer[offset] & bit)) {
-        set->buffer[offset] |= bit;
-        *set->buffer += 1;
+    rset_pool_t *pool = context;
+    unsigned class = pool_class(size);
+    if (UNLIKELY(class == pool_classes)) {
+        pool_large_t *large = malloc(sizeof(pool_large_t) + size);
+        if (!large)
+            return NULL;
+        pool_link(pool, large);
+        return large + 1;
     }
-    return true;
+    pool_block_t *block = pool->free_lists[class];
+    if (block) {
+        pool->free_lists[class] = block->next;
+        return block;
+    }
+    size_t bytes = pool_class_size(class);
+    if ((size_t)(pool->end - pool->cursor) < bytes && !pool_grow(pool))
+        return NULL;
+    block = (pool_block_t *)pool->cursor;
+    pool->cursor += bytes;
+    return block;
 }
 
-static bool INLINE rset_add_inverted_array(rset_t *set, uint16_t item)
+static void pool_deallocate(void *context, void *pointer, size_t size)
 {
-    unsigned cardinality = max_cardinality - *set->buffer;
-    if (set->buffer[cardinality] == item) {
-        *set->buffer += 1;
-        return true;
-    }
-    uint16_t *array = set->buffer + 1;
-    for (unsigned i = 0; i < cardinality; i++) {
-        if (array[i] < item)
-            continue;
-        if (array[i] > item)
-            break;
-        memmove(array + i, array + i + 1,
-                (cardinality - i) * sizeof(uint16_t));
-        *set->buffer += 1;
-        return true;
+    rset_pool_t *pool = context;
+    unsigned class = pool_class(size);
+    if (UNLIKELY(class == pool_classes)) {
+        pool_large_t *large = (pool_large_t *)pointer - 1;
+        pool_unlink(pool, large);
+        free(large);
+        return;
     }
-    return true;
+    pool_block_t *block = pointer;
+    block->next = pool->free_lists[class];
+    pool->free_lists[class] = block;
 }
 
-static bool INLINE rset_contains_array(const rset_t *set, uint16_t item)
+static void *pool_reallocate(void *context, void *pointer, size_t old_size,
+                             size_t size)
 {
-    unsigned cardinality = *set->buffer;
-    if (cardinality > high_cutoff)
-        cardinality = max_cardinality - cardinality;
-    uint16_t *array = set->buffer + 1;
-    int first = 0, last = cardinality - 1, middle = (first + last) / 2;
-    while (first <= last) {
-        if (array[middle] == item)
-            return true;
-        if (array[middle] < item)
-            first = middle + 1;
-        else
-            last = middle - 1;
-        middle = (first + last) / 2;
+    rset_pool_t *pool = context;
+    unsigned old_class = pool_class(old_size), class = pool_class(size);
+    if (old_class == class && class < pool_classes)
+        return pointer;
+    if (old_class == pool_classes && class == pool_classes) {
+        pool_large_t *large = (pool_large_t *)pointer - 1;
+        pool_unlink(pool, large);
+        pool_large_t *resized = realloc(large, sizeof(pool_large_t) + size);
+        pool_link(pool, resized ? resized : large);
+        return resized ? resized + 1 : NULL;
     }
-    return false;
+    void *resized = pool_allocate(pool, size);
+    if (!resized)
+        return NULL;
+    memcpy(resized, pointer, MIN(old_size, size));
+    pool_deallocate(pool, pointer, old_size);
+    return resized;
 }
 
-static bool INLINE rset_contains_bitset(const rset_t *set, uint16_t item)
+rset_pool_t *rset_pool_new()
 {
-    return set->buffer[(item >> 4) + 1] & (1 << (item & 0xF));
+    return calloc(1, sizeof(rset_pool_t));
 }
 
-bool rset_add(rset_t *set, uint16_t item)
+void rset_pool_free(rset_pool_t *pool)
 {
-    if (UNLIKELY(rset_is_full(set)))
-        return true;
-
-    if (UNLIKELY(rset_is_empty(set)))
-        *set->buffer = 0;
-
-    unsigned cardinality = *set->buffer;
-    if (UNLIKELY(cardinality == low_cutoff)) {
-        if (rset_contains_array(set, item))
-            return true;
-        if (!rset_convert_array_to_bitset(set))
-            return false;
-    } else if (UNLIKELY(cardinality == high_cutoff)) {
-        if (rset_contains_bitset(set, item))
-            return true;
-        if (!rset_convert_bitset_to_inverted_array(set))
-            return false;
+    while (pool->chunks) {
+        pool_block_t *chunk = pool->chunks;
+        pool->chunks = chunk->next;
+        free(chunk);
     }
+    while (pool->large) {
+        pool_large_t *large = pool->large;
+        pool->large = large->next;
+        free(large);
+    }
+    free(pool);
+}
 
-    if (cardinality < low_cutoff) {
-        if (!rset_add_array(set, item))
-            return false;
-    } else if (cardinality >= high_cutoff) {
-        if (!rset_add_inverted_array(set, item))
-            return false;
-    } else if (!rset_add_bitset(set, item))
-        return false;
-
-    return true;
+rset_allocator_t rset_pool_allocator(rset_pool_t *pool)
+{
+    rset_allocator_t pool_allocator = {
+        pool_allocate, pool_reallocate, pool_deallocate, pool
+    };
+    return pool_allocator;
 }
 
-bool rset_equals(const rset_t *set, const rset_t *comparison)
+static bool rset_valid_header(const uint16_t *buffer, unsigned length)
 {
-    unsigned cardinality = rset_cardinality(set);
-    if (cardinality != rset_cardinality(comparison))
+    // Check that the header is consistent with the length of the buffer and
+    // with the representation. The items themselves aren't checked.
+    if (length < header_size * sizeof(uint16_t) ||
+        length != sizeof(uint16_t) * (header_size + buffer[1]))
+        return false;
+    unsigned count = buffer[1];
+    unsigned cardinality = buffer[2] | (unsigned)buffer[3] << 16;
+    if (cardinality > max_cardinality || count > max_capacity)
         return false;
-    unsigned length = rset_length_for(cardinality);
-    return !length || !memcmp(set->buffer + 1, comparison->buffer + 1, length);
+    if (buffer[0] == RSET_ARRAY)
+        return count == cardinality;
+    if (buffer[0] == RSET_INVERTED_ARRAY)
+        return count == max_cardinality - cardinality;
+    if (buffer[0] == RSET_BITSET)
+        return count == max_size;
+    return buffer[0] == RSET_RUN && count % 2 == 0 &&
+           cardinality >= count / 2;
 }
 
-bool rset_contains(const rset_t *set, uint16_t item)
+static bool rset_valid_items(const rset_t *set)
 {
-    if (rset_is_full(set))
-        return true;
-    if (rset_is_empty(set))
-        return false;
-    if (rset_is_array(set))
-        return rset_contains_array(set, item);
-    if (rset_is_inverted_array(set))
-        return !rset_contains_array(set, item);
-    return rset_contains_bitset(set, item);
+    // Check the invariants the rest of the library relies on: array items are
+    // strictly increasing, a bitset has as many bits set as its cardinality,
+    // and runs are sorted, neither overlap nor touch (they'd have been merged)
+    // and add up to the cardinality.
+    const uint16_t *items = rset_items(set);
+    unsigned count = rset_count(set);
+    if (rset_type(set) == RSET_BITSET)
+        return kernels.bitset_and_count(rset_bitset(set), rset_bitset(set)) ==
+               rset_cardinality(set);
+    if (rset_type(set) == RSET_RUN) {
+        unsigned cardinality = 0, next = 0;
+        for (unsigned i = 0; i < count; i += 2) {
+            unsigned start = items[i], end = start + items[i + 1];
+            if ((i && start <= next) || end > max_item)
+                return false;
+            cardinality += items[i + 1] + 1;
+            next = end + 1;
+        }
+        return cardinality == rset_cardinality(set);
+    }
+    // The difference is negative for any pair that's out of order. Don't
+    // exit early so that the loop vectorizes.
+    int unsorted = 0;
+    for (unsigned i = 1; i < count; i++)
+        unsorted |= items[i] - items[i - 1] - 1;
+    return unsorted >= 0;
 }
 
-static bool rset_copy_to(const rset_t *set, rset_t *dest)
+static bool rset_init_size(rset_t *set, unsigned size)
 {
-    if (!rset_grow_to(dest, set->size))
+    set->buffer = rset_allocate(sizeof(uint16_t) * (header_size + size));
+    if (!set->buffer)
         return false;
-    memcpy(dest->buffer, set->buffer, rset_length(set));
-    return true;
+    set->size = size;
+    return rset_truncate(set);
 }
 
-static void INLINE rset_invert_bitset(rset_t *set)
+bool rset_init(rset_t *set)
 {
-    uint16_t *bitset = set->buffer + 1;
-    for (unsigned i = 0; i < max_size; i++)
-        bitset[i] = ~bitset[i];
+    return rset_init_size(set, default_size);
 }
 
-bool rset_invert(const rset_t *set, rset_t *result)
+void rset_destroy(rset_t *set)
 {
-    if (rset_is_empty(set)) // ~0 => U
-        return rset_fill(result);
-    if (rset_is_full(set)) // ~U => 0
-        return rset_truncate(result);
-    if (!rset_copy_to(set, result))
-        return false;
-    *result->buffer = max_cardinality - *result->buffer;
-    if (rset_is_bitset(result))
-        rset_invert_bitset(result);
-    return true;
+    rset_deallocate(set->buffer, sizeof(uint16_t) * (header_size + set->size));
 }
 
-static inline const uint16_t*
-naive_intersection(const uint16_t* restrict a, size_t a_size,
-                   const uint16_t* restrict b, size_t b_size,
-                   uint16_t* restrict result)
+rset_t *rset_import(const void *buffer, unsigned length)
 {
-    const uint16_t* const restrict a_end = a + a_size;
-    const uint16_t* const restrict b_end = b + b_size;
-    while (a < a_end && b < b_end) {
-        if (*a < *b) {
-            a++;
-        } else if (*b < *a) {
-            b++;
-        } else {
-            *result++ = *a++;
-            b++;
-        }
+    // Without a buffer `length` is the number of items to make room for.
+    // Otherwise it's a length in bytes, and anything longer than the largest
+    // set would overflow the allocation below.
+    if (buffer && length > sizeof(uint16_t) * (header_size + max_capacity))
+        return NULL;
+    rset_t *set = rset_allocate(sizeof(rset_t));
+    if (!set)
+        return NULL;
+    unsigned size = length ? length : 1;
+    if (size > max_capacity)
+        size = max_capacity;
+    if (!rset_init_size(set, size)) {
+        rset_deallocate(set, sizeof(rset_t));
+        return NULL;
     }
-    return result;
+    if (!buffer || !length)
+        return set;
+    memcpy(set->buffer, buffer, length);
+    if (!rset_valid_header(set->buffer, length)) {
+        rset_free(set);
+        return NULL;
+    }
+    return set;
 }
 
-static inline const uint16_t*
-sse_intersection(const uint16_t* restrict a, size_t a_size,
-                 const uint16_t* restrict b, size_t b_size,
-                 uint16_t* restrict result)
+const rset_t *rset_view(rset_view_t *view, const void *buffer,
+                        unsigned length)
 {
-    // from https://highlyscalable.wordpress.com/2012/06/05/fast-intersection-sorted-lists-sse/
-    size_t count = 0;
-    static __m128i shuffle_mask16[256];
-    static int built_shuffle_mask = 0;
-    if (!built_shuffle_mask) {
-        built_shuffle_mask = 1;
-        for (int i = 0; i < 256; i++) {
-            uint8_t mask[16];
-            memset(mask, 0xFF, sizeof(mask));
-            int counter = 0;
-            for (int j = 0; j < 16; j++) {
-                if (i & (1 << j)) {
-                    mask[counter++] = 2 * j;
-                    mask[counter++] = 2 * j + 1;
-                }
-            }
-            __m128i v_mask = _mm_loadu_si128((const __m128i *)mask);
-            shuffle_mask16[i] = v_mask;
-        }
-    }
-    size_t i_a = 0, i_b = 0;
-    size_t st_a = (a_size / 8) * 8;
-    size_t st_b = (b_size / 8) * 8;
+    if (!buffer || (uintptr_t)buffer % sizeof(uint16_t) ||
+        !rset_valid_header(buffer, length))
+        return NULL;
+    // The view doesn't own its buffer, so it has no capacity to grow into.
+    // The items are checked too, since views usually wrap untrusted data
+    // (e.g. a mapped file) and set operations trust the items, e.g. to stay
+    // within a bitset when expanding runs. The check is linear in the size
+    // of the buffer, which is small next to the cost of copying it.
+    view->set.buffer = (uint16_t *)buffer;
+    view->set.size = 0;
+    return rset_valid_items(&view->set) ? &view->set : NULL;
+}
 
-    while(i_a < st_a && i_b < st_b) {
-        __m128i v_a = _mm_loadu_si128((__m128i *)&a[i_a]);
-        __m128i v_b = _mm_loadu_si128((__m128i *)&b[i_b]);
-        __m128i v_cmp = _mm_cmpestrm(v_a, 8, v_b, 8,
-            _SIDD_UWORD_OPS|_SIDD_CMP_EQUAL_ANY|_SIDD_BIT_MASK);
-        int r = _mm_extract_epi32(v_cmp, 0);
-        __m128i v_shuf = _mm_shuffle_epi8(v_b, shuffle_mask16[r]);
-        _mm_storeu_si128((__m128i *)&result[count], v_shuf);
-        count += _mm_popcnt_u32(r);
-        uint16_t a_max = _mm_extract_epi16(v_a, 7);
-        uint16_t b_max = _mm_extract_epi16(v_b, 7);
-        i_a += (a_max <= b_max) * 8;
-        i_b += (a_max >= b_max) * 8;
-    }
-    a += i_a;
-    a_size -= i_a;
-    b += i_b;
-    b_size -= i_b;
-    result += count;
-    return naive_intersection(a, a_size, b, b_size, result);
+/**
+ * The serialized format is documented in rset.h. Every field is little-endian
+ * regardless of the host, so uncompressed items are copied as-is on
+ * little-endian hosts and only swapped on big-endian ones.
+ */
+
+const static uint32_t serialized_magic = 0x54455352; // "RSET"
+const static unsigned serialized_version = 1;
+const static unsigned serialized_header_size = 16;
+
+static void store_le32(unsigned char *out, uint32_t value)
+{
+    out[0] = value & 0xFF;
+    out[1] = (value >> 8) & 0xFF;
+    out[2] = (value >> 16) & 0xFF;
+    out[3] = value >> 24;
 }
 
-static bool rset_intersection_array(const rset_t *a, const rset_t *b,
-                                    rset_t *result)
+static uint32_t load_le32(const unsigned char *in)
 {
-    unsigned result_size = MAX(*a->buffer, *b->buffer);
-    if (!rset_grow_to(result, result_size))
-        return false;
-    const uint16_t *end = \
-        sse_intersection(a->buffer + 1, *a->buffer,
-                         b->buffer + 1, *b->buffer,
-                         result->buffer + 1);
-    *result->buffer = end - result->buffer - 1;
-    if (!*result->buffer)
-        rset_truncate(result);
-    return true;
+    return in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 |
+           (uint32_t)in[3] << 24;
 }
 
-static unsigned rset_intersection_bitset(const rset_t *a, const rset_t *b,
-                                         rset_t *result)
+static void copy_items_le(void *out, const void *items, unsigned type,
+                          unsigned count)
 {
-    uint16_t *bitset_a = a->buffer + 1;
-    uint16_t *bitset_b = b->buffer + 1;
-    uint16_t *bitset_result = result->buffer + 1;
-    unsigned cardinality = 0;
-    for (unsigned i = 0; i < max_size; i++) {
-        bitset_result[i] = bitset_a[i] & bitset_b[i];
-        cardinality += __builtin_popcount(bitset_result[i]);
+    // Converts in both directions. Bitsets are processed as 64-bit words, so
+    // on a big-endian host they're swapped a word rather than an item at a
+    // time to keep bit i of the set at bit i % 8 of byte i / 8.
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    (void)type;
+    memcpy(out, items, sizeof(uint16_t) * count);
+#else
+    unsigned char *dst = out;
+    const unsigned char *src = items;
+    if (type == RSET_BITSET) {
+        for (unsigned i = 0; i < count * sizeof(uint16_t); i += 8) {
+            uint64_t word;
+            memcpy(&word, src + i, sizeof(word));
+            word = __builtin_bswap64(word);
+            memcpy(dst + i, &word, sizeof(word));
+        }
+    } else {
+        for (unsigned i = 0; i < count * sizeof(uint16_t); i += 2) {
+            uint16_t item;
+            memcpy(&item, src + i, sizeof(item));
+            item = __builtin_bswap16(item);
+            memcpy(dst + i, &item, sizeof(item));
+        }
     }
-    return cardinality;
+#endif
 }
 
-bool rset_intersection(const rset_t *a, const rset_t *b, rset_t *result)
+static uint32_t rset_crc32c(const unsigned char *data, size_t length)
 {
-    if (rset_is_empty(a) || rset_is_empty(b)) // A & 0 => 0
-        return rset_truncate(result);
-    if (rset_is_full(a)) // A & U => A
-        return rset_copy_to(b, result);
-    else if (rset_is_full(b))
-        return rset_copy_to(a, result);
-    if (rset_is_array(a) && rset_is_array(b))
-        return rset_intersection_array(a, b, result);
+    return ~kernels.crc32c(0xFFFFFFFF, data, length);
+}
 
-    // TODO: convert both operands to bitsets if necessary
+static void store_le64(unsigned char *out, uint64_t value)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    memcpy(out, &value, sizeof(value));
+}
 
-    if (!rset_grow_to(result, max_size))
-        return false;
-    unsigned cardinality = rset_intersection_bitset(a, b, result);
+static uint64_t load_le64(const unsigned char *in)
+{
+    uint64_t value;
+    memcpy(&value, in, sizeof(value));
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
 
-    if (!cardinality)
-        return rset_truncate(result);
-    if (cardinality == max_cardinality)
-        return rset_fill(result);
+/**
+ * Compressed payloads. Arrays and inverted arrays are stored as the gaps
+ * between consecutive items, and runs as the gap before each run followed
+ * by its length. The gaps are split into blocks of 64 and each block is
+ * stored as its bit width (one byte) followed by the gaps bit-packed at
+ * that width, least significant bit first. Consecutive items have a gap of
+ * zero, so dense blocks take a single byte.
+ *
+ * Bitsets are stored as 2 bits per 64-bit word (zero, all ones or literal)
+ * followed by the literal words.
+ *
+ * A set is only compressed if that makes it smaller.
+ */
 
-    *result->buffer = cardinality;
-    return true;
+const static unsigned pack_block = 64;
+const static unsigned max_pack_width = 16;
+const static unsigned word_classes = bitset_words / 4;
 
-    // TODO: convert back to an array or inverted array as necessary
+enum {
+    WORD_ZERO,
+    WORD_ONES,
+    WORD_LITERAL
+};
 
-    return false;
+static uint16_t INLINE rset_gap(const uint16_t *items, unsigned i, bool runs)
+{
+    if (!runs)
+        return items[i] - (i ? items[i - 1] + 1 : 0);
+    if (i % 2)
+        return items[i];
+    return items[i] - (i ? items[i - 2] + items[i - 1] + 1 : 0);
+}
+
+static unsigned pack_items(const rset_t *set, unsigned char *out)
+{
+    // Returns the length of the packed items, only writing them if `out`
+    // isn't NULL.
+    const uint16_t *items = rset_items(set);
+    unsigned count = rset_count(set), length = 0;
+    bool runs = rset_is_run(set);
+    for (unsigned start = 0; start < count; start += pack_block) {
+        unsigned n = MIN(pack_block, count - start), bits = 0;
+        uint16_t gaps[pack_block];
+        for (unsigned i = 0; i < n; i++)
+            bits |= gaps[i] = rset_gap(items, start + i, runs);
+        unsigned width = bits ? 32 - __builtin_clz(bits) : 0;
+        unsigned bytes = (n * width + 7) / 8;
+        if (out) {
+            unsigned char *packed = out + length + 1;
+            uint64_t pending = 0;
+            unsigned pending_bits = 0;
+            out[length] = width;
+            for (unsigned i = 0; i < n; i++) {
+                pending |= (uint64_t)gaps[i] << pending_bits;
+                pending_bits += width;
+                for (; pending_bits >= 8; pending_bits -= 8, pending >>= 8)
+                    *packed++ = pending & 0xFF;
+            }
+            if (pending_bits)
+                *packed = pending & 0xFF;
+        }
+        length += 1 + bytes;
+    }
+    return length;
+}
+
+static bool unpack_items(const unsigned char *in, unsigned length,
+                         uint16_t *items, unsigned count, bool runs)
+{
+    unsigned position = 0;
+    uint16_t next = 0;
+    for (unsigned start = 0; start < count; start += pack_block) {
+        unsigned n = MIN(pack_block, count - start);
+        if (position >= length || in[position] > max_pack_width)
+            return false;
+        unsigned width = in[position++], bytes = (n * width + 7) / 8;
+        if (bytes > length - position)
+            return false;
+        // The kernels over-read each block by up to 16 bytes, so the last
+        // block is copied somewhere it can be over-read.
+        const unsigned char *packed = in + position;
+        unsigned char padded[pack_block * 2 + 16];
+        if (length - position < bytes + 16) {
+            memset(padded, 0, sizeof(padded));
+            memcpy(padded, packed, bytes);
+            packed = padded;
+        }
+        if (!runs) {
+            next = kernels.unpack_array(packed, width, n, items + start, next);
+        } else {
+            uint64_t mask = (1 << width) - 1;
+            for (unsigned i = 0, bit = 0; i < n; i++, bit += width)
+                items[start + i] = load_le64(packed + bit / 8) >> bit % 8 &
+                                   mask;
+        }
+        position += bytes;
+    }
+    if (position != length)
+        return false;
+    // Array items that overflow wrap around and end up out of order, which
+    // is caught when the items are validated.
+    if (!runs)
+        return true;
+
+    // Turn the gaps back into runs. The runs only increase, so they
+    // overflowed if the last one did.
+    unsigned end = 0;
+    for (unsigned i = 0; i < count; i += 2) {
+        items[i] = end += items[i];
+        end += items[i + 1] + 1;
+    }
+    return end <= max_cardinality;
+}
+
+static unsigned bitset_literals(const bitset_word_t *bitset)
+{
+    unsigned literals = 0;
+    for (unsigned i = 0; i < bitset_words; i++)
+        literals += bitset[i] && ~bitset[i];
+    return literals;
+}
+
+static void pack_bitset(const bitset_word_t *bitset, unsigned char *out)
+{
+    unsigned char *literals = out + word_classes;
+    memset(out, 0, word_classes);
+    for (unsigned i = 0; i < bitset_words; i++) {
+        unsigned type = WORD_ZERO;
+        if (!~bitset[i]) {
+            type = WORD_ONES;
+        } else if (bitset[i]) {
+            type = WORD_LITERAL;
+            store_le64(literals, bitset[i]);
+            literals += sizeof(uint64_t);
+        }
+        out[i / 4] |= type << 2 * (i % 4);
+    }
+}
+
+static bool unpack_bitset(const unsigned char *in, unsigned length,
+                          bitset_word_t *bitset)
+{
+    if (length < word_classes)
+        return false;
+    const unsigned char *literals = in + word_classes, *end = in + length;
+    for (unsigned i = 0; i < bitset_words; i++) {
+        unsigned type = in[i / 4] >> 2 * (i % 4) & 3;
+        if (type == WORD_LITERAL) {
+            if (end - literals < (ptrdiff_t)sizeof(uint64_t))
+                return false;
+            bitset[i] = load_le64(literals);
+            literals += sizeof(uint64_t);
+        } else if (type == WORD_ONES) {
+            bitset[i] = ~0ULL;
+        } else if (type == WORD_ZERO) {
+            bitset[i] = 0;
+        } else {
+            return false;
+        }
+    }
+    return literals == end;
+}
+
+static unsigned rset_payload_length(const rset_t *set, unsigned flags)
+{
+    unsigned length = sizeof(uint16_t) * rset_count(set);
+    if (!(flags & RSET_COMPRESS))
+        return length;
+    unsigned compressed = rset_type(set) == RSET_BITSET ?
+        word_classes + sizeof(uint64_t) * bitset_literals(rset_bitset(set)) :
+        pack_items(set, NULL);
+    return MIN(compressed, length);
+}
+
+unsigned rset_serialized_length(const rset_t *set, unsigned flags)
+{
+    return serialized_header_size + rset_payload_length(set, flags) +
+           (flags & RSET_CHECKSUM ? sizeof(uint32_t) : 0);
+}
+
+unsigned rset_serialize(const rset_t *set, void *out, unsigned flags)
+{
+    unsigned char *bytes = out;
+    unsigned count = rset_count(set);
+    unsigned payload = rset_payload_length(set, flags);
+    bool compressed = payload < sizeof(uint16_t) * count;
+    store_le32(bytes, serialized_magic);
+    bytes[4] = serialized_version;
+    bytes[5] = (flags & RSET_CHECKSUM) | (compressed ? RSET_COMPRESS : 0);
+    bytes[6] = rset_type(set);
+    bytes[7] = 0;
+    store_le32(bytes + 8, rset_cardinality(set));
+    store_le32(bytes + 12, count);
+    unsigned char *items = bytes + serialized_header_size;
+    if (!compressed)
+        copy_items_le(items, rset_items(set), rset_type(set), count);
+    else if (rset_type(set) == RSET_BITSET)
+        pack_bitset(rset_bitset(set), items);
+    else
+        pack_items(set, items);
+    unsigned length = serialized_header_size + payload;
+    if (flags & RSET_CHECKSUM) {
+        store_le32(bytes + length, rset_crc32c(bytes, length));
+        length += sizeof(uint32_t);
+    }
+    return length;
+}
+
+rset_t *rset_import_checked(const void *buffer, unsigned length)
+{
+    const unsigned char *bytes = buffer;
+    if (!buffer || length < serialized_header_size ||
+        load_le32(bytes) != serialized_magic ||
+        bytes[4] != serialized_version ||
+        bytes[5] & ~(RSET_CHECKSUM | RSET_COMPRESS) ||
+        bytes[6] > RSET_RUN || bytes[7])
+        return NULL;
+    unsigned type = bytes[6];
+    bool compressed = bytes[5] & RSET_COMPRESS;
+    uint32_t cardinality = load_le32(bytes + 8);
+    uint32_t count = load_le32(bytes + 12);
+    unsigned checksum = bytes[5] & RSET_CHECKSUM ? sizeof(uint32_t) : 0;
+    if (count > max_capacity ||
+        length < serialized_header_size + checksum)
+        return NULL;
+    unsigned payload = length - serialized_header_size - checksum;
+    // Compressed items are unpacked before the header is validated, so make
+    // sure they'll fit first.
+    if (compressed ? (type == RSET_BITSET && count != max_size) ||
+                     (type == RSET_RUN && count % 2) :
+                     payload != sizeof(uint16_t) * count)
+        return NULL;
+    if (checksum && rset_crc32c(bytes, length - checksum) !=
+                    load_le32(bytes + length - checksum))
+        return NULL;
+    rset_t *set = rset_import(NULL, count);
+    if (!set)
+        return NULL;
+    rset_set_header(set, type, count, cardinality);
+    const unsigned char *items = bytes + serialized_header_size;
+    bool unpacked = true;
+    if (!compressed)
+        copy_items_le(rset_items(set), items, type, count);
+    else if (type == RSET_BITSET)
+        unpacked = unpack_bitset(items, payload, rset_bitset(set));
+    else
+        unpacked = unpack_items(items, payload, rset_items(set), count,
+                                type == RSET_RUN);
+    if (!unpacked || !rset_valid_header(set->buffer, rset_length(set)) ||
+        !rset_valid_items(set)) {
+        rset_free(set);
+        return NULL;
+    }
+    return set;
+}
+
+rset_t *rset_new()
+{
+    return rset_import(NULL, default_size);
+}
+
+void rset_free(rset_t *set)
+{
+    rset_destroy(set);
+    rset_deallocate(set, sizeof(rset_t));
+}
+
+const void *rset_export(const rset_t *set)
+{
+    return set->buffer;
+}
+
+rset_t *rset_copy(const rset_t *set)
+{
+    return rset_import(rset_export(set), rset_length(set));
+}
+
+unsigned rset_length(const rset_t *set)
+{
+    return sizeof(uint16_t) * (header_size + rset_count(set));
+}
+
+static bool rset_grow_to(rset_t *set, unsigned size)
+{
+    if (set->size >= size)
+        return true;
+    uint16_t *buffer = rset_reallocate(set->buffer,
+                                       sizeof(uint16_t) *
+                                       (header_size + set->size),
+                                       sizeof(uint16_t) * (header_size + size));
+    if (!buffer)
+        return false;
+    set->buffer = buffer;
+    set->size = size;
+    return true;
+}
+
+static bool NOINLINE rset_grow(rset_t *set)
+{
+    unsigned size = set->size * growth_factor;
+    if (size > max_capacity)
+        size = max_capacity;
+    return rset_grow_to(set, size);
+}
+
+static void bitset_set_range(bitset_word_t *bitset, unsigned start,
+                             unsigned end)
+{
+    // Set the bits in the range [start, end] using word-level masks.
+    unsigned first = start >> 6, last = end >> 6;
+    uint64_t first_mask = ~0ULL << (start & 0x3F);
+    uint64_t last_mask = ~0ULL >> (63 - (end & 0x3F));
+    if (first == last) {
+        bitset[first] |= first_mask & last_mask;
+        return;
+    }
+    bitset[first] |= first_mask;
+    for (unsigned i = first + 1; i < last; i++)
+        bitset[i] = ~0ULL;
+    bitset[last] |= last_mask;
+}
+
+static void bitset_clear_range(bitset_word_t *bitset, unsigned start,
+                               unsigned end)
+{
+    // Clear the bits in the range [start, end].
+    unsigned first = start >> 6, last = end >> 6;
+    uint64_t first_mask = ~0ULL << (start & 0x3F);
+    uint64_t last_mask = ~0ULL >> (63 - (end & 0x3F));
+    if (first == last) {
+        bitset[first] &= ~(first_mask & last_mask);
+        return;
+    }
+    bitset[first] &= ~first_mask;
+    for (unsigned i = first + 1; i < last; i++)
+        bitset[i] = 0;
+    bitset[last] &= ~last_mask;
+}
+
+static unsigned bitset_count_range(const bitset_word_t *bitset,
+                                   unsigned start, unsigned end)
+{
+    // Count the bits in the range [start, end].
+    unsigned first = start >> 6, last = end >> 6;
+    uint64_t first_mask = ~0ULL << (start & 0x3F);
+    uint64_t last_mask = ~0ULL >> (63 - (end & 0x3F));
+    if (first == last)
+        return __builtin_popcountll(bitset[first] & first_mask & last_mask);
+    unsigned count = __builtin_popcountll(bitset[first] & first_mask) +
+                     __builtin_popcountll(bitset[last] & last_mask);
+    for (unsigned i = first + 1; i < last; i++)
+        count += __builtin_popcountll(bitset[i]);
+    return count;
+}
+
+static unsigned bitset_count_runs(const bitset_word_t *bitset)
+{
+    // A run starts at every set bit whose preceding bit is clear.
+    unsigned runs = 0;
+    uint64_t carry = 0;
+    for (unsigned i = 0; i < bitset_words; i++) {
+        uint64_t word = bitset[i];
+        runs += __builtin_popcountll(word & ~((word << 1) | carry));
+        carry = word >> 63;
+    }
+    return runs;
+}
+
+static unsigned bitset_to_runs(const bitset_word_t *bitset, uint16_t *runs)
+{
+    // Find the start of each run with tzcnt, fill in the bits below it so
+    // that the end of the run is the first clear bit, and then clear the run.
+    uint16_t *ptr = runs;
+    unsigned i = 0;
+    uint64_t word = bitset[0];
+    for (;;) {
+        while (!word && i + 1 < bitset_words)
+            word = bitset[++i];
+        if (!word)
+            break;
+        unsigned start = i * 64 + __builtin_ctzll(word);
+        word |= word - 1;
+        while (word == ~0ULL && i + 1 < bitset_words)
+            word = bitset[++i];
+        if (word == ~0ULL) {
+            *ptr++ = start;
+            *ptr++ = max_item - start;
+            break;
+        }
+        *ptr++ = start;
+        *ptr++ = i * 64 + __builtin_ctzll(~word) - 1 - start;
+        word &= word + 1;
+    }
+    return (ptr - runs) / 2;
+}
+
+static uint16_t *bitset_extract(const bitset_word_t *bitset, uint16_t *out,
+                                uint64_t flip)
+{
+    // Write the position of each set bit (or clear bit, if flip is ~0).
+    for (unsigned i = 0; i < bitset_words; i++) {
+        for (uint64_t word = bitset[i] ^ flip; word; word &= word - 1)
+            *out++ = i * 64 + __builtin_ctzll(word);
+    }
+    return out;
+}
+
+static void rset_to_bitset(const rset_t *set, bitset_word_t *bitset)
+{
+    const uint16_t *items = rset_items(set);
+    unsigned count = rset_count(set);
+    if (rset_is_bitset(set)) {
+        memcpy(bitset, items, bitset_words * sizeof(uint64_t));
+    } else if (rset_is_inverted_array(set)) {
+        memset(bitset, 0xFF, bitset_words * sizeof(uint64_t));
+        for (unsigned i = 0; i < count; i++)
+            bitset[items[i] >> 6] &= ~(1ULL << (items[i] & 0x3F));
+    } else {
+        memset(bitset, 0, bitset_words * sizeof(uint64_t));
+        if (rset_is_array(set))
+            kernels.array_to_bitset(items, count, bitset);
+        else
+            for (unsigned i = 0; i < count; i += 2)
+                bitset_set_range(bitset, items[i], items[i] + items[i + 1]);
+    }
+}
+
+static bool rset_from_bitset(rset_t *set, const bitset_word_t *bitset,
+                             unsigned cardinality, unsigned type)
+{
+    // The bitset must not point into the set's buffer, since the buffer may
+    // be reallocated.
+    unsigned count;
+    if (type == RSET_ARRAY)
+        count = cardinality;
+    else if (type == RSET_INVERTED_ARRAY)
+        count = max_cardinality - cardinality;
+    else if (type == RSET_BITSET)
+        count = max_size;
+    else
+        count = 2 * bitset_count_runs(bitset);
+    if (!rset_grow_to(set, count))
+        return false;
+    uint16_t *items = rset_items(set);
+    if (type == RSET_BITSET)
+        memcpy(items, bitset, bitset_words * sizeof(uint64_t));
+    else if (type == RSET_RUN)
+        bitset_to_runs(bitset, items);
+    else
+        kernels.bitset_extract16(bitset, items, items + set->size,
+                                 type == RSET_INVERTED_ARRAY ? ~0ULL : 0);
+    rset_set_header(set, type, count, cardinality);
+    return true;
+}
+
+static unsigned rset_count_runs(const rset_t *set)
+{
+    const uint16_t *items = rset_items(set);
+    unsigned count = rset_count(set), runs = 0;
+    if (rset_is_array(set)) {
+        for (unsigned i = 0; i < count; i++)
+            runs += !i || items[i] != items[i - 1] + 1;
+    } else if (rset_is_inverted_array(set)) {
+        // The runs are the non-empty gaps between missing items.
+        unsigned next = 0;
+        for (unsigned i = 0; i < count; next = items[i++] + 1)
+            runs += items[i] > next;
+        runs += next <= max_item;
+    } else if (rset_is_bitset(set)) {
+        runs = bitset_count_runs(rset_bitset(set));
+    } else {
+        runs = count / 2;
+    }
+    return runs;
+}
+
+static unsigned rset_best_type(unsigned cardinality, unsigned runs)
+{
+    // Pick the representation that uses the least amount of space. The array,
+    // bitset and inverted array are chosen based on the cardinality cut-off
+    // points, and a run container is used only if it's strictly smaller.
+    unsigned type = RSET_BITSET, size = max_size;
+    if (cardinality <= low_cutoff) {
+        type = RSET_ARRAY;
+        size = cardinality;
+    } else if (cardinality > high_cutoff) {
+        type = RSET_INVERTED_ARRAY;
+        size = max_cardinality - cardinality;
+    }
+    return 2 * runs < size ? (unsigned)RSET_RUN : type;
+}
+
+static bool NOINLINE rset_convert(rset_t *set, unsigned type)
+{
+    uint64_t bitset[bitset_words];
+    rset_to_bitset(set, bitset);
+    return rset_from_bitset(set, bitset, rset_cardinality(set), type);
+}
+
+bool rset_optimize(rset_t *set)
+{
+    unsigned type = rset_best_type(rset_cardinality(set),
+                                   rset_count_runs(set));
+    return type == rset_type(set) || rset_convert(set, type);
+}
+
+static bool INLINE rset_prefers_runs(const rset_t *set)
+{
+    // Check whether a run container would be smaller than the representation
+    // the set is about to be upgraded to, allowing for the item that's about
+    // to be added.
+    return rset_best_type(rset_cardinality(set) + 1,
+                          rset_count_runs(set) + 1) == RSET_RUN;
+}
+
+/**
+ * Conversions between arrays and bitsets don't allocate. A bitset can't be
+ * built over the array it's built from (or the other way around) without
+ * clobbering items that haven't been read yet, so the smaller of the two is
+ * copied to the stack first and the result is written straight into the
+ * set's buffer.
+ */
+
+static bool NOINLINE rset_convert_array_to_bitset(rset_t *set)
+{
+    unsigned count = rset_count(set);
+    if (!rset_grow_to(set, max_size))
+        return false;
+    uint16_t array[max_capacity];
+    memcpy(array, rset_items(set), count * sizeof(uint16_t));
+    bitset_word_t *bitset = rset_bitset(set);
+    memset(bitset, 0, bitset_words * sizeof(uint64_t));
+    kernels.array_to_bitset(array, count, bitset);
+    rset_set_header(set, RSET_BITSET, max_size, rset_cardinality(set));
+    return true;
+}
+
+static bool NOINLINE rset_convert_bitset_to_items(rset_t *set, unsigned type,
+                                                  unsigned count)
+{
+    // Extract the set bits (or the clear bits, for an inverted array) into a
+    // stack buffer with some slack for the extraction kernel.
+    uint16_t array[max_size + 64];
+    kernels.bitset_extract16(rset_bitset(set), array, array + max_size + 64,
+                             type == RSET_INVERTED_ARRAY ? ~0ULL : 0);
+    memcpy(rset_items(set), array, count * sizeof(uint16_t));
+    rset_set_header(set, type, count, rset_cardinality(set));
+    return true;
+}
+
+static bool rset_convert_bitset_to_inverted_array(rset_t *set)
+{
+    return rset_convert_bitset_to_items(set, RSET_INVERTED_ARRAY,
+                                        max_cardinality -
+                                        rset_cardinality(set));
+}
+
+static bool rset_convert_bitset_to_array(rset_t *set)
+{
+    return rset_convert_bitset_to_items(set, RSET_ARRAY,
+                                        rset_cardinality(set));
+}
+
+static bool NOINLINE rset_convert_inverted_array_to_bitset(rset_t *set)
+{
+    unsigned count = rset_count(set);
+    if (!rset_grow_to(set, max_size))
+        return false;
+    uint16_t array[max_capacity];
+    memcpy(array, rset_items(set), count * sizeof(uint16_t));
+    bitset_word_t *bitset = rset_bitset(set);
+    memset(bitset, 0xFF, bitset_words * sizeof(uint64_t));
+    for (unsigned i = 0; i < count; i++)
+        bitset[array[i] >> 6] &= ~(1ULL << (array[i] & 0x3F));
+    rset_set_header(set, RSET_BITSET, max_size, rset_cardinality(set));
+    return true;
+}
+
+static unsigned INLINE rset_lower_bound(const uint16_t *array, unsigned count,
+                                        uint16_t item)
+{
+    // Find the index of the first item that's >= the specified item.
+    unsigned first = 0, last = count;
+    while (first < last) {
+        unsigned middle = (first + last) / 2;
+        if (array[middle] < item)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    return first;
+}
+
+static unsigned rset_gallop(const uint16_t *array, unsigned count,
+                            unsigned from, uint16_t item)
+{
+    // Find the index of the first item that's >= the specified item,
+    // starting at `from`. The step doubles until it overshoots and then the
+    // last step is binary searched, so the cost is logarithmic in the
+    // distance moved rather than in the size of the array.
+    unsigned last = from, step = 1;
+    while (last < count && array[last] < item) {
+        from = last + 1;
+        last += step;
+        step *= 2;
+    }
+    return from + rset_lower_bound(array + from, MIN(last, count) - from,
+                                   item);
+}
+
+static bool INLINE rset_add_array(rset_t *set, uint16_t item)
+{
+    unsigned i, cardinality = rset_count(set);
+    uint16_t *array = rset_items(set);
+    if (cardinality && array[cardinality - 1] < item) {
+        i = cardinality;
+    } else {
+        for (i = 0; i < cardinality; i++) {
+            if (array[i] < item)
+                continue;
+            if (array[i] == item)
+                return true;
+            break;
+        }
+    }
+    if (UNLIKELY(cardinality == set->size && !rset_grow(set)))
+        return false;
+    array = rset_items(set);
+    if (cardinality > i) {
+        memmove(array + i + 1,
+                array + i,
+                (cardinality - i) * sizeof(uint16_t));
+    }
+    array[i] = item;
+    rset_set_header(set, RSET_ARRAY, cardinality + 1, cardinality + 1);
+    return true;
+}
+
+static bool INLINE rset_add_bitset(rset_t *set, uint16_t item)
+{
+    bitset_word_t *bitset = rset_bitset(set);
+    unsigned offset = item >> 6;
+    uint64_t bit = 1ULL << (item & 0x3F);
+    if (!(bitset[offset] & bit)) {
+        bitset[offset] |= bit;
+        rset_set_header(set, RSET_BITSET, max_size,
+                        rset_cardinality(set) + 1);
+    }
+    return true;
+}
+
+static bool INLINE rset_add_inverted_array(rset_t *set, uint16_t item)
+{
+    unsigned count = rset_count(set), cardinality = rset_cardinality(set);
+    uint16_t *array = rset_items(set);
+    if (count && array[count - 1] == item) {
+        rset_set_header(set, RSET_INVERTED_ARRAY, count - 1, cardinality + 1);
+        return true;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        if (array[i] < item)
+            continue;
+        if (array[i] > item)
+            break;
+        memmove(array + i, array + i + 1,
+                (count - i - 1) * sizeof(uint16_t));
+        rset_set_header(set, RSET_INVERTED_ARRAY, count - 1, cardinality + 1);
+        return true;
+    }
+    return true;
+}
+
+static int INLINE rset_find_run(const uint16_t *runs, unsigned count,
+                                uint16_t item)
+{
+    // Find the last run that starts at or before the item, or -1 if the item
+    // precedes every run.
+    int first = 0, last = count - 1;
+    while (first <= last) {
+        int middle = (first + last) / 2;
+        if (runs[2 * middle] <= item)
+            first = middle + 1;
+        else
+            last = middle - 1;
+    }
+    return last;
+}
+
+static bool rset_normalize_run(rset_t *set)
+{
+    unsigned cardinality = rset_cardinality(set);
+    if (cardinality == max_cardinality)
+        return rset_fill(set);
+    unsigned type = rset_best_type(cardinality, rset_count(set) / 2);
+    return type == RSET_RUN || rset_convert(set, type);
+}
+
+static bool rset_normalize(rset_t *set)
+{
+    // Re-encode the result of an operation using the representation its
+    // cardinality calls for. Run containers are left alone.
+    unsigned cardinality = rset_cardinality(set), type = RSET_BITSET;
+    if (cardinality <= low_cutoff)
+        type = RSET_ARRAY;
+    else if (cardinality > high_cutoff)
+        type = RSET_INVERTED_ARRAY;
+    if (rset_type(set) == type || rset_is_run(set))
+        return true;
+    return rset_convert(set, type);
+}
+
+/**
+ * Operations whose result may not fit the largest buffer (e.g. the union of
+ * two 4000-item arrays) build it outside the set and load it with one of the
+ * functions below. A result that doesn't fit is past the cut-off points
+ * anyway, so it's loaded as a bitset rather than growing the set past
+ * max_capacity.
+ */
+
+static bool rset_load_items(rset_t *set, const uint16_t *items,
+                            unsigned count, unsigned type)
+{
+    // Load sorted items as an array or an inverted array.
+    unsigned cardinality = type == RSET_ARRAY ? count : max_cardinality - count;
+    if (count <= max_capacity) {
+        if (!rset_grow_to(set, count))
+            return false;
+        memcpy(rset_items(set), items, count * sizeof(uint16_t));
+        rset_set_header(set, type, count, cardinality);
+        return true;
+    }
+    if (!rset_grow_to(set, max_size))
+        return false;
+    bitset_word_t *bitset = rset_bitset(set);
+    if (type == RSET_ARRAY) {
+        memset(bitset, 0, bitset_words * sizeof(uint64_t));
+        kernels.array_to_bitset(items, count, bitset);
+    } else {
+        memset(bitset, 0xFF, bitset_words * sizeof(uint64_t));
+        for (unsigned i = 0; i < count; i++)
+            bitset[items[i] >> 6] &= ~(1ULL << (items[i] & 0x3F));
+    }
+    rset_set_header(set, RSET_BITSET, max_size, cardinality);
+    return true;
+}
+
+static bool rset_load_runs(rset_t *set, const uint16_t *runs, unsigned count,
+                           unsigned cardinality)
+{
+    // Load `count` (start, length) pairs and normalize the result.
+    if (2 * count <= max_capacity) {
+        if (!rset_grow_to(set, 2 * count))
+            return false;
+        memcpy(rset_items(set), runs, 2 * count * sizeof(uint16_t));
+        rset_set_header(set, RSET_RUN, 2 * count, cardinality);
+        return rset_normalize_run(set);
+    }
+    if (!rset_grow_to(set, max_size))
+        return false;
+    bitset_word_t *bitset = rset_bitset(set);
+    memset(bitset, 0, bitset_words * sizeof(uint64_t));
+    for (unsigned i = 0; i < count; i++)
+        bitset_set_range(bitset, runs[2 * i], runs[2 * i] + runs[2 * i + 1]);
+    rset_set_header(set, RSET_BITSET, max_size, cardinality);
+    return rset_normalize(set);
+}
+
+static bool rset_add_run(rset_t *set, uint16_t item)
+{
+    uint16_t *runs = rset_items(set);
+    unsigned count = rset_count(set) / 2;
+    int i = rset_find_run(runs, count, item);
+    unsigned end = i >= 0 ? runs[2 * i] + runs[2 * i + 1] : 0;
+    if (i >= 0 && item <= end)
+        return true;
+    bool extends_prev = i >= 0 && item == end + 1;
+    bool extends_next = i + 1 < (int)count && item + 1 == runs[2 * i + 2];
+    if (extends_prev && extends_next) {
+        runs[2 * i + 1] += runs[2 * i + 3] + 2;
+        memmove(runs + 2 * i + 2, runs + 2 * i + 4,
+                (count - i - 2) * 2 * sizeof(uint16_t));
+        count--;
+    } else if (extends_prev) {
+        runs[2 * i + 1]++;
+    } else if (extends_next) {
+        runs[2 * i + 2]--;
+        runs[2 * i + 3]++;
+    } else {
+        if (UNLIKELY(2 * count + 2 > set->size && !rset_grow(set)))
+            return false;
+        runs = rset_items(set);
+        memmove(runs + 2 * i + 4, runs + 2 * i + 2,
+                (count - i - 1) * 2 * sizeof(uint16_t));
+        runs[2 * i + 2] = item;
+        runs[2 * i + 3] = 0;
+        count++;
+    }
+    rset_set_header(set, RSET_RUN, 2 * count, rset_cardinality(set) + 1);
+    return rset_normalize_run(set);
+}
+
+static bool INLINE rset_contains_array(const rset_t *set, uint16_t item)
+{
+    // Branchless binary search: the range is halved with a conditional move
+    // rather than a branch, which would be mispredicted half of the time.
+    unsigned count = rset_count(set);
+    const uint16_t *base = rset_items(set);
+    if (!count)
+        return false;
+    while (count > 1) {
+        unsigned half = count / 2;
+        base = base[half] <= item ? base + half : base;
+        count -= half;
+    }
+    return *base == item;
+}
+
+static bool INLINE rset_contains_bitset(const rset_t *set, uint16_t item)
+{
+    return rset_bitset(set)[item >> 6] >> (item & 0x3F) & 1;
+}
+
+static bool INLINE rset_contains_run(const rset_t *set, uint16_t item)
+{
+    const uint16_t *runs = rset_items(set);
+    int i = rset_find_run(runs, rset_count(set) / 2, item);
+    return i >= 0 && item - runs[2 * i] <= runs[2 * i + 1];
+}
+
+bool rset_add(rset_t *set, uint16_t item)
+{
+    unsigned cardinality = rset_cardinality(set);
+    if (UNLIKELY(cardinality >= low_cutoff && rset_is_array(set))) {
+        if (rset_contains_array(set, item))
+            return true;
+        if (!(rset_prefers_runs(set) ? rset_convert(set, RSET_RUN)
+                                     : rset_convert_array_to_bitset(set)))
+            return false;
+    } else if (UNLIKELY(cardinality == high_cutoff && rset_is_bitset(set))) {
+        if (rset_contains_bitset(set, item))
+            return true;
+        if (!(rset_prefers_runs(set) ? rset_convert(set, RSET_RUN)
+                                     : rset_convert_bitset_to_inverted_array(set)))
+            return false;
+    }
+
+    if (rset_is_array(set)) {
+        if (!rset_add_array(set, item))
+            return false;
+    } else if (rset_is_inverted_array(set)) {
+        if (!rset_add_inverted_array(set, item))
+            return false;
+    } else if (rset_is_run(set)) {
+        if (!rset_add_run(set, item))
+            return false;
+    } else if (!rset_add_bitset(set, item))
+        return false;
+
+    return true;
+}
+
+static bool INLINE rset_remove_array(rset_t *set, uint16_t item)
+{
+    unsigned count = rset_count(set);
+    uint16_t *array = rset_items(set);
+    unsigned i = rset_lower_bound(array, count, item);
+    if (i == count || array[i] != item)
+        return true;
+    memmove(array + i, array + i + 1, (count - i - 1) * sizeof(uint16_t));
+    rset_set_header(set, RSET_ARRAY, count - 1, count - 1);
+    return true;
+}
+
+static bool INLINE rset_remove_bitset(rset_t *set, uint16_t item)
+{
+    bitset_word_t *bitset = rset_bitset(set);
+    unsigned offset = item >> 6;
+    uint64_t bit = 1ULL << (item & 0x3F);
+    if (!(bitset[offset] & bit))
+        return true;
+    bitset[offset] &= ~bit;
+    unsigned cardinality = rset_cardinality(set) - 1;
+    rset_set_header(set, RSET_BITSET, max_size, cardinality);
+    if (UNLIKELY(cardinality <= low_cutoff - hysteresis))
+        return rset_convert_bitset_to_array(set);
+    return true;
+}
+
+static bool INLINE rset_remove_inverted_array(rset_t *set, uint16_t item)
+{
+    unsigned count = rset_count(set), cardinality = rset_cardinality(set);
+    uint16_t *array = rset_items(set);
+    unsigned i = rset_lower_bound(array, count, item);
+    if (i < count && array[i] == item)
+        return true;
+    if (UNLIKELY(count == set->size && !rset_grow(set)))
+        return false;
+    array = rset_items(set);
+    memmove(array + i + 1, array + i, (count - i) * sizeof(uint16_t));
+    array[i] = item;
+    rset_set_header(set, RSET_INVERTED_ARRAY, count + 1, cardinality - 1);
+    return true;
+}
+
+static bool rset_remove_run(rset_t *set, uint16_t item)
+{
+    uint16_t *runs = rset_items(set);
+    unsigned count = rset_count(set) / 2;
+    int i = rset_find_run(runs, count, item);
+    if (i < 0)
+        return true;
+    unsigned start = runs[2 * i], end = start + runs[2 * i + 1];
+    if (item > end)
+        return true;
+    if (start == end) {
+        memmove(runs + 2 * i, runs + 2 * i + 2,
+                (count - i - 1) * 2 * sizeof(uint16_t));
+        count--;
+    } else if (item == start) {
+        runs[2 * i]++;
+        runs[2 * i + 1]--;
+    } else if (item == end) {
+        runs[2 * i + 1]--;
+    } else {
+        // Split the run in two.
+        if (UNLIKELY(2 * count + 2 > set->size && !rset_grow(set)))
+            return false;
+        runs = rset_items(set);
+        memmove(runs + 2 * i + 4, runs + 2 * i + 2,
+                (count - i - 1) * 2 * sizeof(uint16_t));
+        runs[2 * i + 1] = item - 1 - start;
+        runs[2 * i + 2] = item + 1;
+        runs[2 * i + 3] = end - item - 1;
+        count++;
+    }
+    rset_set_header(set, RSET_RUN, 2 * count, rset_cardinality(set) - 1);
+    return rset_normalize_run(set);
+}
+
+bool rset_remove(rset_t *set, uint16_t item)
+{
+    // Downward conversions lag the upward ones by `hysteresis` items so that
+    // a set hovering around a cut-off point doesn't thrash between
+    // representations. Bitsets become arrays once they shrink well below
+    // low_cutoff, and inverted arrays are allowed to grow past max_size
+    // before becoming bitsets.
+    if (UNLIKELY(rset_count(set) >= max_capacity &&
+                 rset_is_inverted_array(set))) {
+        if (rset_contains_array(set, item))
+            return true;
+        if (!rset_convert_inverted_array_to_bitset(set))
+            return false;
+    }
+
+    if (rset_is_array(set)) {
+        if (!rset_remove_array(set, item))
+            return false;
+    } else if (rset_is_inverted_array(set)) {
+        if (!rset_remove_inverted_array(set, item))
+            return false;
+    } else if (rset_is_run(set)) {
+        if (!rset_remove_run(set, item))
+            return false;
+    } else if (!rset_remove_bitset(set, item))
+        return false;
+
+    return true;
+}
+
+static bool NOINLINE rset_equals_slow(const rset_t *set,
+                                      const rset_t *comparison)
+{
+    uint64_t bitsets[2 * bitset_words];
+    rset_to_bitset(set, bitsets);
+    rset_to_bitset(comparison, bitsets + bitset_words);
+    return !memcmp(bitsets, bitsets + bitset_words,
+                   bitset_words * sizeof(uint64_t));
+}
+
+bool rset_equals(const rset_t *set, const rset_t *comparison)
+{
+    if (rset_cardinality(set) != rset_cardinality(comparison))
+        return false;
+    // The same items can be stored using different representations, e.g.
+    // a short run of items can be stored as either an array or a run.
+    if (rset_type(set) != rset_type(comparison))
+        return rset_equals_slow(set, comparison);
+    unsigned count = rset_count(set);
+    return count == rset_count(comparison) &&
+        !memcmp(rset_items(set), rset_items(comparison),
+                count * sizeof(uint16_t));
+}
+
+bool rset_contains(const rset_t *set, uint16_t item)
+{
+    if (rset_is_array(set))
+        return rset_contains_array(set, item);
+    if (rset_is_inverted_array(set))
+        return !rset_contains_array(set, item);
+    if (rset_is_run(set))
+        return rset_contains_run(set, item);
+    return rset_contains_bitset(set, item);
+}
+
+static bool rset_copy_to(const rset_t *set, rset_t *dest)
+{
+    if (set == dest)
+        return true;
+    if (!rset_grow_to(dest, rset_count(set)))
+        return false;
+    memcpy(dest->buffer, set->buffer, rset_length(set));
+    return true;
+}
+
+static void INLINE rset_invert_bitset(rset_t *set)
+{
+    bitset_word_t *bitset = rset_bitset(set);
+    for (unsigned i = 0; i < bitset_words; i++)
+        bitset[i] = ~bitset[i];
+}
+
+static bool rset_invert_run(const rset_t *set, rset_t *result)
+{
+    // The inverted runs are the gaps between runs, so the result can't be
+    // written over the input.
+    if (set == result) {
+        rset_t *copy = rset_copy(set);
+        if (!copy)
+            return false;
+        bool success = rset_invert_run(copy, result);
+        rset_free(copy);
+        return success;
+    }
+    const uint16_t *runs = rset_items(set);
+    unsigned count = rset_count(set) / 2;
+    if (!rset_grow_to(result, 2 * count + 2))
+        return false;
+    uint16_t *inverted = rset_items(result);
+    unsigned next = 0, inverted_count = 0;
+    for (unsigned i = 0; i < count; i++) {
+        unsigned start = runs[2 * i];
+        if (start > next) {
+            inverted[2 * inverted_count] = next;
+            inverted[2 * inverted_count + 1] = start - next - 1;
+            inverted_count++;
+        }
+        next = start + runs[2 * i + 1] + 1;
+    }
+    if (next <= max_item) {
+        inverted[2 * inverted_count] = next;
+        inverted[2 * inverted_count + 1] = max_item - next;
+        inverted_count++;
+    }
+    rset_set_header(result, RSET_RUN, 2 * inverted_count,
+                    max_cardinality - rset_cardinality(set));
+    return rset_normalize_run(result);
+}
+
+bool rset_invert(const rset_t *set, rset_t *result)
+{
+    // An empty set is an array with no items and a full set is an inverted
+    // array with no items, so ~0 => U and ~U => 0 fall out naturally.
+    if (rset_is_run(set))
+        return rset_invert_run(set, result);
+    if (!rset_copy_to(set, result))
+        return false;
+    unsigned type = rset_type(result);
+    if (type == RSET_ARRAY)
+        type = RSET_INVERTED_ARRAY;
+    else if (type == RSET_INVERTED_ARRAY)
+        type = RSET_ARRAY;
+    else
+        rset_invert_bitset(result);
+    rset_set_header(result, type, rset_count(result),
+                    max_cardinality - rset_cardinality(result));
+    return rset_normalize(result);
+}
+
+static __m128i shuffle_mask16[256];
+
+static void build_shuffle_mask16()
+{
+    // shuffle_mask16[i] moves the 16-bit lanes selected by the bits of i
+    // to the front of the vector.
+    for (int i = 0; i < 256; i++) {
+        uint8_t mask[16];
+        memset(mask, 0xFF, sizeof(mask));
+        int counter = 0;
+        for (int j = 0; j < 16; j++) {
+            if (i & (1 << j)) {
+                mask[counter++] = 2 * j;
+                mask[counter++] = 2 * j + 1;
+            }
+        }
+        __m128i v_mask = _mm_loadu_si128((const __m128i *)mask);
+        shuffle_mask16[i] = v_mask;
+    }
+}
+
+static inline const uint16_t*
+naive_intersection(const uint16_t* restrict a, size_t a_size,
+                   const uint16_t* restrict b, size_t b_size,
+                   uint16_t* restrict result)
+{
+    const uint16_t* const restrict a_end = a + a_size;
+    const uint16_t* const restrict b_end = b + b_size;
+    while (a < a_end && b < b_end) {
+        if (*a < *b) {
+            a++;
+        } else if (*b < *a) {
+            b++;
+        } else {
+            *result++ = *a++;
+            b++;
+        }
+    }
+    return result;
+}
+
+static size_t naive_intersection_count(const uint16_t* restrict a,
+                                       size_t a_size,
+                                       const uint16_t* restrict b,
+                                       size_t b_size)
+{
+    const uint16_t* const restrict a_end = a + a_size;
+    const uint16_t* const restrict b_end = b + b_size;
+    size_t count = 0;
+    while (a < a_end && b < b_end) {
+        count += *a == *b;
+        uint16_t a_item = *a, b_item = *b;
+        a += a_item <= b_item;
+        b += b_item <= a_item;
+    }
+    return count;
+}
+
+static inline const uint16_t* TARGET("sse4.2,popcnt")
+sse_intersection(const uint16_t* restrict a, size_t a_size,
+                 const uint16_t* restrict b, size_t b_size,
+                 uint16_t* restrict result)
+{
+    // from https://highlyscalable.wordpress.com/2012/06/05/fast-intersection-sorted-lists-sse/
+    size_t count = 0;
+    size_t i_a = 0, i_b = 0;
+    size_t st_a = (a_size / 8) * 8;
+    size_t st_b = (b_size / 8) * 8;
+
+    while(i_a < st_a && i_b < st_b) {
+        __m128i v_a = _mm_loadu_si128((__m128i *)&a[i_a]);
+        __m128i v_b = _mm_loadu_si128((__m128i *)&b[i_b]);
+        __m128i v_cmp = _mm_cmpestrm(v_a, 8, v_b, 8,
+            _SIDD_UWORD_OPS|_SIDD_CMP_EQUAL_ANY|_SIDD_BIT_MASK);
+        int r = _mm_extract_epi32(v_cmp, 0);
+        __m128i v_shuf = _mm_shuffle_epi8(v_b, shuffle_mask16[r]);
+        _mm_storeu_si128((__m128i *)&result[count], v_shuf);
+        count += _mm_popcnt_u32(r);
+        uint16_t a_max = _mm_extract_epi16(v_a, 7);
+        uint16_t b_max = _mm_extract_epi16(v_b, 7);
+        i_a += (a_max <= b_max) * 8;
+        i_b += (a_max >= b_max) * 8;
+    }
+    a += i_a;
+    a_size -= i_a;
+    b += i_b;
+    b_size -= i_b;
+    result += count;
+    return naive_intersection(a, a_size, b, b_size, result);
+}
+
+static size_t TARGET("sse4.2,popcnt")
+sse_intersection_count(const uint16_t* restrict a, size_t a_size,
+                       const uint16_t* restrict b, size_t b_size)
+{
+    // Same as sse_intersection, but only the matches are counted.
+    size_t i_a = 0, i_b = 0, count = 0;
+    size_t st_a = (a_size / 8) * 8;
+    size_t st_b = (b_size / 8) * 8;
+    while (i_a < st_a && i_b < st_b) {
+        __m128i v_a = _mm_loadu_si128((const __m128i *)&a[i_a]);
+        __m128i v_b = _mm_loadu_si128((const __m128i *)&b[i_b]);
+        __m128i v_cmp = _mm_cmpestrm(v_a, 8, v_b, 8,
+            _SIDD_UWORD_OPS|_SIDD_CMP_EQUAL_ANY|_SIDD_BIT_MASK);
+        count += _mm_popcnt_u32(_mm_extract_epi32(v_cmp, 0));
+        uint16_t a_max = a[i_a + 7], b_max = b[i_b + 7];
+        i_a += (a_max <= b_max) * 8;
+        i_b += (a_max >= b_max) * 8;
+    }
+    return count + naive_intersection_count(a + i_a, a_size - i_a,
+                                            b + i_b, b_size - i_b);
+}
+
+static inline const uint16_t*
+naive_union(const uint16_t* restrict a, size_t a_size,
+            const uint16_t* restrict b, size_t b_size,
+            uint16_t* restrict result)
+{
+    const uint16_t* const restrict a_end = a + a_size;
+    const uint16_t* const restrict b_end = b + b_size;
+    while (a < a_end && b < b_end) {
+        if (*a < *b) {
+            *result++ = *a++;
+        } else if (*b < *a) {
+            *result++ = *b++;
+        } else {
+            *result++ = *a++;
+            b++;
+        }
+    }
+    while (a < a_end)
+        *result++ = *a++;
+    while (b < b_end)
+        *result++ = *b++;
+    return result;
+}
+
+static inline const uint16_t*
+naive_difference(const uint16_t* restrict a, size_t a_size,
+                 const uint16_t* restrict b, size_t b_size,
+                 uint16_t* restrict result)
+{
+    const uint16_t* const restrict a_end = a + a_size;
+    const uint16_t* const restrict b_end = b + b_size;
+    while (a < a_end && b < b_end) {
+        if (*a < *b) {
+            *result++ = *a++;
+        } else if (*b < *a) {
+            b++;
+        } else {
+            a++;
+            b++;
+        }
+    }
+    while (a < a_end)
+        *result++ = *a++;
+    return result;
+}
+
+static inline const uint16_t*
+naive_xor(const uint16_t* restrict a, size_t a_size,
+          const uint16_t* restrict b, size_t b_size,
+          uint16_t* restrict result)
+{
+    const uint16_t* const restrict a_end = a + a_size;
+    const uint16_t* const restrict b_end = b + b_size;
+    while (a < a_end && b < b_end) {
+        if (*a < *b) {
+            *result++ = *a++;
+        } else if (*b < *a) {
+            *result++ = *b++;
+        } else {
+            a++;
+            b++;
+        }
+    }
+    while (a < a_end)
+        *result++ = *a++;
+    while (b < b_end)
+        *result++ = *b++;
+    return result;
+}
+
+static inline void TARGET("sse4.2") sse_merge(__m128i *min, __m128i *max)
+{
+    // Merge two sorted vectors with a min/max network, leaving the 8
+    // smallest items in `min` and the 8 largest items in `max`, both sorted.
+    __m128i tmp = _mm_min_epu16(*min, *max);
+    *max = _mm_max_epu16(*min, *max);
+    for (int i = 0; i < 7; i++) {
+        tmp = _mm_alignr_epi8(tmp, tmp, 2);
+        *min = _mm_min_epu16(tmp, *max);
+        *max = _mm_max_epu16(tmp, *max);
+        tmp = *min;
+    }
+    *min = _mm_alignr_epi8(*min, *min, 2);
+}
+
+static inline size_t TARGET("sse4.2,popcnt")
+sse_store_unique(__m128i previous, __m128i v,
+                                      uint16_t* restrict result)
+{
+    // Drop lanes that are equal to the preceding lane (the last lane of
+    // `previous` in the case of the first lane) and pack the rest.
+    __m128i v_shifted = _mm_alignr_epi8(v, previous, 16 - 2);
+    __m128i v_cmp = _mm_cmpeq_epi16(v, v_shifted);
+    int r = ~_mm_movemask_epi8(_mm_packs_epi16(v_cmp, _mm_setzero_si128()));
+    r &= 0xFF;
+    _mm_storeu_si128((__m128i *)result, _mm_shuffle_epi8(v, shuffle_mask16[r]));
+    return _mm_popcnt_u32(r);
+}
+
+static inline const uint16_t* TARGET("sse4.2,popcnt")
+sse_union(const uint16_t* restrict a, size_t a_size,
+          const uint16_t* restrict b, size_t b_size,
+          uint16_t* restrict result)
+{
+    // Vectorized merge in the style of Inoue et al. Each step loads the next
+    // 8 items from whichever list has the smaller head, merges them with
+    // the 8 largest items seen so far, and emits the 8 smallest.
+    if (a_size < 8 || b_size < 8)
+        return naive_union(a, a_size, b, b_size, result);
+    size_t i_a = 8, i_b = 8;
+    size_t st_a = (a_size / 8) * 8;
+    size_t st_b = (b_size / 8) * 8;
+
+    __m128i v_min = _mm_loadu_si128((const __m128i *)a);
+    __m128i v_max = _mm_loadu_si128((const __m128i *)b);
+    __m128i v_previous = _mm_set1_epi16(-1);
+    sse_merge(&v_min, &v_max);
+    result += sse_store_unique(v_previous, v_min, result);
+    v_previous = v_min;
+
+    while (i_a < st_a && i_b < st_b) {
+        if (a[i_a] <= b[i_b]) {
+            v_min = _mm_loadu_si128((const __m128i *)&a[i_a]);
+            i_a += 8;
+        } else {
+            v_min = _mm_loadu_si128((const __m128i *)&b[i_b]);
+            i_b += 8;
+        }
+        sse_merge(&v_min, &v_max);
+        result += sse_store_unique(v_previous, v_min, result);
+        v_previous = v_min;
+    }
+
+    // One of the lists has fewer than 8 items left. Merge those with the
+    // pending items and then merge the result with the other list, skipping
+    // duplicates and the last item emitted if it shows up again.
+    uint16_t pending[8], merged[16];
+    uint16_t last = _mm_extract_epi16(v_previous, 7);
+    _mm_storeu_si128((__m128i *)pending, v_max);
+    size_t pending_size = 0;
+    for (size_t i = 0, previous = last; i < 8; previous = pending[i++])
+        if (pending[i] != previous)
+            pending[pending_size++] = pending[i];
+    const uint16_t *rest = a + i_a, *tail = b + i_b;
+    size_t rest_size = a_size - i_a, tail_size = b_size - i_b;
+    if (i_a >= st_a) {
+        rest = b + i_b;
+        rest_size = b_size - i_b;
+        tail = a + i_a;
+        tail_size = a_size - i_a;
+    }
+    if (tail_size && *tail == last) {
+        tail++;
+        tail_size--;
+    }
+    if (rest_size && *rest == last) {
+        rest++;
+        rest_size--;
+    }
+    size_t merged_size = naive_union(pending, pending_size, tail, tail_size,
+                                     merged) - merged;
+    return naive_union(merged, merged_size, rest, rest_size, result);
+}
+
+static unsigned TARGET("sse4.2,popcnt")
+sse_bitset_op(const bitset_word_t *a, const bitset_word_t *b,
+              bitset_word_t *result, unsigned op)
+{
+    unsigned cardinality = 0;
+    for (unsigned i = 0; i < bitset_words; i += 2) {
+        __m128i v_a = _mm_loadu_si128((const __m128i *)&a[i]);
+        __m128i v_b = _mm_loadu_si128((const __m128i *)&b[i]);
+        __m128i v_result;
+        if (op == OP_AND)
+            v_result = _mm_and_si128(v_a, v_b);
+        else if (op == OP_OR)
+            v_result = _mm_or_si128(v_a, v_b);
+        else if (op == OP_ANDNOT)
+            v_result = _mm_andnot_si128(v_b, v_a);
+        else
+            v_result = _mm_xor_si128(v_a, v_b);
+        _mm_storeu_si128((__m128i *)&result[i], v_result);
+        cardinality += __builtin_popcountll(_mm_cvtsi128_si64(v_result)) +
+                       __builtin_popcountll(_mm_extract_epi64(v_result, 1));
+    }
+    return cardinality;
+}
+
+static unsigned TARGET("sse4.2,popcnt")
+sse_bitset_and_count(const bitset_word_t *a, const bitset_word_t *b)
+{
+    unsigned cardinality = 0;
+    for (unsigned i = 0; i < bitset_words; i++)
+        cardinality += _mm_popcnt_u64(a[i] & b[i]);
+    return cardinality;
+}
+
+static uint16_t *TARGET("sse4.2,popcnt")
+sse_bitset_extract16(const bitset_word_t *bitset, uint16_t *out,
+                     const uint16_t *end, uint64_t flip)
+{
+    // Decode the bitset a byte at a time: the shuffle mask for the byte moves
+    // the lanes of (base, base + 1, ..., base + 7) whose bits are set to the
+    // front of the vector, and all eight lanes are stored. Only popcount(byte)
+    // of them are kept, so the vector path stops a word's worth of items from
+    // the end of the output and the rest is decoded a bit at a time.
+    __m128i v_step = _mm_set1_epi16(8);
+    unsigned i = 0;
+    for (; i < bitset_words && out + 64 <= end; i++) {
+        uint64_t word = bitset[i] ^ flip;
+        if (!word)
+            continue;
+        __m128i v_base = _mm_add_epi16(_mm_set1_epi16(i * 64),
+                                       _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7));
+        for (unsigned byte = 0; byte < 8; byte++, word >>= 8) {
+            unsigned mask = word & 0xFF;
+            __m128i v_items = _mm_shuffle_epi8(v_base, shuffle_mask16[mask]);
+            _mm_storeu_si128((__m128i *)out, v_items);
+            out += __builtin_popcount(mask);
+            v_base = _mm_add_epi16(v_base, v_step);
+        }
+    }
+    for (; i < bitset_words; i++) {
+        for (uint64_t word = bitset[i] ^ flip; word; word &= word - 1)
+            *out++ = i * 64 + __builtin_ctzll(word);
+    }
+    return out;
+}
+
+static uint32_t *TARGET("sse4.2,popcnt")
+sse_bitset_extract32(const bitset_word_t *bitset, uint32_t *out,
+                     const uint32_t *end, uint32_t offset)
+{
+    // Same as sse_bitset_extract16, with each byte's items widened to 32
+    // bits and offset before they're stored.
+    __m128i v_step = _mm_set1_epi16(8);
+    __m128i v_offset = _mm_set1_epi32(offset);
+    unsigned i = 0;
+    for (; i < bitset_words && out + 64 <= end; i++) {
+        uint64_t word = bitset[i];
+        if (!word)
+            continue;
+        __m128i v_base = _mm_add_epi16(_mm_set1_epi16(i * 64),
+                                       _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7));
+        for (unsigned byte = 0; byte < 8; byte++, word >>= 8) {
+            unsigned mask = word & 0xFF;
+            __m128i v_items = _mm_shuffle_epi8(v_base, shuffle_mask16[mask]);
+            __m128i v_low = _mm_cvtepu16_epi32(v_items);
+            __m128i v_high = _mm_cvtepu16_epi32(_mm_srli_si128(v_items, 8));
+            _mm_storeu_si128((__m128i *)out, _mm_add_epi32(v_low, v_offset));
+            _mm_storeu_si128((__m128i *)(out + 4),
+                             _mm_add_epi32(v_high, v_offset));
+            out += __builtin_popcount(mask);
+            v_base = _mm_add_epi16(v_base, v_step);
+        }
+    }
+    for (; i < bitset_words; i++) {
+        for (uint64_t word = bitset[i]; word; word &= word - 1)
+            *out++ = offset + i * 64 + __builtin_ctzll(word);
+    }
+    return out;
+}
+
+static unsigned scalar_bitset_op(const bitset_word_t *a, const bitset_word_t *b,
+                                 bitset_word_t *result, unsigned op)
+{
+    unsigned cardinality = 0;
+    for (unsigned i = 0; i < bitset_words; i++) {
+        uint64_t word;
+        if (op == OP_AND)
+            word = a[i] & b[i];
+        else if (op == OP_OR)
+            word = a[i] | b[i];
+        else if (op == OP_ANDNOT)
+            word = a[i] & ~b[i];
+        else
+            word = a[i] ^ b[i];
+        result[i] = word;
+        cardinality += __builtin_popcountll(word);
+    }
+    return cardinality;
+}
+
+static unsigned scalar_bitset_and_count(const bitset_word_t *a,
+                                        const bitset_word_t *b)
+{
+    unsigned cardinality = 0;
+    for (unsigned i = 0; i < bitset_words; i++)
+        cardinality += __builtin_popcountll(a[i] & b[i]);
+    return cardinality;
+}
+
+static void scalar_array_to_bitset(const uint16_t *array, unsigned count,
+                                   bitset_word_t *bitset)
+{
+    for (unsigned i = 0; i < count; i++)
+        bitset[array[i] >> 6] |= 1ULL << (array[i] & 0x3F);
+}
+
+static uint16_t *scalar_bitset_extract16(const bitset_word_t *bitset,
+                                         uint16_t *out, const uint16_t *end,
+                                         uint64_t flip)
+{
+    (void)end;
+    return bitset_extract(bitset, out, flip);
+}
+
+static uint32_t *scalar_bitset_extract32(const bitset_word_t *bitset,
+                                         uint32_t *out, const uint32_t *end,
+                                         uint32_t offset)
+{
+    (void)end;
+    for (unsigned i = 0; i < bitset_words; i++) {
+        for (uint64_t word = bitset[i]; word; word &= word - 1)
+            *out++ = offset + i * 64 + __builtin_ctzll(word);
+    }
+    return out;
+}
+
+static inline int TARGET("avx2") INLINE avx2_match(__m128i v_a, __m128i v_b)
+{
+    // The 8x8 all-pairs comparison is done as four 256-bit compares: the low
+    // lane compares `a` with `b` rotated by 0-3 places and the high lane with
+    // `b` rotated by 4-7 places. Returns a bit for each lane of `a` that
+    // matches some lane of `b`.
+    __m256i v_aa = _mm256_broadcastsi128_si256(v_a);
+    __m256i v_bb = _mm256_set_m128i(_mm_alignr_epi8(v_b, v_b, 8), v_b);
+    __m256i v_cmp = _mm256_cmpeq_epi16(v_aa, v_bb);
+    v_cmp = _mm256_or_si256(v_cmp, _mm256_cmpeq_epi16(v_aa,
+        _mm256_alignr_epi8(v_bb, v_bb, 2)));
+    v_cmp = _mm256_or_si256(v_cmp, _mm256_cmpeq_epi16(v_aa,
+        _mm256_alignr_epi8(v_bb, v_bb, 4)));
+    v_cmp = _mm256_or_si256(v_cmp, _mm256_cmpeq_epi16(v_aa,
+        _mm256_alignr_epi8(v_bb, v_bb, 6)));
+    __m128i v_any = _mm_or_si128(_mm256_castsi256_si128(v_cmp),
+                                 _mm256_extracti128_si256(v_cmp, 1));
+    return _mm_movemask_epi8(_mm_packs_epi16(v_any, _mm_setzero_si128()));
+}
+
+static const uint16_t* TARGET("avx2,popcnt")
+avx2_intersection(const uint16_t* restrict a, size_t a_size,
+                  const uint16_t* restrict b, size_t b_size,
+                  uint16_t* restrict result)
+{
+    // Same block structure as sse_intersection, with the comparison done by
+    // avx2_match. The matching lanes of `a` are then packed as before.
+    size_t i_a = 0, i_b = 0, count = 0;
+    size_t st_a = (a_size / 8) * 8;
+    size_t st_b = (b_size / 8) * 8;
+    while (i_a < st_a && i_b < st_b) {
+        __m128i v_a = _mm_loadu_si128((const __m128i *)&a[i_a]);
+        __m128i v_b = _mm_loadu_si128((const __m128i *)&b[i_b]);
+        int r = avx2_match(v_a, v_b);
+        _mm_storeu_si128((__m128i *)&result[count],
+                         _mm_shuffle_epi8(v_a, shuffle_mask16[r]));
+        count += _mm_popcnt_u32(r);
+        uint16_t a_max = a[i_a + 7], b_max = b[i_b + 7];
+        i_a += (a_max <= b_max) * 8;
+        i_b += (a_max >= b_max) * 8;
+    }
+    return naive_intersection(a + i_a, a_size - i_a, b + i_b, b_size - i_b,
+                              result + count);
+}
+
+static size_t TARGET("avx2,popcnt")
+avx2_intersection_count(const uint16_t* restrict a, size_t a_size,
+                        const uint16_t* restrict b, size_t b_size)
+{
+    size_t i_a = 0, i_b = 0, count = 0;
+    size_t st_a = (a_size / 8) * 8;
+    size_t st_b = (b_size / 8) * 8;
+    while (i_a < st_a && i_b < st_b) {
+        __m128i v_a = _mm_loadu_si128((const __m128i *)&a[i_a]);
+        __m128i v_b = _mm_loadu_si128((const __m128i *)&b[i_b]);
+        count += _mm_popcnt_u32(avx2_match(v_a, v_b));
+        uint16_t a_max = a[i_a + 7], b_max = b[i_b + 7];
+        i_a += (a_max <= b_max) * 8;
+        i_b += (a_max >= b_max) * 8;
+    }
+    return count + naive_intersection_count(a + i_a, a_size - i_a,
+                                            b + i_b, b_size - i_b);
+}
+
+static inline __m256i TARGET("avx2") avx2_popcount(__m256i v)
+{
+    // Count the bits in each 64-bit lane using a nibble lookup table.
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                            1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3,
+                                            1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0F);
+    __m256i low = _mm256_and_si256(v, low_mask);
+    __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, low),
+                                     _mm256_shuffle_epi8(lookup, high));
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+static inline void TARGET("avx2") avx2_csa(__m256i *high, __m256i *low,
+                                           __m256i b, __m256i c)
+{
+    // Carry-save adder: add b and c to the bits in `low`, leaving the sum
+    // bits in `low` and the carry bits in `high`.
+    __m256i u = _mm256_xor_si256(*low, b);
+    *high = _mm256_or_si256(_mm256_and_si256(*low, b), _mm256_and_si256(u, c));
+    *low = _mm256_xor_si256(u, c);
+}
+
+static inline __m256i TARGET("avx2") INLINE
+avx2_op(const bitset_word_t *a, const bitset_word_t *b, bitset_word_t *result,
+        unsigned i, unsigned op)
+{
+    // Apply the op to the i-th 256-bit vector and store the result, unless
+    // the result is NULL and the op is only being counted.
+    __m256i v_a = _mm256_loadu_si256((const __m256i *)&a[4 * i]);
+    __m256i v_b = _mm256_loadu_si256((const __m256i *)&b[4 * i]);
+    __m256i v_result;
+    if (op == OP_AND)
+        v_result = _mm256_and_si256(v_a, v_b);
+    else if (op == OP_OR)
+        v_result = _mm256_or_si256(v_a, v_b);
+    else if (op == OP_ANDNOT)
+        v_result = _mm256_andnot_si256(v_b, v_a);
+    else
+        v_result = _mm256_xor_si256(v_a, v_b);
+    if (result)
+        _mm256_storeu_si256((__m256i *)&result[4 * i], v_result);
+    return v_result;
+}
+
+static inline unsigned TARGET("avx2") INLINE
+avx2_bitset_op_inline(const bitset_word_t *a, const bitset_word_t *b,
+                      bitset_word_t *result, unsigned op)
+{
+    // Harley-Seal popcount (Mula, Kurz & Lemire): sixteen vectors at a time
+    // are reduced with a tree of carry-save adders, so only one vector in
+    // sixteen needs a full popcount.
+    __m256i total = _mm256_setzero_si256(), ones = total, twos = total;
+    __m256i fours = total, eights = total, sixteens;
+    __m256i twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+    for (unsigned i = 0; i < bitset_words / 4; i += 16) {
+        avx2_csa(&twos_a, &ones, avx2_op(a, b, result, i, op),
+                 avx2_op(a, b, result, i + 1, op));
+        avx2_csa(&twos_b, &ones, avx2_op(a, b, result, i + 2, op),
+                 avx2_op(a, b, result, i + 3, op));
+        avx2_csa(&fours_a, &twos, twos_a, twos_b);
+        avx2_csa(&twos_a, &ones, avx2_op(a, b, result, i + 4, op),
+                 avx2_op(a, b, result, i + 5, op));
+        avx2_csa(&twos_b, &ones, avx2_op(a, b, result, i + 6, op),
+                 avx2_op(a, b, result, i + 7, op));
+        avx2_csa(&fours_b, &twos, twos_a, twos_b);
+        avx2_csa(&eights_a, &fours, fours_a, fours_b);
+        avx2_csa(&twos_a, &ones, avx2_op(a, b, result, i + 8, op),
+                 avx2_op(a, b, result, i + 9, op));
+        avx2_csa(&twos_b, &ones, avx2_op(a, b, result, i + 10, op),
+                 avx2_op(a, b, result, i + 11, op));
+        avx2_csa(&fours_a, &twos, twos_a, twos_b);
+        avx2_csa(&twos_a, &ones, avx2_op(a, b, result, i + 12, op),
+                 avx2_op(a, b, result, i + 13, op));
+        avx2_csa(&twos_b, &ones, avx2_op(a, b, result, i + 14, op),
+                 avx2_op(a, b, result, i + 15, op));
+        avx2_csa(&fours_b, &twos, twos_a, twos_b);
+        avx2_csa(&eights_b, &fours, fours_a, fours_b);
+        avx2_csa(&sixteens, &eights, eights_a, eights_b);
+        total = _mm256_add_epi64(total, avx2_popcount(sixteens));
+    }
+    total = _mm256_slli_epi64(total, 4);
+    total = _mm256_add_epi64(total,
+                             _mm256_slli_epi64(avx2_popcount(eights), 3));
+    total = _mm256_add_epi64(total,
+                             _mm256_slli_epi64(avx2_popcount(fours), 2));
+    total = _mm256_add_epi64(total,
+                             _mm256_slli_epi64(avx2_popcount(twos), 1));
+    total = _mm256_add_epi64(total, avx2_popcount(ones));
+    return _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+           _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+}
+
+static unsigned TARGET("avx2") avx2_bitset_op(const bitset_word_t *a,
+                                              const bitset_word_t *b,
+                                              bitset_word_t *result,
+                                              unsigned op)
+{
+    // Branch on the op once so that each copy of the loop is specialized.
+    if (op == OP_AND)
+        return avx2_bitset_op_inline(a, b, result, OP_AND);
+    if (op == OP_OR)
+        return avx2_bitset_op_inline(a, b, result, OP_OR);
+    if (op == OP_ANDNOT)
+        return avx2_bitset_op_inline(a, b, result, OP_ANDNOT);
+    return avx2_bitset_op_inline(a, b, result, OP_XOR);
+}
+
+static unsigned TARGET("avx2") avx2_bitset_and_count(const bitset_word_t *a,
+                                                     const bitset_word_t *b)
+{
+    return avx2_bitset_op_inline(a, b, NULL, OP_AND);
+}
+
+static inline __m256i TARGET("avx2") avx2_shift_lanes(__m256i v, int lanes)
+{
+    // Shift the 16-bit lanes of v up by 1, 2 or 4 lanes, shifting in zeros.
+    __m256i v_low = _mm256_permute2x128_si256(v, v, 0x08);
+    if (lanes == 1)
+        return _mm256_alignr_epi8(v, v_low, 16 - 2);
+    if (lanes == 2)
+        return _mm256_alignr_epi8(v, v_low, 16 - 4);
+    return _mm256_alignr_epi8(v, v_low, 16 - 8);
+}
+
+static void TARGET("avx2") avx2_array_to_bitset(const uint16_t *array,
+                                                unsigned count,
+                                                bitset_word_t *bitset)
+{
+    // Compute the word and bit of sixteen items at a time. Sorted items that
+    // share a word are adjacent, so when some do, their bits are combined
+    // with a prefix OR and only the last item of each word is stored. This
+    // breaks the store-to-load dependency between items in the same word.
+    const __m256i one = _mm256_set1_epi32(1), low_bits = _mm256_set1_epi32(15);
+    // The words and masks are computed at 16-bit granularity.
+    uint16_t *halves = (uint16_t *)bitset;
+    uint16_t words[16], masks[16];
+    unsigned i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&array[i]);
+        __m256i v_low = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v));
+        __m256i v_high = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1));
+        v_low = _mm256_sllv_epi32(one, _mm256_and_si256(v_low, low_bits));
+        v_high = _mm256_sllv_epi32(one, _mm256_and_si256(v_high, low_bits));
+        __m256i v_masks = _mm256_permute4x64_epi64(
+            _mm256_packus_epi32(v_low, v_high), 0xD8);
+        __m256i v_words = _mm256_srli_epi16(v, 4);
+        __m256i v_next = _mm256_alignr_epi8(
+            _mm256_permute2x128_si256(v_words, v_words, 0x81), v_words, 2);
+        unsigned same = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi16(v_words, v_next)) & 0x3FFFFFFF;
+        if (same) {
+            for (int lanes = 1; lanes <= 8; lanes *= 2) {
+                __m256i v_shifted = lanes == 8
+                    ? _mm256_permute2x128_si256(v_words, v_words, 0x08)
+                    : avx2_shift_lanes(v_words, lanes);
+                __m256i v_carry = lanes == 8
+                    ? _mm256_permute2x128_si256(v_masks, v_masks, 0x08)
+                    : avx2_shift_lanes(v_masks, lanes);
+                __m256i v_cmp = _mm256_cmpeq_epi16(v_words, v_shifted);
+                v_masks = _mm256_or_si256(v_masks,
+                                          _mm256_and_si256(v_carry, v_cmp));
+            }
+        }
+        _mm256_storeu_si256((__m256i *)words, v_words);
+        _mm256_storeu_si256((__m256i *)masks, v_masks);
+        if (!same) {
+            for (int j = 0; j < 16; j++)
+                halves[words[j]] |= masks[j];
+            continue;
+        }
+        for (unsigned last = ~same & 0x55555555; last; last &= last - 1) {
+            int j = __builtin_ctz(last) / 2;
+            halves[words[j]] |= masks[j];
+        }
+    }
+    scalar_array_to_bitset(array + i, count - i, bitset);
+}
+
+static inline unsigned TARGET("avx512f,avx512vpopcntdq") INLINE
+avx512_bitset_op_inline(const bitset_word_t *a, const bitset_word_t *b,
+                        bitset_word_t *result, unsigned op)
+{
+    __m512i total = _mm512_setzero_si512();
+    for (unsigned i = 0; i < bitset_words; i += 8) {
+        __m512i v_a = _mm512_loadu_si512((const void *)&a[i]);
+        __m512i v_b = _mm512_loadu_si512((const void *)&b[i]);
+        __m512i v_result;
+        if (op == OP_AND)
+            v_result = _mm512_and_si512(v_a, v_b);
+        else if (op == OP_OR)
+            v_result = _mm512_or_si512(v_a, v_b);
+        else if (op == OP_ANDNOT)
+            v_result = _mm512_andnot_si512(v_b, v_a);
+        else
+            v_result = _mm512_xor_si512(v_a, v_b);
+        if (result)
+            _mm512_storeu_si512((void *)&result[i], v_result);
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(v_result));
+    }
+    return _mm512_reduce_add_epi64(total);
+}
+
+static unsigned TARGET("avx512f,avx512vpopcntdq")
+avx512_bitset_op(const bitset_word_t *a, const bitset_word_t *b,
+                 bitset_word_t *result, unsigned op)
+{
+    if (op == OP_AND)
+        return avx512_bitset_op_inline(a, b, result, OP_AND);
+    if (op == OP_OR)
+        return avx512_bitset_op_inline(a, b, result, OP_OR);
+    if (op == OP_ANDNOT)
+        return avx512_bitset_op_inline(a, b, result, OP_ANDNOT);
+    return avx512_bitset_op_inline(a, b, result, OP_XOR);
+}
+
+static unsigned TARGET("avx512f,avx512vpopcntdq")
+avx512_bitset_and_count(const bitset_word_t *a, const bitset_word_t *b)
+{
+    return avx512_bitset_op_inline(a, b, NULL, OP_AND);
+}
+
+static void TARGET("avx512f,avx512bw") avx512_array_to_bitset(
+    const uint16_t *array, unsigned count, bitset_word_t *bitset)
+{
+    // Like the AVX2 version, but with thirty-two items at a time. Shifts and
+    // permutes work on 16-bit lanes, so the masks needn't be widened to
+    // 32 bits and packed back, and lanes can be moved across the register.
+    static const uint16_t lanes[32] = {
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+        16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31
+    };
+    const __m512i one = _mm512_set1_epi16(1), low_bits = _mm512_set1_epi16(15);
+    const __m512i v_lanes = _mm512_loadu_si512(lanes);
+    const __m512i v_next_lanes = _mm512_add_epi16(v_lanes, one);
+    uint16_t *halves = (uint16_t *)bitset;
+    uint16_t words[32], masks[32];
+    unsigned i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m512i v = _mm512_loadu_si512(&array[i]);
+        __m512i v_words = _mm512_srli_epi16(v, 4);
+        __m512i v_masks = _mm512_sllv_epi16(one, _mm512_and_si512(v, low_bits));
+        uint32_t same = _mm512_cmpeq_epi16_mask(
+            v_words, _mm512_permutexvar_epi16(v_next_lanes, v_words)) &
+            0x7FFFFFFF;
+        if (same) {
+            for (unsigned shift = 1; shift < 32; shift *= 2) {
+                __m512i v_from = _mm512_sub_epi16(v_lanes,
+                                                  _mm512_set1_epi16(shift));
+                __mmask32 shifted = ~0u << shift;
+                __m512i v_shifted = _mm512_maskz_permutexvar_epi16(
+                    shifted, v_from, v_words);
+                __m512i v_carry = _mm512_maskz_permutexvar_epi16(
+                    shifted, v_from, v_masks);
+                v_masks = _mm512_mask_mov_epi16(
+                    v_masks, _mm512_cmpeq_epi16_mask(v_words, v_shifted),
+                    _mm512_or_si512(v_masks, v_carry));
+            }
+        }
+        _mm512_storeu_si512(words, v_words);
+        _mm512_storeu_si512(masks, v_masks);
+        if (!same) {
+            for (int j = 0; j < 32; j++)
+                halves[words[j]] |= masks[j];
+            continue;
+        }
+        for (uint32_t last = ~same; last; last &= last - 1) {
+            int j = __builtin_ctz(last);
+            halves[words[j]] |= masks[j];
+        }
+    }
+    scalar_array_to_bitset(array + i, count - i, bitset);
+}
+
+static uint16_t scalar_unpack_array(const unsigned char *packed,
+                                    unsigned width, unsigned count,
+                                    uint16_t *items, uint16_t next)
+{
+    // Each item is the next possible item plus its gap.
+    uint64_t mask = (1 << width) - 1;
+    for (unsigned i = 0, bit = 0; i < count; i++, bit += width) {
+        next += load_le64(packed + bit / 8) >> bit % 8 & mask;
+        items[i] = next++;
+    }
+    return next;
+}
+
+static __m128i unpack_shuffle[17][2];
+static __m128i unpack_multiplier[17][2];
+
+static void build_unpack_masks()
+{
+    // Eight gaps packed at `width` bits take exactly `width` bytes. For each
+    // width unpack_shuffle moves the (up to) three bytes that hold each gap
+    // into its own 32-bit lane, and unpack_multiplier shifts each lane left
+    // so that every gap starts at bit 8.
+    for (unsigned width = 0; width <= max_pack_width; width++) {
+        uint8_t shuffle[32];
+        uint32_t multiplier[8];
+        for (unsigned i = 0; i < 8; i++) {
+            unsigned bit = i * width;
+            for (unsigned j = 0; j < 4; j++)
+                shuffle[4 * i + j] = j < 3 && bit / 8 + j < 16 ?
+                                     bit / 8 + j : 0x80;
+            multiplier[i] = 1 << (8 - bit % 8);
+        }
+        for (unsigned i = 0; i < 2; i++) {
+            unpack_shuffle[width][i] =
+                _mm_loadu_si128((const __m128i *)shuffle + i);
+            unpack_multiplier[width][i] =
+                _mm_loadu_si128((const __m128i *)multiplier + i);
+        }
+    }
+}
+
+static uint16_t TARGET("sse4.2")
+sse_unpack_array(const unsigned char *packed, unsigned width, unsigned count,
+                 uint16_t *items, uint16_t next)
+{
+    // Unpack eight gaps at a time, then turn them into items with a prefix
+    // sum of (gap + 1) on top of the item before them.
+    const __m128i v_shuffle_lo = unpack_shuffle[width][0];
+    const __m128i v_shuffle_hi = unpack_shuffle[width][1];
+    const __m128i v_multiplier_lo = unpack_multiplier[width][0];
+    const __m128i v_multiplier_hi = unpack_multiplier[width][1];
+    const __m128i v_mask = _mm_set1_epi32((1 << width) - 1);
+    const __m128i v_one = _mm_set1_epi16(1);
+    const __m128i v_last = _mm_set1_epi16(0x0F0E);
+    __m128i v_previous = _mm_set1_epi16(next - 1);
+    unsigned i = 0;
+    for (; i + 8 <= count; i += 8, packed += width) {
+        __m128i v_packed = _mm_loadu_si128((const __m128i *)packed);
+        __m128i v_lo = _mm_shuffle_epi8(v_packed, v_shuffle_lo);
+        __m128i v_hi = _mm_shuffle_epi8(v_packed, v_shuffle_hi);
+        v_lo = _mm_srli_epi32(_mm_mullo_epi32(v_lo, v_multiplier_lo), 8);
+        v_hi = _mm_srli_epi32(_mm_mullo_epi32(v_hi, v_multiplier_hi), 8);
+        __m128i v_items = _mm_packus_epi32(_mm_and_si128(v_lo, v_mask),
+                                           _mm_and_si128(v_hi, v_mask));
+        v_items = _mm_add_epi16(v_items, v_one);
+        v_items = _mm_add_epi16(v_items, _mm_slli_si128(v_items, 2));
+        v_items = _mm_add_epi16(v_items, _mm_slli_si128(v_items, 4));
+        v_items = _mm_add_epi16(v_items, _mm_slli_si128(v_items, 8));
+        v_items = _mm_add_epi16(v_items, v_previous);
+        _mm_storeu_si128((__m128i *)(items + i), v_items);
+        v_previous = _mm_shuffle_epi8(v_items, v_last);
+    }
+    next = _mm_extract_epi16(v_previous, 0) + 1;
+    return scalar_unpack_array(packed, width, count - i, items + i, next);
+}
+
+static uint32_t crc32c_table[256];
+
+static void build_crc32c_table()
+{
+    // The reflected CRC-32C (Castagnoli) polynomial, the one implemented by
+    // the SSE4.2 crc32 instruction.
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t scalar_crc32c(uint32_t crc, const unsigned char *data,
+                              size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        crc = crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+static uint32_t TARGET("sse4.2")
+sse_crc32c(uint32_t crc, const unsigned char *data, size_t length)
+{
+    uint64_t crc64 = crc;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; i < length; i++)
+        crc = _mm_crc32_u8(crc, data[i]);
+    return crc;
+}
+
+const static rset_kernels_t scalar_kernels = {
+    naive_intersection, naive_union, scalar_bitset_op,
+    scalar_array_to_bitset, scalar_bitset_extract16, scalar_bitset_extract32,
+    naive_intersection_count, scalar_bitset_and_count, scalar_crc32c,
+    scalar_unpack_array
+};
+
+const static rset_kernels_t sse_kernels = {
+    sse_intersection, sse_union, sse_bitset_op,
+    scalar_array_to_bitset, sse_bitset_extract16, sse_bitset_extract32,
+    sse_intersection_count, sse_bitset_and_count, sse_crc32c,
+    sse_unpack_array
+};
+
+const static rset_kernels_t avx2_kernels = {
+    avx2_intersection, sse_union, avx2_bitset_op,
+    avx2_array_to_bitset, sse_bitset_extract16, sse_bitset_extract32,
+    avx2_intersection_count, avx2_bitset_and_count, sse_crc32c,
+    sse_unpack_array
+};
+
+const static rset_kernels_t avx512_kernels = {
+    avx2_intersection, sse_union, avx512_bitset_op,
+    avx512_array_to_bitset, sse_bitset_extract16, sse_bitset_extract32,
+    avx2_intersection_count, avx512_bitset_and_count, sse_crc32c,
+    sse_unpack_array
+};
+
+static void __attribute__ ((constructor)) rset_init_kernels()
+{
+    // Pick the kernels once at startup. RSET_ISA can be set to "scalar",
+    // "sse4.2", "avx2" or "avx512" to cap the instruction set, e.g. to test
+    // the fallbacks on a machine that supports AVX-512.
+    const char *isa = getenv("RSET_ISA");
+    unsigned level = 3;
+    if (isa && !strcmp(isa, "scalar"))
+        level = 0;
+    else if (isa && !strcmp(isa, "sse4.2"))
+        level = 1;
+    else if (isa && !strcmp(isa, "avx2"))
+        level = 2;
+    else if (isa && !strcmp(isa, "avx512"))
+        level = 3;
+
+    // The lookup tables are built here rather than on first use so that
+    // they're never written once other threads can read them.
+    build_shuffle_mask16();
+    build_crc32c_table();
+    build_unpack_masks();
+    __builtin_cpu_init();
+    kernels = scalar_kernels;
+    if (level < 1 || !__builtin_cpu_supports("sse4.2") ||
+        !__builtin_cpu_supports("popcnt"))
+        return;
+    kernels = sse_kernels;
+    if (level < 2 || !__builtin_cpu_supports("avx2"))
+        return;
+    kernels = avx2_kernels;
+    if (level < 3 || !__builtin_cpu_supports("avx512f") ||
+        !__builtin_cpu_supports("avx512bw") ||
+        !__builtin_cpu_supports("avx512vpopcntdq"))
+        return;
+    kernels = avx512_kernels;
+}
+
+static const uint16_t *gallop_intersection(const uint16_t *small,
+                                           size_t small_size,
+                                           const uint16_t *large,
+                                           size_t large_size,
+                                           uint16_t *result)
+{
+    unsigned j = 0;
+    for (size_t i = 0; i < small_size; i++) {
+        j = rset_gallop(large, large_size, j, small[i]);
+        if (j == large_size)
+            break;
+        *result = small[i];
+        result += large[j] == small[i];
+    }
+    return result;
+}
+
+static size_t gallop_intersection_count(const uint16_t *small,
+                                        size_t small_size,
+                                        const uint16_t *large,
+                                        size_t large_size)
+{
+    size_t count = 0;
+    unsigned j = 0;
+    for (size_t i = 0; i < small_size; i++) {
+        j = rset_gallop(large, large_size, j, small[i]);
+        if (j == large_size)
+            break;
+        count += large[j] == small[i];
+    }
+    return count;
+}
+
+static const uint16_t *gallop_difference(const uint16_t *small,
+                                         size_t small_size,
+                                         const uint16_t *large,
+                                         size_t large_size, uint16_t *result)
+{
+    unsigned j = 0;
+    for (size_t i = 0; i < small_size; i++) {
+        j = rset_gallop(large, large_size, j, small[i]);
+        *result = small[i];
+        result += j == large_size || large[j] != small[i];
+    }
+    return result;
+}
+
+static const uint16_t *array_intersection(const uint16_t *a, size_t a_size,
+                                          const uint16_t *b, size_t b_size,
+                                          uint16_t *result)
+{
+    // The merge kernels are linear in the size of both arrays, so when one
+    // is much smaller its items are galloped through the other instead.
+    if (a_size * gallop_factor < b_size)
+        return gallop_intersection(a, a_size, b, b_size, result);
+    if (b_size * gallop_factor < a_size)
+        return gallop_intersection(b, b_size, a, a_size, result);
+    return kernels.intersection(a, a_size, b, b_size, result);
+}
+
+static size_t array_intersection_count(const uint16_t *a, size_t a_size,
+                                       const uint16_t *b, size_t b_size)
+{
+    if (a_size * gallop_factor < b_size)
+        return gallop_intersection_count(a, a_size, b, b_size);
+    if (b_size * gallop_factor < a_size)
+        return gallop_intersection_count(b, b_size, a, a_size);
+    return kernels.intersection_count(a, a_size, b, b_size);
+}
+
+static bool rset_intersection_array(const rset_t *a, const rset_t *b,
+                                    rset_t *result)
+{
+    unsigned result_size = MAX(rset_count(a), rset_count(b));
+    if (!rset_grow_to(result, result_size))
+        return false;
+    const uint16_t *end = \
+        array_intersection(rset_items(a), rset_count(a),
+                           rset_items(b), rset_count(b),
+                           rset_items(result));
+    unsigned cardinality = end - rset_items(result);
+    rset_set_header(result, RSET_ARRAY, cardinality, cardinality);
+    return true;
+}
+
+static unsigned rset_intersection_bitset(const rset_t *a, const rset_t *b,
+                                         rset_t *result)
+{
+    return kernels.bitset_op(rset_bitset(a), rset_bitset(b), rset_bitset(result),
+                             OP_AND);
+}
+
+static bool rset_intersection_run_run(const rset_t *a, const rset_t *b,
+                                      rset_t *result)
+{
+    // The intersection has fewer runs than the operands combined, which may
+    // be more than fit the largest buffer, so the runs are built on the
+    // stack.
+    unsigned a_count = rset_count(a) / 2, b_count = rset_count(b) / 2;
+    uint16_t runs[2 * max_capacity];
+    const uint16_t *runs_a = rset_items(a), *runs_b = rset_items(b);
+    unsigned i = 0, j = 0, count = 0, cardinality = 0;
+    while (i < a_count && j < b_count) {
+        unsigned a_start = runs_a[2 * i], a_end = a_start + runs_a[2 * i + 1];
+        unsigned b_start = runs_b[2 * j], b_end = b_start + runs_b[2 * j + 1];
+        unsigned start = MAX(a_start, b_start), end = MIN(a_end, b_end);
+        if (start <= end) {
+            runs[2 * count] = start;
+            runs[2 * count + 1] = end - start;
+            cardinality += end - start + 1;
+            count++;
+        }
+        i += a_end <= b_end;
+        j += b_end <= a_end;
+    }
+    if (!cardinality)
+        return rset_truncate(result);
+    return rset_load_runs(result, runs, count, cardinality);
+}
+
+static bool rset_intersection_run_array(const rset_t *runs_set,
+                                        const rset_t *array_set,
+                                        rset_t *result)
+{
+    unsigned count = rset_count(array_set), runs_count = rset_count(runs_set);
+    if (!rset_grow_to(result, count))
+        return false;
+    const uint16_t *runs = rset_items(runs_set), *array = rset_items(array_set);
+    uint16_t *ptr = rset_items(result);
+    for (unsigned i = 0, j = 0; i < count && j < runs_count; ) {
+        unsigned end = runs[j] + runs[j + 1];
+        if (end < array[i]) {
+            j += 2;
+        } else {
+            if (runs[j] <= array[i])
+                *ptr++ = array[i];
+            i++;
+        }
+    }
+    unsigned cardinality = ptr - rset_items(result);
+    rset_set_header(result, RSET_ARRAY, cardinality, cardinality);
+    return true;
+}
+
+static bool rset_intersection_run(const rset_t *a, const rset_t *b,
+                                  rset_t *result)
+{
+    if (!rset_is_run(a)) {
+        const rset_t *swap = a;
+        a = b;
+        b = swap;
+    }
+    if (rset_is_run(b))
+        return rset_intersection_run_run(a, b, result);
+    if (rset_is_array(b))
+        return rset_intersection_run_array(a, b, result);
+
+    // Expand the runs into the result and then mask out the items that
+    // aren't in the bitset or inverted array.
+    if (!rset_grow_to(result, max_size))
+        return false;
+    bitset_word_t *bitset = rset_bitset(result);
+    const uint16_t *items = rset_items(b);
+    rset_to_bitset(a, bitset);
+    unsigned cardinality;
+    if (rset_is_bitset(b)) {
+        cardinality = kernels.bitset_op(bitset, rset_bitset(b), bitset, OP_AND);
+    } else {
+        cardinality = rset_cardinality(a);
+        for (unsigned i = 0; i < rset_count(b); i++) {
+            uint64_t bit = 1ULL << (items[i] & 0x3F);
+            cardinality -= (bitset[items[i] >> 6] & bit) != 0;
+            bitset[items[i] >> 6] &= ~bit;
+        }
+    }
+    rset_set_header(result, RSET_BITSET, max_size, cardinality);
+    return rset_optimize(result);
+}
+
+static const uint16_t *array_op(const uint16_t *a, size_t a_size,
+                                const uint16_t *b, size_t b_size,
+                                uint16_t *result, unsigned op)
+{
+    if (op == OP_AND)
+        return array_intersection(a, a_size, b, b_size, result);
+    if (op == OP_OR)
+        return kernels.union_(a, a_size, b, b_size, result);
+    if (op == OP_ANDNOT && a_size * gallop_factor < b_size)
+        return gallop_difference(a, a_size, b, b_size, result);
+    if (op == OP_ANDNOT)
+        return naive_difference(a, a_size, b, b_size, result);
+    return naive_xor(a, a_size, b, b_size, result);
+}
+
+static bool NOINLINE rset_array_op_large(const rset_t *a, const rset_t *b,
+                                         rset_t *result, unsigned op,
+                                         unsigned type)
+{
+    // The result may not fit the largest buffer, so build it on the stack.
+    uint16_t items[2 * max_capacity];
+    unsigned count = array_op(rset_items(a), rset_count(a), rset_items(b),
+                              rset_count(b), items, op) - items;
+    return rset_load_items(result, items, count, type) &&
+           rset_normalize(result);
+}
+
+static bool rset_apply_array(const rset_t *a, const rset_t *b, rset_t *result,
+                             unsigned op)
+{
+    // Both operands are arrays or inverted arrays. An inverted array is the
+    // complement of its items, so each op reduces to an op on the two sorted
+    // arrays whose result is possibly inverted, e.g. ~A | B => ~(A \ B).
+    bool invert_a = rset_is_inverted_array(a);
+    bool invert_b = rset_is_inverted_array(b);
+    bool invert = false, swap = false;
+    if (op == OP_AND) {
+        // ~A & B => B \ A, A & ~B => A \ B, ~A & ~B => ~(A | B)
+        if (invert_a && invert_b) {
+            op = OP_OR;
+            invert = true;
+        } else if (invert_a || invert_b) {
+            op = OP_ANDNOT;
+            swap = invert_a;
+        }
+    } else if (op == OP_OR) {
+        // ~A | B => ~(A \ B), A | ~B => ~(B \ A), ~A | ~B => ~(A & B)
+        invert = invert_a || invert_b;
+        if (invert_a && invert_b) {
+            op = OP_AND;
+        } else if (invert_a || invert_b) {
+            op = OP_ANDNOT;
+            swap = invert_b;
+        }
+    } else if (op == OP_ANDNOT) {
+        // ~A \ B => ~(A | B), A \ ~B => A & B, ~A \ ~B => B \ A
+        if (invert_a && invert_b) {
+            swap = true;
+        } else if (invert_a) {
+            op = OP_OR;
+            invert = true;
+        } else if (invert_b) {
+            op = OP_AND;
+        }
+    } else {
+        // ~A ^ B => ~(A ^ B)
+        invert = invert_a != invert_b;
+    }
+    if (swap) {
+        const rset_t *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    unsigned type = invert ? RSET_INVERTED_ARRAY : RSET_ARRAY;
+    unsigned count = rset_count(a) + rset_count(b);
+    if (count > max_capacity)
+        return rset_array_op_large(a, b, result, op, type);
+    if (!rset_grow_to(result, count))
+        return false;
+    const uint16_t *end = array_op(rset_items(a), rset_count(a),
+                                   rset_items(b), rset_count(b),
+                                   rset_items(result), op);
+    count = end - rset_items(result);
+    rset_set_header(result, type, count,
+                    invert ? max_cardinality - count : count);
+    return rset_normalize(result);
+}
+
+static bool rset_filter_array(const rset_t *set, const rset_t *bitset,
+                              rset_t *result, bool present, unsigned type)
+{
+    // Keep the items of an array or inverted array that are present (or
+    // absent) in the bitset.
+    unsigned count = rset_count(set);
+    if (!rset_grow_to(result, count))
+        return false;
+    const uint16_t *items = rset_items(set);
+    const bitset_word_t *bits = rset_bitset(bitset);
+    uint16_t *ptr = rset_items(result);
+    for (unsigned i = 0; i < count; i++) {
+        bool bit = bits[items[i] >> 6] >> (items[i] & 0x3F) & 1;
+        *ptr = items[i];
+        ptr += bit == present;
+    }
+    count = ptr - rset_items(result);
+    rset_set_header(result, type, count,
+                    type == RSET_ARRAY ? count : max_cardinality - count);
+    return true;
+}
+
+static bool rset_modify_bitset(const rset_t *set, const rset_t *bitset,
+                               rset_t *result, unsigned op, bool invert)
+{
+    // Copy the bitset and then set (OP_OR), clear (OP_ANDNOT) or toggle
+    // (OP_XOR) the bit of each item in an array or inverted array.
+    if (!rset_grow_to(result, max_size))
+        return false;
+    bitset_word_t *bits = rset_bitset(result);
+    if (bitset != result)
+        memcpy(bits, rset_items(bitset), bitset_words * sizeof(uint64_t));
+    const uint16_t *items = rset_items(set);
+    unsigned count = rset_count(set), cardinality = rset_cardinality(bitset);
+    for (unsigned i = 0; i < count; i++) {
+        unsigned offset = items[i] >> 6;
+        uint64_t bit = 1ULL << (items[i] & 0x3F);
+        bool present = bits[offset] & bit;
+        if (op == OP_OR) {
+            bits[offset] |= bit;
+            cardinality += !present;
+        } else if (op == OP_ANDNOT) {
+            bits[offset] &= ~bit;
+            cardinality -= present;
+        } else {
+            bits[offset] ^= bit;
+            cardinality += present ? -1 : 1;
+        }
+    }
+    if (invert) {
+        for (unsigned i = 0; i < bitset_words; i++)
+            bits[i] = ~bits[i];
+        cardinality = max_cardinality - cardinality;
+    }
+    rset_set_header(result, RSET_BITSET, max_size, cardinality);
+    return true;
+}
+
+static bool rset_apply_bitset(const rset_t *a, const rset_t *b,
+                              rset_t *result, unsigned op)
+{
+    if (rset_is_bitset(a) && rset_is_bitset(b)) {
+        if (!rset_grow_to(result, max_size))
+            return false;
+        unsigned cardinality = kernels.bitset_op(rset_bitset(a), rset_bitset(b),
+                                                 rset_bitset(result), op);
+        rset_set_header(result, RSET_BITSET, max_size, cardinality);
+        return rset_normalize(result);
+    }
+
+    // One operand is a bitset and the other is an array or inverted array.
+    // Depending on the op it's cheaper to either filter the array against
+    // the bitset, or to copy the bitset and apply the array to it.
+    const rset_t *set = rset_is_bitset(a) ? b : a;
+    const rset_t *bitset = rset_is_bitset(a) ? a : b;
+    bool inverted = rset_is_inverted_array(set), success;
+    if (op == OP_AND) {
+        // A & B => filter, ~A & B => B \ A
+        success = inverted
+            ? rset_modify_bitset(set, bitset, result, OP_ANDNOT, false)
+            : rset_filter_array(set, bitset, result, true, RSET_ARRAY);
+    } else if (op == OP_OR) {
+        // A | B => set bits, ~A | B => ~(A \ B)
+        success = inverted
+            ? rset_filter_array(set, bitset, result, false,
+                                RSET_INVERTED_ARRAY)
+            : rset_modify_bitset(set, bitset, result, OP_OR, false);
+    } else if (op == OP_XOR) {
+        // ~A ^ B => ~(A ^ B)
+        success = rset_modify_bitset(set, bitset, result, OP_XOR, inverted);
+    } else if (set == a) {
+        // A \ B => filter, ~A \ B => ~(A | B)
+        success = inverted
+            ? rset_modify_bitset(set, bitset, result, OP_OR, true)
+            : rset_filter_array(set, bitset, result, false, RSET_ARRAY);
+    } else {
+        // B \ A => clear bits, B \ ~A => A & B
+        success = inverted
+            ? rset_filter_array(set, bitset, result, true, RSET_ARRAY)
+            : rset_modify_bitset(set, bitset, result, OP_ANDNOT, false);
+    }
+    return success && rset_normalize(result);
+}
+
+static bool rset_init_bitset(rset_t *copy, const rset_t *set)
+{
+    if (!rset_init_size(copy, max_size))
+        return false;
+    rset_to_bitset(set, rset_bitset(copy));
+    rset_set_header(copy, RSET_BITSET, max_size, rset_cardinality(set));
+    return true;
+}
+
+static bool rset_apply(const rset_t *a, const rset_t *b, rset_t *result,
+                       unsigned op);
+
+static bool rset_apply_run(const rset_t *a, const rset_t *b, rset_t *result,
+                           unsigned op)
+{
+    // Expand run operands into temporary bitsets, and then pick the smallest
+    // representation for the result since it's likely made up of runs.
+    rset_t a_bitset, b_bitset;
+    bool a_run = rset_is_run(a), b_run = rset_is_run(b), success = false;
+    if (a_run && !rset_init_bitset(&a_bitset, a))
+        return false;
+    if (b_run && !rset_init_bitset(&b_bitset, b))
+        goto done;
+    success = rset_apply(a_run ? &a_bitset : a, b_run ? &b_bitset : b,
+                         result, op) && rset_optimize(result);
+    if (b_run)
+        rset_destroy(&b_bitset);
+done:
+    if (a_run)
+        rset_destroy(&a_bitset);
+    return success;
+}
+
+static bool rset_apply(const rset_t *a, const rset_t *b, rset_t *result,
+                       unsigned op)
+{
+    if (rset_is_run(a) || rset_is_run(b))
+        return rset_apply_run(a, b, result, op);
+    if (rset_is_bitset(a) || rset_is_bitset(b))
+        return rset_apply_bitset(a, b, result, op);
+    return rset_apply_array(a, b, result, op);
+}
+
+bool rset_intersection(const rset_t *a, const rset_t *b, rset_t *result)
+{
+    if (rset_is_empty(a) || rset_is_empty(b)) // A & 0 => 0
+        return rset_truncate(result);
+    if (rset_is_full(a)) // A & U => A
+        return rset_copy_to(b, result);
+    else if (rset_is_full(b))
+        return rset_copy_to(a, result);
+    if (rset_is_array(a) && rset_is_array(b))
+        return rset_intersection_array(a, b, result);
+    if (rset_is_run(a) || rset_is_run(b))
+        return rset_intersection_run(a, b, result);
+
+    if (rset_is_bitset(a) && rset_is_bitset(b)) {
+        if (!rset_grow_to(result, max_size))
+            return false;
+        unsigned cardinality = rset_intersection_bitset(a, b, result);
+        if (!cardinality)
+            return rset_truncate(result);
+        rset_set_header(result, RSET_BITSET, max_size, cardinality);
+        return rset_normalize(result);
+    }
+
+    // Arrays are probed against bitsets, and inverted arrays either reduce
+    // to array kernels or are cleared from a copy of the bitset.
+    return rset_apply(a, b, result, OP_AND);
+}
+
+bool rset_union(const rset_t *a, const rset_t *b, rset_t *result)
+{
+    if (rset_is_full(a) || rset_is_full(b)) // A | U => U
+        return rset_fill(result);
+    if (rset_is_empty(a)) // 0 | B => B
+        return rset_copy_to(b, result);
+    if (rset_is_empty(b))
+        return rset_copy_to(a, result);
+    return rset_apply(a, b, result, OP_OR);
+}
+
+bool rset_difference(const rset_t *a, const rset_t *b, rset_t *result)
+{
+    if (rset_is_empty(a) || rset_is_full(b)) // 0 \ B => 0, A \ U => 0
+        return rset_truncate(result);
+    if (rset_is_empty(b)) // A \ 0 => A
+        return rset_copy_to(a, result);
+    if (rset_is_full(a)) // U \ B => ~B
+        return rset_invert(b, result);
+    return rset_apply(a, b, result, OP_ANDNOT);
+}
+
+bool rset_xor(const rset_t *a, const rset_t *b, rset_t *result)
+{
+    if (rset_is_empty(a)) // 0 ^ B => B
+        return rset_copy_to(b, result);
+    if (rset_is_empty(b))
+        return rset_copy_to(a, result);
+    if (rset_is_full(a)) // U ^ B => ~B
+        return rset_invert(b, result);
+    if (rset_is_full(b))
+        return rset_invert(a, result);
+    return rset_apply(a, b, result, OP_XOR);
+}
+
+static bool rset_filter_items(rset_t *set, const rset_t *other, bool present)
+{
+    // Keep the items of an array or inverted array that are present (or
+    // absent) in the other set. Items are only ever moved towards the front,
+    // so they're compacted in place, except for the intersection of two
+    // arrays which goes through the SIMD kernel and a scratch buffer.
+    uint16_t *items = rset_items(set);
+    const uint16_t *other_items = rset_items(other);
+    unsigned count = rset_count(set), other_count = rset_count(other);
+    unsigned kept = 0;
+    if (rset_is_bitset(other)) {
+        const bitset_word_t *bits = rset_bitset(other);
+        for (unsigned i = 0; i < count; i++) {
+            bool bit = bits[items[i] >> 6] >> (items[i] & 0x3F) & 1;
+            items[kept] = items[i];
+            kept += bit == present;
+        }
+    } else if (rset_is_run(other)) {
+        for (unsigned i = 0, j = 0; i < count; i++) {
+            while (j < other_count &&
+                   other_items[j] + other_items[j + 1] < items[i])
+                j += 2;
+            bool bit = j < other_count && other_items[j] <= items[i];
+            items[kept] = items[i];
+            kept += bit == present;
+        }
+    } else if (count * gallop_factor < other_count) {
+        // Gallop the few items through the much larger array.
+        bool match = present != rset_is_inverted_array(other);
+        for (unsigned i = 0, j = 0; i < count; i++) {
+            j = rset_gallop(other_items, other_count, j, items[i]);
+            bool found = j < other_count && other_items[j] == items[i];
+            items[kept] = items[i];
+            kept += found == match;
+        }
+    } else if (present != rset_is_inverted_array(other) &&
+               other_count * gallop_factor < count) {
+        // Gallop the other items through the set's items. Each match is
+        // found at or after the position it's written to.
+        for (unsigned i = 0, j = 0; j < other_count; j++) {
+            i = rset_gallop(items, count, i, other_items[j]);
+            if (i == count)
+                break;
+            items[kept] = items[i];
+            kept += items[i] == other_items[j];
+        }
+    } else if (present != rset_is_inverted_array(other)) {
+        size_t length = MAX(count, other_count) * sizeof(uint16_t);
+        uint16_t *scratch = rset_allocate(length);
+        if (!scratch)
+            return false;
+        kept = kernels.intersection(items, count, other_items, other_count,
+                                    scratch) - scratch;
+        memcpy(items, scratch, kept * sizeof(uint16_t));
+        rset_deallocate(scratch, length);
+    } else {
+        for (unsigned i = 0, j = 0; i < count; i++) {
+            while (j < other_count && other_items[j] < items[i])
+                j++;
+            items[kept] = items[i];
+            kept += j == other_count || other_items[j] != items[i];
+        }
+    }
+    rset_set_header(set, rset_type(set), kept,
+                    rset_is_array(set) ? kept : max_cardinality - kept);
+    return true;
+}
+
+static bool rset_merge_items(rset_t *set, const rset_t *other)
+{
+    // Merge the items of another array or inverted array into the items of
+    // an array or inverted array, using the SIMD union kernel and a scratch
+    // buffer. The set is only reallocated if the merged items don't fit, and
+    // never past max_capacity.
+    unsigned count = rset_count(set), other_count = rset_count(other);
+    size_t length = (count + other_count) * sizeof(uint16_t);
+    uint16_t *scratch = rset_allocate(length);
+    if (!scratch)
+        return false;
+    count = kernels.union_(rset_items(set), count, rset_items(other),
+                           other_count, scratch) - scratch;
+    bool success = rset_load_items(set, scratch, count, rset_type(set));
+    rset_deallocate(scratch, length);
+    return success;
+}
+
+static void rset_clear_gaps(rset_t *set, const rset_t *runs_set)
+{
+    // Clear the bits of a bitset that aren't covered by a run.
+    bitset_word_t *bitset = rset_bitset(set);
+    const uint16_t *runs = rset_items(runs_set);
+    unsigned count = rset_count(runs_set), next = 0;
+    for (unsigned i = 0; i < count; next = runs[i] + runs[i + 1] + 1, i += 2)
+        if (runs[i] > next)
+            bitset_clear_range(bitset, next, runs[i] - 1);
+    if (next <= max_item)
+        bitset_clear_range(bitset, next, max_item);
+}
+
+static void rset_swap(rset_t *a, rset_t *b)
+{
+    uint16_t *buffer = a->buffer;
+    unsigned size = a->size;
+    a->buffer = b->buffer;
+    a->size = b->size;
+    b->buffer = buffer;
+    b->size = size;
+}
+
+static bool rset_apply_inplace(rset_t *set, const rset_t *other, unsigned op)
+{
+    // The representation of the result differs from both operands, so it's
+    // built separately and then swapped in.
+    rset_t result;
+    if (!rset_init(&result))
+        return false;
+    bool success;
+    if (op == OP_AND)
+        success = rset_intersection(set, other, &result);
+    else if (op == OP_OR)
+        success = rset_union(set, other, &result);
+    else
+        success = rset_difference(set, other, &result);
+    if (success)
+        rset_swap(set, &result);
+    rset_destroy(&result);
+    return success;
+}
+
+static bool rset_modify_inplace(rset_t *set, const rset_t *other, unsigned op)
+{
+    // Change a bitset in place. Bitsets are combined word-wise, runs set or
+    // clear whole ranges, and the items of arrays and inverted arrays are
+    // applied one at a time.
+    if (rset_is_bitset(other)) {
+        unsigned cardinality = kernels.bitset_op(rset_bitset(set),
+                                                 rset_bitset(other),
+                                                 rset_bitset(set), op);
+        rset_set_header(set, RSET_BITSET, max_size, cardinality);
+    } else if (rset_is_run(other)) {
+        const uint16_t *runs = rset_items(other);
+        bitset_word_t *bitset = rset_bitset(set);
+        if (op == OP_AND) {
+            rset_clear_gaps(set, other);
+        } else {
+            for (unsigned i = 0; i < rset_count(other); i += 2) {
+                unsigned start = runs[i], end = start + runs[i + 1];
+                if (op == OP_OR)
+                    bitset_set_range(bitset, start, end);
+                else
+                    bitset_clear_range(bitset, start, end);
+            }
+        }
+        unsigned cardinality = bitset_count_range(bitset, 0, max_item);
+        rset_set_header(set, RSET_BITSET, max_size, cardinality);
+    } else {
+        // A & ~B => A \ B, A | B => set bits, A \ B => clear bits
+        op = op == OP_OR ? OP_OR : OP_ANDNOT;
+        if (!rset_modify_bitset(other, set, set, op, false))
+            return false;
+    }
+    return rset_normalize(set);
+}
+
+static bool rset_combine_inplace(rset_t *set, const rset_t *other,
+                                 unsigned op)
+{
+    // Find the representation of the result. Arrays and inverted arrays are
+    // filtered or merged in place, and bitsets are modified in place when the
+    // result is still a bitset (or close to it).
+    bool array = rset_is_array(set), inverted = rset_is_inverted_array(set);
+    bool other_array = rset_is_array(other);
+    bool other_inverted = rset_is_inverted_array(other);
+    if (array && op != OP_OR) {
+        // A & B => filter, A \ B => filter
+        return rset_filter_items(set, other, op == OP_AND) &&
+            rset_normalize(set);
+    }
+    if (inverted && op == OP_OR) {
+        // ~A | B => ~(A \ B)
+        return rset_filter_items(set, other, false) && rset_normalize(set);
+    }
+    if ((array && op == OP_OR && other_array) ||
+        (inverted && op == OP_AND && other_inverted) ||
+        (inverted && op == OP_ANDNOT && other_array)) {
+        // A | B, ~A & ~B => ~(A | B), ~A \ B => ~(A | B)
+        return rset_merge_items(set, other) && rset_normalize(set);
+    }
+    if (rset_is_bitset(set) && !(op == OP_OR && other_inverted) &&
+        !(op == OP_ANDNOT && other_inverted) &&
+        !(op == OP_AND && other_array))
+        return rset_modify_inplace(set, other, op);
+    return rset_apply_inplace(set, other, op);
+}
+
+bool rset_and_inplace(rset_t *a, const rset_t *b)
+{
+    if (a == b || rset_is_empty(a) || rset_is_full(b)) // A & U => A
+        return true;
+    if (rset_is_empty(b)) // A & 0 => 0
+        return rset_truncate(a);
+    if (rset_is_full(a)) // U & B => B
+        return rset_copy_to(b, a);
+    return rset_combine_inplace(a, b, OP_AND);
+}
+
+bool rset_or_inplace(rset_t *a, const rset_t *b)
+{
+    if (a == b || rset_is_full(a) || rset_is_empty(b)) // A | 0 => A
+        return true;
+    if (rset_is_full(b)) // A | U => U
+        return rset_fill(a);
+    if (rset_is_empty(a)) // 0 | B => B
+        return rset_copy_to(b, a);
+    return rset_combine_inplace(a, b, OP_OR);
+}
+
+bool rset_andnot_inplace(rset_t *a, const rset_t *b)
+{
+    if (a == b || rset_is_full(b)) // A \ A => 0, A \ U => 0
+        return rset_truncate(a);
+    if (rset_is_empty(a) || rset_is_empty(b)) // A \ 0 => A
+        return true;
+    if (rset_is_full(a)) // U \ B => ~B
+        return rset_invert(b, a);
+    return rset_combine_inplace(a, b, OP_ANDNOT);
+}
+
+static int rset_compare_cardinality(const void *a, const void *b)
+{
+    unsigned a_cardinality = rset_cardinality(*(const rset_t **)a);
+    unsigned b_cardinality = rset_cardinality(*(const rset_t **)b);
+    return (a_cardinality > b_cardinality) - (a_cardinality < b_cardinality);
+}
+
+static bool rset_aliases(const rset_t **sets, size_t n, const rset_t *set)
+{
+    for (size_t i = 0; i < n; i++)
+        if (sets[i] == set)
+            return true;
+    return false;
+}
+
+bool rset_intersection_many(const rset_t **sets, size_t n, rset_t *out)
+{
+    // Start with the smallest set and intersect it with the others in order
+    // of increasing cardinality, so the result only ever shrinks and the
+    // loop can stop as soon as it's empty. Full sets don't change the result.
+    if (!n)
+        return rset_fill(out);
+    const rset_t **sorted = rset_allocate(n * sizeof(rset_t *));
+    if (!sorted)
+        return false;
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++)
+        if (!rset_is_full(sets[i]))
+            sorted[count++] = sets[i];
+    qsort(sorted, count, sizeof(rset_t *), rset_compare_cardinality);
+
+    rset_t temporary, *result = out;
+    bool success = true;
+    if (!count) {
+        rset_fill(out);
+        goto done;
+    }
+    if (rset_aliases(sorted + 1, count - 1, out)) {
+        if (!(success = rset_init(&temporary)))
+            goto done;
+        result = &temporary;
+    }
+    success = rset_copy_to(sorted[0], result);
+    for (size_t i = 1; success && i < count && !rset_is_empty(result); i++)
+        success = rset_and_inplace(result, sorted[i]);
+    if (result != out) {
+        if (success)
+            rset_swap(out, result);
+        rset_destroy(result);
+    }
+done:
+    rset_deallocate(sorted, n * sizeof(rset_t *));
+    return success;
+}
+
+static void bitset_or_gaps(bitset_word_t *bitset, const uint16_t *missing,
+                           unsigned count)
+{
+    // Set every bit except the missing items of an inverted array.
+    unsigned next = 0;
+    for (unsigned i = 0; i < count; next = missing[i++] + 1)
+        if (missing[i] > next)
+            bitset_set_range(bitset, next, missing[i] - 1);
+    if (next <= max_item)
+        bitset_set_range(bitset, next, max_item);
+}
+
+bool rset_union_many(const rset_t **sets, size_t n, rset_t *out)
+{
+    // Small arrays are merged. Otherwise every set is ORed into a single
+    // bitset without counting, and the cardinality is computed once at the
+    // end.
+    size_t total = 0;
+    bool arrays = true, runs = false;
+    for (size_t i = 0; i < n; i++) {
+        if (rset_is_full(sets[i]))
+            return rset_fill(out);
+        total += rset_cardinality(sets[i]);
+        arrays = arrays && rset_is_array(sets[i]);
+        runs = runs || rset_is_run(sets[i]);
+    }
+
+    rset_t temporary, *result = out;
+    if (rset_aliases(sets, n, out)) {
+        if (!rset_init(&temporary))
+            return false;
+        result = &temporary;
+    }
+    bool success = true;
+    if (arrays && total <= low_cutoff) {
+        rset_truncate(result);
+        for (size_t i = 0; success && i < n; i++)
+            success = rset_or_inplace(result, sets[i]);
+        goto done;
+    }
+    if (!(success = rset_grow_to(result, max_size)))
+        goto done;
+    bitset_word_t *bitset = rset_bitset(result);
+    memset(bitset, 0, bitset_words * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++) {
+        const rset_t *set = sets[i];
+        const uint16_t *items = rset_items(set);
+        unsigned count = rset_count(set);
+        if (rset_is_array(set)) {
+            kernels.array_to_bitset(items, count, bitset);
+        } else if (rset_is_inverted_array(set)) {
+            bitset_or_gaps(bitset, items, count);
+        } else if (rset_is_run(set)) {
+            for (unsigned j = 0; j < count; j += 2)
+                bitset_set_range(bitset, items[j], items[j] + items[j + 1]);
+        } else {
+            const bitset_word_t *bits = rset_bitset(set);
+            for (unsigned j = 0; j < bitset_words; j++)
+                bitset[j] |= bits[j];
+        }
+    }
+    unsigned cardinality = bitset_count_range(bitset, 0, max_item);
+    rset_set_header(result, RSET_BITSET, max_size, cardinality);
+    success = runs ? rset_optimize(result) : rset_normalize(result);
+done:
+    if (result != out) {
+        if (success)
+            rset_swap(out, result);
+        rset_destroy(result);
+    }
+    return success;
+}
+
+static unsigned rset_count_items(const rset_t *set, const uint16_t *items,
+                                 unsigned count)
+{
+    // Count how many of the sorted items are in the set.
+    const uint16_t *set_items = rset_items(set);
+    unsigned set_count = rset_count(set);
+    if (rset_is_array(set))
+        return array_intersection_count(set_items, set_count, items, count);
+    if (rset_is_inverted_array(set))
+        return count - array_intersection_count(set_items, set_count,
+                                                items, count);
+    unsigned found = 0;
+    if (rset_is_bitset(set)) {
+        const bitset_word_t *bits = rset_bitset(set);
+        for (unsigned i = 0; i < count; i++)
+            found += bits[items[i] >> 6] >> (items[i] & 0x3F) & 1;
+        return found;
+    }
+    for (unsigned i = 0, j = 0; i < count && j < set_count; ) {
+        unsigned end = set_items[j] + set_items[j + 1];
+        if (end < items[i]) {
+            j += 2;
+        } else {
+            found += set_items[j] <= items[i];
+            i++;
+        }
+    }
+    return found;
+}
+
+static unsigned rset_count_runs_in(const rset_t *runs_set, const rset_t *set)
+{
+    // Count the items of a bitset or run set that fall in each run.
+    const uint16_t *runs = rset_items(runs_set);
+    unsigned count = rset_count(runs_set), found = 0;
+    if (rset_is_bitset(set)) {
+        for (unsigned i = 0; i < count; i += 2)
+            found += bitset_count_range(rset_bitset(set), runs[i],
+                                        runs[i] + runs[i + 1]);
+        return found;
+    }
+    const uint16_t *other = rset_items(set);
+    unsigned other_count = rset_count(set);
+    for (unsigned i = 0, j = 0; i < count && j < other_count; ) {
+        unsigned a_end = runs[i] + runs[i + 1];
+        unsigned b_end = other[j] + other[j + 1];
+        unsigned start = MAX(runs[i], other[j]), end = MIN(a_end, b_end);
+        if (start <= end)
+            found += end - start + 1;
+        i += (a_end <= b_end) * 2;
+        j += (b_end <= a_end) * 2;
+    }
+    return found;
+}
+
+unsigned rset_intersection_cardinality(const rset_t *a, const rset_t *b)
+{
+    if (rset_is_empty(a) || rset_is_empty(b))
+        return 0;
+    if (rset_is_full(a))
+        return rset_cardinality(b);
+    if (rset_is_full(b))
+        return rset_cardinality(a);
+
+    // The items of an array are counted in the other set. An inverted array
+    // is the complement of its items, so ~A & B => |B| - |A & B|.
+    if (rset_is_array(a))
+        return rset_count_items(b, rset_items(a), rset_count(a));
+    if (rset_is_array(b))
+        return rset_count_items(a, rset_items(b), rset_count(b));
+    if (rset_is_inverted_array(a))
+        return rset_cardinality(b) -
+            rset_count_items(b, rset_items(a), rset_count(a));
+    if (rset_is_inverted_array(b))
+        return rset_cardinality(a) -
+            rset_count_items(a, rset_items(b), rset_count(b));
+
+    // Both sets are bitsets or runs.
+    if (rset_is_run(a))
+        return rset_count_runs_in(a, b);
+    if (rset_is_run(b))
+        return rset_count_runs_in(b, a);
+    return kernels.bitset_and_count(rset_bitset(a), rset_bitset(b));
+}
+
+unsigned rset_union_cardinality(const rset_t *a, const rset_t *b)
+{
+    return rset_cardinality(a) + rset_cardinality(b) -
+        rset_intersection_cardinality(a, b);
+}
+
+unsigned rset_difference_cardinality(const rset_t *a, const rset_t *b)
+{
+    return rset_cardinality(a) - rset_intersection_cardinality(a, b);
+}
+
+double rset_jaccard(const rset_t *a, const rset_t *b)
+{
+    unsigned intersection = rset_intersection_cardinality(a, b);
+    unsigned union_ = rset_cardinality(a) + rset_cardinality(b) - intersection;
+    return union_ ? (double)intersection / union_ : 1;
+}
+
+static bool rset_contains_any(const rset_t *set, const uint16_t *items,
+                              unsigned count)
+{
+    // Check if any of the sorted items are in the set, stopping at the
+    // first one that is.
+    if (rset_is_array(set)) {
+        const uint16_t *array = rset_items(set);
+        unsigned i = 0, j = 0, array_count = rset_count(set);
+        while (i < count && j < array_count) {
+            if (items[i] == array[j])
+                return true;
+            if (items[i] < array[j])
+                i++;
+            else
+                j++;
+        }
+        return false;
+    }
+    if (rset_is_bitset(set)) {
+        const bitset_word_t *bits = rset_bitset(set);
+        for (unsigned i = 0; i < count; i++)
+            if (bits[items[i] >> 6] >> (items[i] & 0x3F) & 1)
+                return true;
+        return false;
+    }
+    return rset_count_items(set, items, count) > 0;
+}
+
+bool rset_intersects(const rset_t *a, const rset_t *b)
+{
+    if (rset_is_empty(a) || rset_is_empty(b))
+        return false;
+    if (rset_is_full(a) || rset_is_full(b))
+        return true;
+    if (rset_is_array(a))
+        return rset_contains_any(b, rset_items(a), rset_count(a));
+    if (rset_is_array(b))
+        return rset_contains_any(a, rset_items(b), rset_count(b));
+
+    // An inverted array is missing at most a few thousand items, so it
+    // intersects unless the other set is made up of those items.
+    if (rset_is_inverted_array(a))
+        return rset_cardinality(b) >
+            rset_count_items(b, rset_items(a), rset_count(a));
+    if (rset_is_inverted_array(b))
+        return rset_cardinality(a) >
+            rset_count_items(a, rset_items(b), rset_count(b));
+
+    if (rset_is_run(b)) {
+        const rset_t *swap = a;
+        a = b;
+        b = swap;
+    }
+    if (rset_is_run(a)) {
+        const uint16_t *runs = rset_items(a);
+        for (unsigned i = 0; i < rset_count(a); i += 2) {
+            unsigned start = runs[i], end = start + runs[i + 1];
+            if (rset_is_run(b) ? rset_range_cardinality(b, start, end + 1)
+                               : bitset_count_range(rset_bitset(b), start, end))
+                return true;
+        }
+        return false;
+    }
+    // Check a block of words at a time so that the loop can be vectorized.
+    const bitset_word_t *bits_a = rset_bitset(a), *bits_b = rset_bitset(b);
+    for (unsigned i = 0; i < bitset_words; i += 16) {
+        uint64_t any = 0;
+        for (unsigned j = i; j < i + 16; j++)
+            any |= bits_a[j] & bits_b[j];
+        if (any)
+            return true;
+    }
+    return false;
+}
+
+static void radix_sort(const uint16_t *items, size_t count, uint16_t *scratch,
+                       uint16_t *sorted)
+{
+    // LSD radix sort with two 8-bit passes.
+    size_t low[256] = {0}, high[256] = {0};
+    for (size_t i = 0; i < count; i++) {
+        low[items[i] & 0xFF]++;
+        high[items[i] >> 8]++;
+    }
+    for (size_t i = 0, low_sum = 0, high_sum = 0; i < 256; i++) {
+        size_t low_count = low[i], high_count = high[i];
+        low[i] = low_sum;
+        high[i] = high_sum;
+        low_sum += low_count;
+        high_sum += high_count;
+    }
+    for (size_t i = 0; i < count; i++)
+        scratch[low[items[i] & 0xFF]++] = items[i];
+    for (size_t i = 0; i < count; i++)
+        sorted[high[scratch[i] >> 8]++] = scratch[i];
+}
+
+static bool rset_add_many_array(rset_t *set, const uint16_t *items,
+                                size_t count)
+{
+    // Sort (unless the items are already sorted) and de-duplicate the items,
+    // and then merge them with the array in a single pass.
+    unsigned cardinality = rset_count(set);
+    size_t length = (2 * count + cardinality + count) * sizeof(uint16_t);
+    uint16_t *buffer = rset_allocate(length);
+    if (!buffer)
+        return false;
+    uint16_t *sorted = buffer, *merged = buffer + 2 * count;
+    bool is_sorted = true;
+    for (size_t i = 1; i < count && is_sorted; i++)
+        is_sorted = items[i - 1] < items[i];
+    if (!is_sorted) {
+        radix_sort(items, count, buffer + count, sorted);
+        size_t unique = 1;
+        for (size_t i = 1; i < count; i++)
+            if (sorted[i] != sorted[unique - 1])
+                sorted[unique++] = sorted[i];
+        items = sorted;
+        count = unique;
+    }
+    if (!rset_grow_to(set, cardinality + count)) {
+        rset_deallocate(buffer, length);
+        return false;
+    }
+    const uint16_t *end = kernels.union_(rset_items(set), cardinality,
+                                         items, count, merged);
+    cardinality = end - merged;
+    memcpy(rset_items(set), merged, cardinality * sizeof(uint16_t));
+    rset_deallocate(buffer, length);
+    rset_set_header(set, RSET_ARRAY, cardinality, cardinality);
+    return true;
+}
+
+bool rset_add_many(rset_t *set, const uint16_t *items, size_t count)
+{
+    if (!count || rset_is_full(set))
+        return true;
+    if (rset_is_array(set) && rset_cardinality(set) + count <= low_cutoff)
+        return rset_add_many_array(set, items, count);
+
+    // The set is going to be (or already is) larger than an array, so set
+    // the bits in a bitset directly and then pick the best representation.
+    unsigned type = rset_type(set);
+    bool success = true;
+    if (type == RSET_ARRAY)
+        success = rset_convert_array_to_bitset(set);
+    else if (type == RSET_INVERTED_ARRAY)
+        success = rset_convert_inverted_array_to_bitset(set);
+    else if (type == RSET_RUN)
+        success = rset_convert(set, RSET_BITSET);
+    if (!success)
+        return false;
+    bitset_word_t *bitset = rset_bitset(set);
+    unsigned cardinality = rset_cardinality(set);
+    for (size_t i = 0; i < count; i++) {
+        unsigned offset = items[i] >> 6;
+        uint64_t bit = 1ULL << (items[i] & 0x3F);
+        cardinality += !(bitset[offset] & bit);
+        bitset[offset] |= bit;
+    }
+    rset_set_header(set, RSET_BITSET, max_size, cardinality);
+    if (type != RSET_BITSET || cardinality > high_cutoff)
+        return rset_optimize(set);
+    return true;
+}
+
+static bool rset_splice(rset_t *set, unsigned from, unsigned to,
+                        unsigned insert)
+{
+    // Replace the item words in [from, to) with `insert` uninitialized words.
+    // The caller is responsible for filling them in and updating the header.
+    unsigned count = rset_count(set);
+    if (!rset_grow_to(set, count - (to - from) + insert))
+        return false;
+    uint16_t *items = rset_items(set);
+    memmove(items + from + insert, items + to,
+            (count - to) * sizeof(uint16_t));
+    return true;
+}
+
+static unsigned rset_upper_bound(const uint16_t *array, unsigned count,
+                                 unsigned end)
+{
+    // Find the index of the first item that's >= the exclusive end of a
+    // range, which may be one past the last item.
+    return end < max_cardinality ? rset_lower_bound(array, count, end) : count;
+}
+
+static unsigned rset_first_run(const uint16_t *runs, unsigned count,
+                               unsigned item)
+{
+    // Find the first run that ends at or after the item.
+    int i = rset_find_run(runs, count, item);
+    if (i >= 0 && runs[2 * i] + runs[2 * i + 1] >= item)
+        return i;
+    return i + 1;
+}
+
+static bool rset_add_range_run(rset_t *set, unsigned start, unsigned end)
+{
+    // Replace the runs that overlap or are adjacent to [start, end) with a
+    // single run.
+    uint16_t *runs = rset_items(set);
+    unsigned count = rset_count(set) / 2, last = end - 1;
+    unsigned first = rset_first_run(runs, count, start ? start - 1 : 0);
+    unsigned cardinality = rset_cardinality(set), i = first;
+    for (; i < count && runs[2 * i] <= end; i++) {
+        unsigned run_start = runs[2 * i], run_end = run_start + runs[2 * i + 1];
+        start = MIN(start, run_start);
+        last = MAX(last, run_end);
+        cardinality -= run_end - run_start + 1;
+    }
+    if (!rset_splice(set, 2 * first, 2 * i, 2))
+        return false;
+    runs = rset_items(set);
+    runs[2 * first] = start;
+    runs[2 * first + 1] = last - start;
+    count = count - (i - first) + 1;
+    cardinality += last - start + 1;
+    rset_set_header(set, RSET_RUN, 2 * count, cardinality);
+    return rset_normalize_run(set);
+}
+
+static bool rset_remove_range_run(rset_t *set, unsigned start, unsigned end)
+{
+    // Replace the runs that overlap [start, end) with the parts of the first
+    // and last runs that fall outside the range.
+    uint16_t *runs = rset_items(set);
+    unsigned count = rset_count(set) / 2, last = end - 1;
+    unsigned first = rset_first_run(runs, count, start);
+    unsigned cardinality = rset_cardinality(set), i = first;
+    uint16_t pieces[4];
+    unsigned piece_count = 0;
+    for (; i < count && runs[2 * i] <= last; i++) {
+        unsigned run_start = runs[2 * i], run_end = run_start + runs[2 * i + 1];
+        if (run_start < start) {
+            pieces[2 * piece_count] = run_start;
+            pieces[2 * piece_count++ + 1] = start - 1 - run_start;
+        }
+        if (run_end > last) {
+            pieces[2 * piece_count] = last + 1;
+            pieces[2 * piece_count++ + 1] = run_end - last - 1;
+        }
+        cardinality -= MIN(run_end, last) - MAX(run_start, start) + 1;
+    }
+    if (!rset_splice(set, 2 * first, 2 * i, 2 * piece_count))
+        return false;
+    memcpy(rset_items(set) + 2 * first, pieces,
+           2 * piece_count * sizeof(uint16_t));
+    count = count - (i - first) + piece_count;
+    rset_set_header(set, RSET_RUN, 2 * count, cardinality);
+    return rset_normalize_run(set);
+}
+
+static uint16_t *sse_sequence16(uint16_t *out, unsigned start, unsigned end)
+{
+    // Write the items [start, end) eight at a time.
+    __m128i v_item = _mm_add_epi16(_mm_set1_epi16(start),
+                                   _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7));
+    __m128i v_step = _mm_set1_epi16(8);
+    for (; start + 8 <= end; start += 8, out += 8) {
+        _mm_storeu_si128((__m128i *)out, v_item);
+        v_item = _mm_add_epi16(v_item, v_step);
+    }
+    for (; start < end; start++)
+        *out++ = start;
+    return out;
+}
+
+static uint32_t *sse_sequence32(uint32_t *out, unsigned start, unsigned end,
+                                uint32_t offset)
+{
+    // Write the items [start, end) plus the offset four at a time.
+    __m128i v_item = _mm_add_epi32(_mm_set1_epi32(offset + start),
+                                   _mm_setr_epi32(0, 1, 2, 3));
+    __m128i v_step = _mm_set1_epi32(4);
+    for (; start + 4 <= end; start += 4, out += 4) {
+        _mm_storeu_si128((__m128i *)out, v_item);
+        v_item = _mm_add_epi32(v_item, v_step);
+    }
+    for (; start < end; start++)
+        *out++ = offset + start;
+    return out;
+}
+
+static void rset_fill_range(rset_t *set, unsigned from, unsigned start,
+                            unsigned end)
+{
+    // Write the items [start, end) to the item words starting at `from`.
+    sse_sequence16(rset_items(set) + from, start, end);
+}
+
+bool rset_add_range(rset_t *set, unsigned start, unsigned end)
+{
+    end = MIN(end, max_cardinality);
+    if (start >= end || rset_is_full(set))
+        return true;
+    if (!start && end == max_cardinality)
+        return rset_fill(set);
+
+    unsigned count = rset_count(set), length = end - start;
+    uint16_t *items = rset_items(set);
+    if (rset_is_run(set))
+        return rset_add_range_run(set, start, end);
+    if (rset_is_inverted_array(set)) {
+        unsigned i = rset_lower_bound(items, count, start);
+        unsigned j = rset_upper_bound(items, count, end);
+        if (!rset_splice(set, i, j, 0))
+            return false;
+        rset_set_header(set, RSET_INVERTED_ARRAY, count - (j - i),
+                        rset_cardinality(set) + (j - i));
+        return true;
+    }
+    if (rset_is_array(set)) {
+        unsigned i = rset_lower_bound(items, count, start);
+        unsigned j = rset_upper_bound(items, count, end);
+        unsigned cardinality = count - (j - i) + length;
+        if (cardinality <= low_cutoff) {
+            if (!rset_splice(set, i, j, length))
+                return false;
+            rset_fill_range(set, i, start, end);
+            rset_set_header(set, RSET_ARRAY, cardinality, cardinality);
+            return rset_optimize(set);
+        }
+        if (!rset_convert_array_to_bitset(set))
+            return false;
+    }
+
+    bitset_word_t *bitset = rset_bitset(set);
+    unsigned cardinality = rset_cardinality(set) + length -
+        bitset_count_range(bitset, start, end - 1);
+    bitset_set_range(bitset, start, end - 1);
+    rset_set_header(set, RSET_BITSET, max_size, cardinality);
+    // A range is likely to leave long runs behind, so check whether
+    // another representation is now smaller.
+    return rset_optimize(set);
+}
+
+bool rset_remove_range(rset_t *set, unsigned start, unsigned end)
+{
+    end = MIN(end, max_cardinality);
+    if (start >= end || rset_is_empty(set))
+        return true;
+    if (!start && end == max_cardinality)
+        return rset_truncate(set);
+
+    unsigned count = rset_count(set), length = end - start;
+    uint16_t *items = rset_items(set);
+    if (rset_is_run(set))
+        return rset_remove_range_run(set, start, end);
+    if (rset_is_array(set)) {
+        unsigned i = rset_lower_bound(items, count, start);
+        unsigned j = rset_upper_bound(items, count, end);
+        if (!rset_splice(set, i, j, 0))
+            return false;
+        rset_set_header(set, RSET_ARRAY, count - (j - i), count - (j - i));
+        return true;
+    }
+    if (rset_is_inverted_array(set)) {
+        unsigned i = rset_lower_bound(items, count, start);
+        unsigned j = rset_upper_bound(items, count, end);
+        unsigned missing = count - (j - i) + length;
+        if (missing < max_capacity) {
+            if (!rset_splice(set, i, j, length))
+                return false;
+            rset_fill_range(set, i, start, end);
+            rset_set_header(set, RSET_INVERTED_ARRAY, missing,
+                            max_cardinality - missing);
+            return true;
+        }
+        if (!rset_convert_inverted_array_to_bitset(set))
+            return false;
+    }
+
+    bitset_word_t *bitset = rset_bitset(set);
+    unsigned cardinality = rset_cardinality(set) -
+        bitset_count_range(bitset, start, end - 1);
+    bitset_clear_range(bitset, start, end - 1);
+    rset_set_header(set, RSET_BITSET, max_size, cardinality);
+    if (cardinality <= low_cutoff - hysteresis)
+        return rset_optimize(set);
+    return true;
+}
+
+bool rset_contains_range(const rset_t *set, unsigned start, unsigned end)
+{
+    end = MIN(end, max_cardinality);
+    if (start >= end)
+        return true;
+    unsigned count = rset_count(set), length = end - start;
+    const uint16_t *items = rset_items(set);
+    if (rset_is_array(set)) {
+        // The items are unique and sorted, so the range is present if the
+        // item `length - 1` places after `start` is `end - 1`.
+        unsigned i = rset_lower_bound(items, count, start);
+        return i + length <= count && items[i + length - 1] == end - 1;
+    }
+    if (rset_is_inverted_array(set)) {
+        unsigned i = rset_lower_bound(items, count, start);
+        return i == count || items[i] >= end;
+    }
+    if (rset_is_run(set)) {
+        int i = rset_find_run(items, count / 2, start);
+        return i >= 0 && items[2 * i] + items[2 * i + 1] >= end - 1;
+    }
+    return bitset_count_range(rset_bitset(set), start, end - 1) == length;
+}
+
+unsigned rset_range_cardinality(const rset_t *set, unsigned start,
+                                unsigned end)
+{
+    end = MIN(end, max_cardinality);
+    if (start >= end)
+        return 0;
+    unsigned count = rset_count(set), length = end - start;
+    const uint16_t *items = rset_items(set);
+    if (rset_is_array(set) || rset_is_inverted_array(set)) {
+        unsigned matches = rset_upper_bound(items, count, end) -
+                           rset_lower_bound(items, count, start);
+        return rset_is_array(set) ? matches : length - matches;
+    }
+    if (rset_is_run(set)) {
+        unsigned cardinality = 0, last = end - 1;
+        for (unsigned i = rset_first_run(items, count / 2, start);
+             i < count / 2 && items[2 * i] <= last; i++) {
+            unsigned run_end = items[2 * i] + items[2 * i + 1];
+            cardinality += MIN(run_end, last) - MAX(items[2 * i], start) + 1;
+        }
+        return cardinality;
+    }
+    return bitset_count_range(rset_bitset(set), start, end - 1);
+}
+
+static unsigned bitset_select(const bitset_word_t *bitset, unsigned word,
+                              unsigned rank)
+{
+    // Find the item with the specified rank among the bits that start at
+    // the specified word. The caller guarantees that such an item exists.
+    unsigned count;
+    while ((count = __builtin_popcountll(bitset[word])) <= rank) {
+        rank -= count;
+        word++;
+    }
+    uint64_t bits = bitset[word];
+    while (rank--)
+        bits &= bits - 1;
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+static unsigned rset_inverted_select(const uint16_t *missing, unsigned count,
+                                     unsigned rank)
+{
+    // The item with the specified rank is rank + i, where i is the number of
+    // missing items before it, i.e. the first i where missing[i] - i > rank.
+    unsigned first = 0, last = count;
+    while (first < last) {
+        unsigned middle = (first + last) / 2;
+        if (missing[middle] - middle <= rank)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    return rank + first;
+}
+
+unsigned rset_rank(const rset_t *set, uint16_t item)
+{
+    return rset_range_cardinality(set, 0, item + 1);
+}
+
+bool rset_select(const rset_t *set, unsigned rank, uint16_t *item)
+{
+    if (rank >= rset_cardinality(set))
+        return false;
+    const uint16_t *items = rset_items(set);
+    if (rset_is_array(set)) {
+        *item = items[rank];
+    } else if (rset_is_inverted_array(set)) {
+        *item = rset_inverted_select(items, rset_count(set), rank);
+    } else if (rset_is_run(set)) {
+        for (unsigned i = 0; ; i += 2) {
+            if (rank <= items[i + 1]) {
+                *item = items[i] + rank;
+                break;
+            }
+            rank -= items[i + 1] + 1;
+        }
+    } else {
+        *item = bitset_select(rset_bitset(set), 0, rank);
+    }
+    return true;
+}
+
+void rset_iterator_init(rset_iterator_t *iterator, const rset_t *set)
+{
+    iterator->set = set;
+    iterator->position = 0;
+    iterator->index = 0;
+    iterator->ranked = false;
+}
+
+static unsigned rset_iterator_find(rset_iterator_t *iterator)
+{
+    // Find the first item that's >= the iterator position, or return
+    // max_cardinality if there isn't one. The index remembers where the
+    // previous search stopped so that sequential iteration never searches.
+    const rset_t *set = iterator->set;
+    const uint16_t *items = rset_items(set);
+    unsigned count = rset_count(set), position = iterator->position;
+    unsigned i = iterator->index;
+    if (position >= max_cardinality)
+        return max_cardinality;
+
+    if (rset_is_array(set)) {
+        if (i < count && items[i] < position && ++i < count &&
+            items[i] < position)
+            i += rset_lower_bound(items + i, count - i, position);
+        iterator->index = i;
+        return i < count ? items[i] : max_cardinality;
+    }
+    if (rset_is_inverted_array(set)) {
+        if (i < count && items[i] < position)
+            i += rset_lower_bound(items + i, count - i, position);
+        for (; i < count && items[i] == position; i++)
+            position++;
+        iterator->index = i;
+        return position;
+    }
+    if (rset_is_run(set)) {
+        count /= 2;
+        if (i < count && items[2 * i] + items[2 * i + 1] < position &&
+            ++i < count && items[2 * i] + items[2 * i + 1] < position)
+            i += rset_first_run(items + 2 * i, count - i, position);
+        iterator->index = i;
+        return i < count ? MAX(position, items[2 * i]) : max_cardinality;
+    }
+
+    const bitset_word_t *bitset = rset_bitset(set);
+    unsigned word = position >> 6;
+    uint64_t bits = bitset[word] & (~0ULL << (position & 0x3F));
+    while (!bits) {
+        if (++word == bitset_words)
+            return max_cardinality;
+        bits = bitset[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+bool rset_iterator_next(rset_iterator_t *iterator, uint16_t *item)
+{
+    unsigned next = rset_iterator_find(iterator);
+    iterator->position = next + 1;
+    if (next == max_cardinality)
+        return false;
+    *item = next;
+    return true;
+}
+
+bool rset_iterator_advance_to(rset_iterator_t *iterator, uint16_t target,
+                              uint16_t *item)
+{
+    iterator->position = MAX(iterator->position, target);
+    return rset_iterator_next(iterator, item);
+}
+
+bool rset_iterator_seek(rset_iterator_t *iterator, unsigned rank)
+{
+    const rset_t *set = iterator->set;
+    if (rank >= rset_cardinality(set))
+        return false;
+    if (!rset_is_bitset(set)) {
+        uint16_t item;
+        rset_select(set, rank, &item);
+        iterator->position = item;
+        iterator->index = rset_is_array(set) ? rank : 0;
+        return true;
+    }
+
+    // Build the cumulative popcount of each block the first time a bitset
+    // is seeked, so that later seeks only scan a single block.
+    const bitset_word_t *bitset = rset_bitset(set);
+    unsigned blocks = sizeof(iterator->ranks) / sizeof(*iterator->ranks);
+    unsigned block_words = bitset_words / blocks;
+    if (!iterator->ranked) {
+        unsigned cardinality = 0;
+        for (unsigned block = 0; block < blocks; block++) {
+            const bitset_word_t *words = bitset + block * block_words;
+            iterator->ranks[block] = cardinality;
+            for (unsigned i = 0; i < block_words; i++)
+                cardinality += __builtin_popcountll(words[i]);
+        }
+        iterator->ranked = true;
+    }
+    unsigned first = 0, last = blocks - 1;
+    while (first < last) {
+        unsigned middle = (first + last + 1) / 2;
+        if (iterator->ranks[middle] <= rank)
+            first = middle;
+        else
+            last = middle - 1;
+    }
+    iterator->position = bitset_select(bitset, first * block_words,
+                                       rank - iterator->ranks[first]);
+    return true;
+}
+
+unsigned rset_to_array(const rset_t *set, uint16_t *out)
+{
+    const uint16_t *items = rset_items(set);
+    unsigned count = rset_count(set), cardinality = rset_cardinality(set);
+    uint16_t *start = out;
+    if (rset_is_array(set)) {
+        memcpy(out, items, count * sizeof(uint16_t));
+        return count;
+    }
+    if (rset_is_inverted_array(set)) {
+        // Fill the gaps between the missing items.
+        unsigned next = 0;
+        for (unsigned i = 0; i < count; i++) {
+            out = sse_sequence16(out, next, items[i]);
+            next = items[i] + 1;
+        }
+        sse_sequence16(out, next, max_cardinality);
+    } else if (rset_is_run(set)) {
+        for (unsigned i = 0; i < count; i += 2)
+            out = sse_sequence16(out, items[i], items[i] + items[i + 1] + 1);
+    } else {
+        kernels.bitset_extract16(rset_bitset(set), out, start + cardinality,
+                                 0);
+    }
+    return cardinality;
+}
+
+unsigned rset_to_array32(const rset_t *set, uint32_t offset, uint32_t *out)
+{
+    const uint16_t *items = rset_items(set);
+    unsigned count = rset_count(set), cardinality = rset_cardinality(set);
+    uint32_t *start = out;
+    if (rset_is_array(set)) {
+        for (unsigned i = 0; i < count; i++)
+            out[i] = offset + items[i];
+    } else if (rset_is_inverted_array(set)) {
+        unsigned next = 0;
+        for (unsigned i = 0; i < count; i++) {
+            out = sse_sequence32(out, next, items[i], offset);
+            next = items[i] + 1;
+        }
+        sse_sequence32(out, next, max_cardinality, offset);
+    } else if (rset_is_run(set)) {
+        for (unsigned i = 0; i < count; i += 2)
+            out = sse_sequence32(out, items[i], items[i] + items[i + 1] + 1,
+                                 offset);
+    } else {
+        kernels.bitset_extract32(rset_bitset(set), out, start + cardinality,
+                                 offset);
+    }
+    return cardinality;
 }
@@ -16,7 +16,11 @@ extern "C" {
  *
  *     buffer ptr
  *     v
- *     |  cardinality  |   items...  |
+ *     |  type  |  count  |  cardinality  |   items...  |
+ *
+ * The header is four 16-bit words: the representation (an `rset_type_t`),
+ * the number of 16-bit item words that follow, and the 32-bit cardinality
+ * (low word first).
  *
  * The set items are represented by either a sorted array of 16-bit unsigned
  * ints or a bitset, whichever uses the least amount of space. The cut-off
@@ -26,16 +30,105 @@ extern "C" {
  * inverted array, where each item represents an unsigned int that is *not* in
  * the set. The cut-off point is 61440 (2^16-2^12) items (8KB).
  *
+ * When items are removed the set converts back to an array or bitset only
+ * once it's 512 items past the cut-off point, so that a set hovering around
+ * a cut-off point doesn't repeatedly convert between representations.
+ *
+ * Sets made up of long runs of consecutive items are stored as a sorted array
+ * of (start, length) pairs, where each run contains the items start through
+ * start+length inclusive. A run container is used whenever it's smaller than
+ * the representation that would be chosen otherwise.
+ *
+ * Sets aren't synchronized. Any number of threads can read the same set
+ * concurrently (every function that takes a `const rset_t *`, including
+ * iterators and views), but a set that's being modified can't be read or
+ * modified by any other thread. The library's own state is initialized
+ * before `main` and never written again, except by `rset_set_allocator`.
+ * See rshared.h for a set that can be updated while it's being read.
+ *
  * See the original paper for more information:
  *
  *     http://arxiv.org/pdf/1402.6407v4.pdf
  */
 
+typedef enum {
+    RSET_ARRAY,
+    RSET_BITSET,
+    RSET_INVERTED_ARRAY,
+    RSET_RUN
+} rset_type_t;
+
 typedef struct {
     uint16_t *buffer;
     unsigned size;
 } rset_t;
 
+/**
+ * An iterator over the items of a set in ascending order. Iterators live
+ * wherever the caller puts them (usually the stack) and never allocate.
+ * An iterator is invalidated when the set is modified.
+ *
+ * `ranks` caches the cumulative popcount of each 1024-item block of a bitset
+ * so that repeated seeks don't rescan the whole bitset.
+ */
+
+typedef struct {
+    const rset_t *set;
+    unsigned position;
+    unsigned index;
+    bool ranked;
+    uint16_t ranks[64];
+} rset_iterator_t;
+
+/**
+ * A read-only view of a set exported with `rset_export`, e.g. a set stored
+ * in an mmap'd file. The view wraps the exported buffer in place rather than
+ * copying it, and like an iterator it lives wherever the caller puts it.
+ */
+
+typedef struct {
+    rset_t set;
+} rset_view_t;
+
+/**
+ * The allocator used for every set and for the temporary buffers of set
+ * operations. `deallocate` and `reallocate` are passed the size of the block,
+ * so that allocators don't need to store it. `context` is passed to every
+ * function.
+ */
+
+typedef struct {
+    void *(*allocate)(void *context, size_t size);
+    void *(*reallocate)(void *context, void *pointer, size_t old_size,
+                        size_t size);
+    void (*deallocate)(void *context, void *pointer, size_t size);
+    void *context;
+} rset_allocator_t;
+
+/**
+ * A size-class pool for allocating many short-lived sets. Blocks are carved
+ * out of large chunks and recycled through a free list per size class, and
+ * the memory is only returned to the system when the pool is freed. A pool
+ * isn't thread-safe.
+ */
+
+typedef struct {
+    void *free_lists[12];
+    void *chunks;
+    void *large;
+    unsigned char *cursor;
+    unsigned char *end;
+} rset_pool_t;
+
+/**
+ * Flags for `rset_serialize`.
+ */
+
+enum {
+    RSET_CHECKSUM = 1,
+    RSET_COMPRESS = 2
+};
+
 /**
  * Create a new set.
  */
@@ -48,6 +141,51 @@ rset_t *rset_new(void);
 
 void rset_free(rset_t *set);
 
+/**
+ * Initialize a set that lives wherever the caller puts it, e.g. embedded by
+ * value in another struct or on the stack, so that only its buffer is
+ * allocated.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rset_init(rset_t *set);
+
+/**
+ * Free the buffer of a set initialized with `rset_init`.
+ */
+
+void rset_destroy(rset_t *set);
+
+/**
+ * Replace the allocator used by the library, or restore the default
+ * (malloc) allocator if `allocator` is NULL. Sets must be freed with the
+ * allocator they were allocated with, so the allocator should be set before
+ * any sets are created. The allocator is shared by every thread, so it must
+ * be thread-safe if sets are created or modified on more than one thread.
+ */
+
+void rset_set_allocator(const rset_allocator_t *allocator);
+
+/**
+ * Create a new pool.
+ */
+
+rset_pool_t *rset_pool_new(void);
+
+/**
+ * Free the pool and all of the memory allocated from it, including sets that
+ * haven't been freed.
+ */
+
+void rset_pool_free(rset_pool_t *pool);
+
+/**
+ * Get an allocator that allocates from the pool, for `rset_set_allocator`.
+ */
+
+rset_allocator_t rset_pool_allocator(rset_pool_t *pool);
+
 /**
  * Get the cardinality of the set.
  */
@@ -62,12 +200,126 @@ unsigned rset_cardinality(const rset_t *set);
 
 bool rset_add(rset_t *set, uint16_t item);
 
+/**
+ * Add many items to the set. The items don't need to be sorted, although
+ * sorted items skip the sorting step.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rset_add_many(rset_t *set, const uint16_t *items, size_t count);
+
+/**
+ * Remove an item from the set.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rset_remove(rset_t *set, uint16_t item);
+
 /**
  * Check if the set contains an item.
  */
 
 bool rset_contains(const rset_t *set, uint16_t item);
 
+/**
+ * Add the items in the range [start, end) to the set. `end` may be 65536 to
+ * include the last item.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rset_add_range(rset_t *set, unsigned start, unsigned end);
+
+/**
+ * Remove the items in the range [start, end) from the set.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rset_remove_range(rset_t *set, unsigned start, unsigned end);
+
+/**
+ * Check if the set contains every item in the range [start, end).
+ */
+
+bool rset_contains_range(const rset_t *set, unsigned start, unsigned end);
+
+/**
+ * Count the items in the range [start, end) that are in the set.
+ */
+
+unsigned rset_range_cardinality(const rset_t *set, unsigned start,
+                                unsigned end);
+
+/**
+ * Count the items in the set that are less than or equal to `item`.
+ */
+
+unsigned rset_rank(const rset_t *set, uint16_t item);
+
+/**
+ * Find the item with the specified (zero-based) rank, i.e. the item that has
+ * `rank` smaller items in the set.
+ *
+ * Returns false if the set has `rank` or fewer items.
+ */
+
+bool rset_select(const rset_t *set, unsigned rank, uint16_t *item);
+
+/**
+ * Initialize an iterator that starts at the smallest item in the set.
+ */
+
+void rset_iterator_init(rset_iterator_t *iterator, const rset_t *set);
+
+/**
+ * Get the next item from the iterator.
+ *
+ * Returns false once the iterator is exhausted.
+ */
+
+bool rset_iterator_next(rset_iterator_t *iterator, uint16_t *item);
+
+/**
+ * Skip the items that are less than `target` and get the next item from
+ * the iterator. The iterator never moves backwards.
+ *
+ * Returns false once the iterator is exhausted.
+ */
+
+bool rset_iterator_advance_to(rset_iterator_t *iterator, uint16_t target,
+                              uint16_t *item);
+
+/**
+ * Move the iterator so that the next item it returns is the item with the
+ * specified rank. Unlike `rset_iterator_advance_to` this can move backwards.
+ *
+ * Returns false if the set has `rank` or fewer items.
+ */
+
+bool rset_iterator_seek(rset_iterator_t *iterator, unsigned rank);
+
+/**
+ * Write the items in the set to `out` in ascending order. `out` must have
+ * room for `rset_cardinality(set)` items.
+ *
+ * Returns the number of items written.
+ */
+
+unsigned rset_to_array(const rset_t *set, uint16_t *out);
+
+/**
+ * Write the items in the set to `out` in ascending order, adding `offset` to
+ * each one (e.g. the high 16 bits of a 32-bit id). `out` must have room for
+ * `rset_cardinality(set)` items.
+ *
+ * Returns the number of items written.
+ */
+
+unsigned rset_to_array32(const rset_t *set, uint32_t offset, uint32_t *out);
+
 /**
  * Check if two sets are equal.
  */
@@ -90,6 +342,109 @@ bool rset_invert(const rset_t *set, rset_t *result);
  */
 bool rset_intersection(const rset_t *a, const rset_t *b, rset_t *result);
 
+/**
+ * Calculate the union of two sets and place the result in the `result` set.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rset_union(const rset_t *a, const rset_t *b, rset_t *result);
+
+/**
+ * Calculate the difference of two sets (the items in `a` that aren't in `b`)
+ * and place the result in the `result` set.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rset_difference(const rset_t *a, const rset_t *b, rset_t *result);
+
+/**
+ * Calculate the symmetric difference of two sets (the items in either set
+ * but not both) and place the result in the `result` set.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rset_xor(const rset_t *a, const rset_t *b, rset_t *result);
+
+/**
+ * Intersect `a` with `b`, modifying `a` in place. `a` is only reallocated if
+ * its representation has to change.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rset_and_inplace(rset_t *a, const rset_t *b);
+
+/**
+ * Add the items in `b` to `a`, modifying `a` in place. `a` is only
+ * reallocated if it has to grow or its representation has to change.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rset_or_inplace(rset_t *a, const rset_t *b);
+
+/**
+ * Remove the items in `b` from `a`, modifying `a` in place. `a` is only
+ * reallocated if its representation has to change.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rset_andnot_inplace(rset_t *a, const rset_t *b);
+
+/**
+ * Calculate the intersection of `n` sets and place the result in the `out`
+ * set. The sets are intersected smallest first and the operation stops as
+ * soon as the result is empty. The intersection of no sets is the full set.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rset_intersection_many(const rset_t **sets, size_t n, rset_t *out);
+
+/**
+ * Calculate the union of `n` sets and place the result in the `out` set.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rset_union_many(const rset_t **sets, size_t n, rset_t *out);
+
+/**
+ * Count the items in the intersection of two sets without building it.
+ */
+
+unsigned rset_intersection_cardinality(const rset_t *a, const rset_t *b);
+
+/**
+ * Count the items in the union of two sets without building it.
+ */
+
+unsigned rset_union_cardinality(const rset_t *a, const rset_t *b);
+
+/**
+ * Count the items in `a` that aren't in `b` without building the difference.
+ */
+
+unsigned rset_difference_cardinality(const rset_t *a, const rset_t *b);
+
+/**
+ * Calculate the Jaccard similarity of two sets, i.e. the cardinality of their
+ * intersection divided by the cardinality of their union. Two empty sets have
+ * a similarity of 1.
+ */
+
+double rset_jaccard(const rset_t *a, const rset_t *b);
+
+/**
+ * Check if two sets have at least one item in common.
+ */
+
+bool rset_intersects(const rset_t *a, const rset_t *b);
+
 /**
  * Truncate the set.
  */
@@ -102,6 +457,15 @@ bool rset_truncate(rset_t *set);
 
 bool rset_fill(rset_t *set);
 
+/**
+ * Convert the set to the representation that uses the least amount of space,
+ * e.g. a run container if the set contains long runs of consecutive items.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rset_optimize(rset_t *set);
+
 /**
  * Export the set.
  *
@@ -117,11 +481,71 @@ const void *rset_export(const rset_t *set);
 unsigned rset_length(const rset_t *set);
 
 /**
- * Import a set given a buffer.
+ * Import a set given a buffer exported with `rset_export`. The buffer is
+ * trusted and only its length and header are checked; use
+ * `rset_import_checked` for data that may be corrupt.
+ *
+ * Returns NULL if the buffer doesn't hold a valid set header.
  */
 
 rset_t *rset_import(const void *buffer, unsigned length);
 
+/**
+ * Initialize a view of a buffer exported with `rset_export` without copying
+ * it. The buffer must be 2-byte aligned and must outlive the view.
+ *
+ * The header and the items are validated as by `rset_import_checked`, so
+ * the buffer can come from an untrusted source.
+ *
+ * Returns a set that can be passed to any function that takes a
+ * `const rset_t *`, or NULL if the buffer doesn't hold a valid set.
+ */
+
+const rset_t *rset_view(rset_view_t *view, const void *buffer,
+                        unsigned length);
+
+/**
+ * Get the length in bytes of the set once serialized with `flags`.
+ */
+
+unsigned rset_serialized_length(const rset_t *set, unsigned flags);
+
+/**
+ * Serialize the set to `out`, which must have room for
+ * `rset_serialized_length(set, flags)` bytes. Unlike `rset_export` the format
+ * is the same on every host. Every field is little-endian:
+ *
+ *     | magic | version | flags | type | 0 | cardinality | count | items | crc |
+ *
+ * The magic is the four bytes "RSET", followed by the version (1), the flags,
+ * the representation (an `rset_type_t`) and a reserved zero byte, each one
+ * byte long. The 32-bit cardinality and count (the number of 16-bit item
+ * words) follow, then the items. Bitsets are 1024 64-bit words where item i
+ * is bit i % 64 of word i / 64. If `RSET_CHECKSUM` is set a CRC-32C of
+ * everything before it is appended.
+ *
+ * If `RSET_COMPRESS` is set and it makes the set smaller the items are
+ * compressed, in which case the flag is also set in the header. Arrays and
+ * runs are delta encoded and bit-packed in blocks of 64, and bitsets only
+ * store the words that aren't all zeros or all ones. The count is still the
+ * number of 16-bit item words once decompressed. See rset.c for details.
+ *
+ * Returns the number of bytes written.
+ */
+
+unsigned rset_serialize(const rset_t *set, void *out, unsigned flags);
+
+/**
+ * Import a set serialized with `rset_serialize`. Unlike `rset_import` the
+ * buffer doesn't have to be trusted: the header, the checksum (if present)
+ * and the items are validated, e.g. that the cardinality matches the items
+ * and that arrays are sorted.
+ *
+ * Returns NULL if the buffer doesn't hold a valid set.
+ */
+
+rset_t *rset_import_checked(const void *buffer, unsigned length);
+
 /**
  * Make a copy of the set.
  */
@@ -0,0 +1,83 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <sched.h>
+
+#include "rshared.h"
+
+bool rshared_init(rshared_t *shared)
+{
+    shared->set = rset_new();
+    if (!shared->set)
+        return false;
+    if (pthread_mutex_init(&shared->lock, NULL)) {
+        rset_free(shared->set);
+        return false;
+    }
+    shared->epoch = 0;
+    shared->readers[0] = shared->readers[1] = 0;
+    return true;
+}
+
+void rshared_destroy(rshared_t *shared)
+{
+    pthread_mutex_destroy(&shared->lock);
+    rset_free(shared->set);
+}
+
+const rset_t *rshared_acquire(rshared_t *shared, unsigned *epoch)
+{
+    // Count the reader against the epoch, and make sure the epoch didn't
+    // advance in the meantime. A writer that advanced the epoch before the
+    // check may not have seen the count, but it has already published its
+    // version, so a reader that retries can only load the new one.
+    for (;;) {
+        unsigned current = __atomic_load_n(&shared->epoch, __ATOMIC_SEQ_CST);
+        unsigned long *readers = &shared->readers[current & 1];
+        __atomic_add_fetch(readers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&shared->epoch, __ATOMIC_SEQ_CST) == current) {
+            *epoch = current;
+            return __atomic_load_n(&shared->set, __ATOMIC_SEQ_CST);
+        }
+        __atomic_sub_fetch(readers, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void rshared_release(rshared_t *shared, unsigned epoch)
+{
+    __atomic_sub_fetch(&shared->readers[epoch & 1], 1, __ATOMIC_RELEASE);
+}
+
+static void rshared_publish(rshared_t *shared, rset_t *set)
+{
+    // Readers that could have loaded the old version are all counted against
+    // the current epoch, so once the epoch has advanced the old version can
+    // be freed as soon as that counter drops to zero.
+    rset_t *old = __atomic_exchange_n(&shared->set, set, __ATOMIC_SEQ_CST);
+    unsigned epoch = __atomic_load_n(&shared->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&shared->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&shared->readers[epoch & 1], __ATOMIC_ACQUIRE))
+        sched_yield();
+    rset_free(old);
+}
+
+bool rshared_update(rshared_t *shared,
+                    bool (*update)(rset_t *set, void *context),
+                    void *context)
+{
+    pthread_mutex_lock(&shared->lock);
+    rset_t *copy = rset_copy(shared->set);
+    bool success = copy && update(copy, context);
+    if (success)
+        rshared_publish(shared, copy);
+    else if (copy)
+        rset_free(copy);
+    pthread_mutex_unlock(&shared->lock);
+    return success;
+}
+
+void rshared_replace(rshared_t *shared, rset_t *set)
+{
+    pthread_mutex_lock(&shared->lock);
+    rshared_publish(shared, set);
+    pthread_mutex_unlock(&shared->lock);
+}
@@ -0,0 +1,94 @@
+#ifndef rshared_H_
+#define rshared_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "rset.h"
+
+/**
+ * A set that's read by many threads and updated by few, e.g. a filter cache.
+ *
+ * Readers never block and never write to the set: they pin the current
+ * version of the set, read it with the usual `rset_*` functions and unpin it.
+ * Writers copy the current version, modify the copy and publish it in place
+ * of the original (read-copy-update), and then wait for the readers that
+ * may still be reading the original to unpin it before freeing it. Writers
+ * are serialized by a mutex, so an update is only as expensive as a copy of
+ * the set plus the modification.
+ *
+ * Readers are counted in one of two counters, picked by the parity of the
+ * epoch. A writer advances the epoch once it has published a new version, so
+ * new readers are counted in the other counter and it only has to wait for
+ * the old counter to drain.
+ */
+
+typedef struct {
+    rset_t *set;
+    unsigned epoch;
+    unsigned long readers[2];
+    pthread_mutex_t lock;
+} rshared_t;
+
+/**
+ * Initialize a shared set, which is initially empty.
+ *
+ * Returns true if the operation was successful and false otherwise.
+ */
+
+bool rshared_init(rshared_t *shared);
+
+/**
+ * Free the shared set. No thread may be reading or updating it.
+ */
+
+void rshared_destroy(rshared_t *shared);
+
+/**
+ * Pin the current version of the set. The version stays valid, and doesn't
+ * change, until it's unpinned with `rshared_release`, passing the epoch
+ * stored in `epoch`. Pins are cheap but should be short, since a writer
+ * waits for them.
+ *
+ * Returns the set.
+ */
+
+const rset_t *rshared_acquire(rshared_t *shared, unsigned *epoch);
+
+/**
+ * Unpin a version of the set pinned with `rshared_acquire`.
+ */
+
+void rshared_release(rshared_t *shared, unsigned epoch);
+
+/**
+ * Update the set by calling `update` with a copy of the current version and
+ * `context`, and publish the copy if `update` returns true. Readers see
+ * either the old version or the new one, never a partial update.
+ *
+ * Returns true if the update was published and false otherwise. This
+ * function must not be called while the calling thread has the set pinned.
+ */
+
+bool rshared_update(rshared_t *shared,
+                    bool (*update)(rset_t *set, void *context),
+                    void *context);
+
+/**
+ * Publish a set created with `rset_new` in place of the current version. The
+ * shared set takes ownership of `set`. This function must not be called
+ * while the calling thread has the set pinned.
+ */
+
+void rshared_replace(rshared_t *shared, rset_t *set);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
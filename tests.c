@@ -1,7 +1,13 @@
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "rset.h"
+#include "rbitmap.h"
+#include "rindex.h"
+#include "rshared.h"
+#include "rbatch.h"
 
 rset_t *rset_new_items(unsigned count, ...)
 {
@@ -25,7 +31,7 @@ static void test_new()
     rset_t *set = rset_new();
     assert(set);
     assert(rset_cardinality(set) == 0);
-    assert(rset_length(set) == sizeof(uint16_t) * 2);
+    assert(rset_length(set) == sizeof(uint16_t) * 4);
     rset_free(set);
 }
 
@@ -34,17 +40,18 @@ static void test_new_items()
     rset_t *set = rset_new_items(0);
     assert(set);
     assert(rset_cardinality(set) == 0);
-    assert(rset_length(set) == sizeof(uint16_t) * 2);
+    assert(rset_length(set) == sizeof(uint16_t) * 4);
     rset_free(set);
 
     set = rset_new_items(3, 1000, 2000, 3000);
     assert(set);
     assert(rset_cardinality(set) == 3);
-    assert(rset_length(set) == sizeof(uint16_t) * (1 + 3));
-    assert(set->buffer[0] == 3 &&
-           set->buffer[1] == 1000 &&
-           set->buffer[2] == 2000 &&
-           set->buffer[3] == 3000);
+    assert(rset_length(set) == sizeof(uint16_t) * (4 + 3));
+    assert(set->buffer[0] == RSET_ARRAY &&
+           set->buffer[1] == 3 &&
+           set->buffer[4] == 1000 &&
+           set->buffer[5] == 2000 &&
+           set->buffer[6] == 3000);
     rset_free(set);
 }
 
@@ -81,7 +88,7 @@ static void test_import_export()
     rset_t *set = rset_new_items(3, 1, 2, 3);
     assert(set);
     assert(rset_export(set) == set->buffer);
-    assert(rset_length(set) == 4 * sizeof(uint16_t));
+    assert(rset_length(set) == 7 * sizeof(uint16_t));
 
     rset_t *copy = rset_import(rset_export(set), rset_length(set));
     assert(copy);
@@ -151,19 +158,23 @@ static void test_array_to_bitset()
         assert(rset_add(set, i * 2));
     assert(rset_cardinality(set) == 32768);
     for (uint16_t i = 0; i < 4096; i++)
-        assert(set->buffer[i + 1] == 0x5555); // 0101010101010101
+        assert(set->buffer[i + 4] == 0x5555); // 0101010101010101
     rset_free(set);
 }
 
 static void test_bitset_to_inverted_array()
 {
+    // Leave out every 16th item so the set doesn't collapse into a handful
+    // of runs.
     rset_t *set = rset_new();
     assert(set);
-    for (uint16_t i = 0; i <= 61440; i++)
-        assert(rset_add(set, i));
+    for (unsigned i = 0; i < 65536; i++)
+        if ((i & 0xF) != 0xF || i < 16)
+            assert(rset_add(set, i));
     assert(rset_cardinality(set) == 61441);
+    assert(set->buffer[0] == RSET_INVERTED_ARRAY);
     for (uint16_t i = 0; i < 4095; i++)
-        assert(set->buffer[i + 1] == 61441 + i);
+        assert(set->buffer[i + 4] == 16 * (i + 2) - 1);
     rset_free(set);
 }
 
@@ -179,8 +190,8 @@ static void test_fill_ascending()
         assert(rset_equals(set, comparison));
     }
     assert(rset_cardinality(set) == 65536);
-    assert(rset_length(set) == sizeof(uint16_t));
-    assert(set->buffer[0] == 0);
+    assert(rset_length(set) == sizeof(uint16_t) * 4);
+    assert(set->buffer[0] == RSET_INVERTED_ARRAY && set->buffer[1] == 0);
     rset_free(set);
     rset_free(comparison);
 }
@@ -197,8 +208,8 @@ static void test_fill_descending()
         assert(rset_equals(set, comparison));
     }
     assert(rset_cardinality(set) == 65536);
-    assert(rset_length(set) == sizeof(uint16_t));
-    assert(set->buffer[0] == 0);
+    assert(rset_length(set) == sizeof(uint16_t) * 4);
+    assert(set->buffer[0] == RSET_INVERTED_ARRAY && set->buffer[1] == 0);
     rset_free(set);
     rset_free(comparison);
 }
@@ -221,8 +232,8 @@ static void test_fill_optimal()
         assert(rset_equals(set, comparison));
     }
     assert(rset_cardinality(set) == 65536);
-    assert(rset_length(set) == sizeof(uint16_t));
-    assert(set->buffer[0] == 0);
+    assert(rset_length(set) == sizeof(uint16_t) * 4);
+    assert(set->buffer[0] == RSET_INVERTED_ARRAY && set->buffer[1] == 0);
     rset_free(set);
     rset_free(comparison);
 }
@@ -326,6 +337,1752 @@ static void test_intersection()
     rset_free(expected);
 }
 
+static void test_bitmap_add_contains()
+{
+    rbitmap_t *bitmap = rbitmap_new();
+    assert(bitmap);
+    assert(rbitmap_cardinality(bitmap) == 0);
+    assert(!rbitmap_contains(bitmap, 0));
+
+    // Add items in descending key order so that keys are inserted in the
+    // middle of the key array.
+    for (uint32_t key = 100; key > 0; key--)
+        for (uint32_t i = 0; i < 10; i++)
+            assert(rbitmap_add(bitmap, (key << 16) | (i * 7)));
+    assert(rbitmap_add(bitmap, 0xFFFFFFFF));
+    assert(rbitmap_add(bitmap, 0xFFFFFFFF)); // idempotent
+    assert(bitmap->count == 101);
+    assert(rbitmap_cardinality(bitmap) == 1001);
+
+    for (uint32_t key = 1; key <= 100; key++) {
+        assert(bitmap->keys[key - 1] == key);
+        for (uint32_t i = 0; i < 70; i++)
+            assert(rbitmap_contains(bitmap, (key << 16) | i) == !(i % 7));
+    }
+    assert(rbitmap_contains(bitmap, 0xFFFFFFFF));
+    assert(!rbitmap_contains(bitmap, 0xFFFFFFFE));
+    assert(!rbitmap_contains(bitmap, 0));
+
+    rbitmap_t *copy = rbitmap_copy(bitmap);
+    assert(copy);
+    assert(rbitmap_equals(bitmap, copy));
+    assert(rbitmap_add(copy, 12345));
+    assert(!rbitmap_equals(bitmap, copy));
+
+    assert(rbitmap_truncate(bitmap));
+    assert(rbitmap_cardinality(bitmap) == 0);
+    assert(!rbitmap_contains(bitmap, 0xFFFFFFFF));
+
+    rbitmap_free(copy);
+    rbitmap_free(bitmap);
+}
+
+static void test_bitmap_intersection()
+{
+    rbitmap_t *a = rbitmap_new();
+    rbitmap_t *b = rbitmap_new();
+    rbitmap_t *result = rbitmap_new();
+    assert(a && b && result);
+
+    for (uint32_t i = 0; i < 16 << 16; i += 2)
+        assert(rbitmap_add(a, i));
+    for (uint32_t i = 0; i < 16 << 16; i += 3)
+        assert(rbitmap_add(b, i));
+    assert(rbitmap_add(a, 0x80000000));
+    assert(rbitmap_add(b, 0x80000001));
+
+    assert(rbitmap_intersection(a, b, result));
+    assert(rbitmap_cardinality(result) == 174763);
+    for (uint32_t i = 0; i < 16 << 16; i++)
+        assert(rbitmap_contains(result, i) == !(i % 6));
+    assert(!rbitmap_contains(result, 0x80000000));
+
+    // The result can alias an operand.
+    assert(rbitmap_intersection(a, result, a));
+    assert(rbitmap_equals(a, result));
+
+    rbitmap_truncate(b);
+    assert(rbitmap_intersection(a, b, result));
+    assert(rbitmap_cardinality(result) == 0);
+    assert(result->count == 0);
+
+    rbitmap_free(a);
+    rbitmap_free(b);
+    rbitmap_free(result);
+}
+
+static void test_bitmap_to_array()
+{
+    rbitmap_t *bitmap = rbitmap_new();
+    assert(bitmap);
+    for (uint32_t i = 0; i < 100000; i += 7)
+        assert(rbitmap_add(bitmap, i * 13));
+    assert(rbitmap_add(bitmap, 0xFFFFFFFF));
+    uint64_t cardinality = rbitmap_cardinality(bitmap);
+    uint32_t *items = malloc(cardinality * sizeof(uint32_t));
+    assert(items);
+    assert(rbitmap_to_array(bitmap, items) == cardinality);
+    for (uint64_t i = 0; i + 1 < cardinality; i++)
+        assert(items[i] == i * 7 * 13);
+    assert(items[cardinality - 1] == 0xFFFFFFFF);
+    free(items);
+    rbitmap_free(bitmap);
+}
+
+static void test_bitmap_invert()
+{
+    rbitmap_t *bitmap = rbitmap_new();
+    rbitmap_t *inverted = rbitmap_new();
+    rbitmap_t *inverted_twice = rbitmap_new();
+    assert(bitmap && inverted && inverted_twice);
+
+    assert(rbitmap_invert(bitmap, inverted));
+    assert(rbitmap_cardinality(inverted) == 1ULL << 32);
+    assert(rbitmap_invert(inverted, inverted_twice));
+    assert(rbitmap_cardinality(inverted_twice) == 0);
+    assert(inverted_twice->count == 0);
+
+    for (uint32_t i = 0; i < 65536; i++)
+        assert(rbitmap_add(bitmap, (3 << 16) | i));
+    assert(rbitmap_add(bitmap, 10));
+    assert(rbitmap_add(bitmap, 0xFFFFFFFF));
+    assert(rbitmap_invert(bitmap, inverted));
+    assert(rbitmap_cardinality(inverted) == (1ULL << 32) - 65538);
+    assert(inverted->count == 65535);
+    assert(!rbitmap_contains(inverted, 10));
+    assert(rbitmap_contains(inverted, 11));
+    assert(!rbitmap_contains(inverted, (3 << 16) | 1234));
+    assert(!rbitmap_contains(inverted, 0xFFFFFFFF));
+    assert(rbitmap_contains(inverted, 0xFFFFFFFE));
+
+    assert(rbitmap_invert(inverted, inverted_twice));
+    assert(rbitmap_equals(bitmap, inverted_twice));
+
+    rbitmap_free(bitmap);
+    rbitmap_free(inverted);
+    rbitmap_free(inverted_twice);
+}
+
+static rset_t *rset_new_range(unsigned start, unsigned end)
+{
+    rset_t *set = rset_new();
+    if (!set)
+        return NULL;
+    for (unsigned i = start; i < end; i++)
+        if (!rset_add(set, i))
+            goto error;
+    return set;
+error:
+    rset_free(set);
+    return NULL;
+}
+
+static void test_array_to_run()
+{
+    rset_t *set = rset_new();
+    assert(set);
+    for (unsigned i = 1000; i < 6000; i++)
+        assert(rset_add(set, i));
+    for (unsigned i = 20000; i < 30000; i++)
+        assert(rset_add(set, i));
+    assert(rset_cardinality(set) == 15000);
+    assert(set->buffer[0] == RSET_RUN);
+    assert(rset_length(set) == sizeof(uint16_t) * (4 + 4));
+    assert(set->buffer[4] == 1000 && set->buffer[5] == 4999);
+    assert(set->buffer[6] == 20000 && set->buffer[7] == 9999);
+
+    // Join the two runs.
+    for (unsigned i = 6000; i < 20000; i++)
+        assert(rset_add(set, i));
+    assert(rset_length(set) == sizeof(uint16_t) * (4 + 2));
+    assert(set->buffer[4] == 1000 && set->buffer[5] == 28999);
+
+    for (unsigned i = 0; i < 65536; i++)
+        assert(rset_contains(set, i) == (i >= 1000 && i < 30000));
+
+    // Isolated items eventually make a bitset smaller than the runs.
+    for (unsigned i = 30001; i < 65536; i += 2)
+        assert(rset_add(set, i));
+    assert(set->buffer[0] == RSET_BITSET);
+    assert(rset_cardinality(set) == 29000 + 17768);
+
+    rset_free(set);
+}
+
+static void test_run_import_export()
+{
+    rset_t *set = rset_new_range(100, 10000);
+    assert(set);
+    assert(set->buffer[0] == RSET_RUN);
+    rset_t *copy = rset_import(rset_export(set), rset_length(set));
+    assert(copy);
+    assert(rset_equals(set, copy));
+    assert(rset_cardinality(copy) == 9900);
+    assert(rset_contains(copy, 100) && rset_contains(copy, 9999));
+    assert(!rset_contains(copy, 99) && !rset_contains(copy, 10000));
+    rset_free(set);
+    rset_free(copy);
+}
+
+static void test_run_invert()
+{
+    rset_t *set = rset_new_range(0, 10000);
+    rset_t *inverted = rset_new();
+    rset_t *expected = rset_new_range(10000, 65536);
+    assert(set && inverted && expected);
+
+    assert(rset_invert(set, inverted));
+    assert(inverted->buffer[0] == RSET_RUN);
+    assert(rset_equals(inverted, expected));
+    assert(rset_invert(inverted, inverted));
+    assert(rset_equals(inverted, set));
+
+    // Runs with gaps at either end.
+    rset_truncate(set);
+    for (unsigned i = 10; i < 65000; i++)
+        if (i % 10000)
+            assert(rset_add(set, i));
+    assert(set->buffer[0] == RSET_RUN);
+    assert(rset_invert(set, inverted));
+    assert(rset_cardinality(inverted) == 10 + 6 + 536);
+    for (unsigned i = 0; i < 65536; i++)
+        assert(rset_contains(inverted, i) == !rset_contains(set, i));
+
+    rset_free(set);
+    rset_free(inverted);
+    rset_free(expected);
+}
+
+static void test_run_intersection()
+{
+    rset_t *a = rset_new_range(0, 20000);
+    rset_t *b = rset_new_range(10000, 30000);
+    rset_t *result = rset_new();
+    rset_t *expected = rset_new_range(10000, 20000);
+    assert(a && b && result && expected);
+
+    assert(rset_intersection(a, b, result));
+    assert(result->buffer[0] == RSET_RUN);
+    assert(rset_equals(result, expected));
+
+    // Run x array
+    rset_truncate(b);
+    for (unsigned i = 0; i < 40000; i += 10)
+        assert(rset_add(b, i));
+    assert(b->buffer[0] == RSET_ARRAY);
+    assert(rset_intersection(a, b, result));
+    assert(rset_intersection(b, a, expected));
+    assert(rset_cardinality(result) == 2000);
+    assert(rset_equals(result, expected));
+    for (unsigned i = 0; i < 40000; i++)
+        assert(rset_contains(result, i) == (i < 20000 && !(i % 10)));
+
+    // Run x bitset
+    rset_truncate(b);
+    for (unsigned i = 0; i < 65536; i += 3)
+        assert(rset_add(b, i));
+    assert(b->buffer[0] == RSET_BITSET);
+    assert(rset_intersection(a, b, result));
+    assert(rset_cardinality(result) == 6667);
+    for (unsigned i = 0; i < 65536; i++)
+        assert(rset_contains(result, i) == (i < 20000 && !(i % 3)));
+
+    // Run x inverted array
+    rset_truncate(b);
+    for (unsigned i = 0; i < 65536; i++)
+        if ((i & 0xF) != 0xF)
+            assert(rset_add(b, i));
+    assert(rset_add(b, 15));
+    assert(b->buffer[0] == RSET_INVERTED_ARRAY);
+    assert(rset_intersection(b, a, result));
+    for (unsigned i = 0; i < 65536; i++)
+        assert(rset_contains(result, i) ==
+               (i < 20000 && ((i & 0xF) != 0xF || i == 15)));
+
+    rset_free(a);
+    rset_free(b);
+    rset_free(result);
+    rset_free(expected);
+}
+
+static void test_optimize()
+{
+    rset_t *set = rset_new_range(0, 1000);
+    assert(set);
+    assert(set->buffer[0] == RSET_ARRAY);
+    assert(rset_optimize(set));
+    assert(set->buffer[0] == RSET_RUN);
+    assert(rset_length(set) == sizeof(uint16_t) * (4 + 2));
+    assert(rset_cardinality(set) == 1000);
+
+    rset_t *comparison = rset_new_range(0, 1000);
+    assert(comparison);
+    assert(rset_equals(set, comparison));
+    assert(rset_equals(comparison, set));
+    assert(rset_add(comparison, 5000));
+    assert(!rset_equals(set, comparison));
+
+    rset_free(set);
+    rset_free(comparison);
+}
+
+static rset_t *rset_new_pattern(unsigned pattern, unsigned seed)
+{
+    // Build sets that cover each representation: empty, sparse and dense
+    // arrays, bitsets, inverted arrays, runs and full.
+    rset_t *set = rset_new();
+    if (!set)
+        return NULL;
+    uint32_t state = seed * 2654435761u + 1;
+    for (unsigned i = 0; i < 65536; i++) {
+        state = state * 1103515245 + 12345;
+        unsigned r = (state >> 16) & 0x7FFF;
+        bool add;
+        switch (pattern) {
+        case 0: add = false; break;
+        case 1: add = r < 64; break;
+        case 2: add = r < 1800; break;
+        case 3: add = r < 16384; break;
+        case 4: add = r >= 300; break;
+        case 5: add = ((i + seed * 1000) / 3000) % 2; break;
+        default: add = true;
+        }
+        if (add && !rset_add(set, i)) {
+            rset_free(set);
+            return NULL;
+        }
+    }
+    return set;
+}
+
+static const unsigned pattern_count = 7;
+
+static void check_op(bool (*op)(const rset_t *, const rset_t *, rset_t *),
+                     bool (*expected)(bool, bool))
+{
+    rset_t *result = rset_new();
+    assert(result);
+    for (unsigned i = 0; i < pattern_count; i++) {
+        for (unsigned j = 0; j < pattern_count; j++) {
+            rset_t *a = rset_new_pattern(i, 1);
+            rset_t *b = rset_new_pattern(j, 2);
+            assert(a && b);
+            assert(op(a, b, result));
+            unsigned cardinality = 0;
+            for (unsigned k = 0; k < 65536; k++) {
+                bool contains = rset_contains(result, k);
+                assert(contains == expected(rset_contains(a, k),
+                                            rset_contains(b, k)));
+                cardinality += contains;
+            }
+            assert(rset_cardinality(result) == cardinality);
+            rset_free(a);
+            rset_free(b);
+        }
+    }
+    rset_free(result);
+}
+
+static bool expect_union(bool a, bool b)
+{
+    return a || b;
+}
+
+static bool expect_difference(bool a, bool b)
+{
+    return a && !b;
+}
+
+static bool expect_xor(bool a, bool b)
+{
+    return a != b;
+}
+
+static void test_union()
+{
+    check_op(rset_union, expect_union);
+
+    // Large arrays are merged with SSE and become a bitset.
+    rset_t *a = rset_new();
+    rset_t *b = rset_new();
+    rset_t *result = rset_new();
+    assert(a && b && result);
+    for (unsigned i = 0; i < 3000; i++) {
+        assert(rset_add(a, i * 7));
+        assert(rset_add(b, i * 5));
+    }
+    assert(rset_union(a, b, result));
+    assert(result->buffer[0] == RSET_BITSET);
+    assert(rset_cardinality(result) == 3000 + 3000 - 429);
+    for (unsigned i = 0; i < 65536; i++)
+        assert(rset_contains(result, i) ==
+               ((!(i % 7) && i < 21000) || (!(i % 5) && i < 15000)));
+
+    rset_truncate(a);
+    rset_truncate(b);
+    for (unsigned i = 0; i < 100; i++) {
+        assert(rset_add(a, i * 2));
+        assert(rset_add(b, i * 3));
+    }
+    assert(rset_union(a, b, result));
+    assert(result->buffer[0] == RSET_ARRAY);
+    assert(rset_cardinality(result) == 100 + 100 - 34);
+
+    rset_free(a);
+    rset_free(b);
+    rset_free(result);
+}
+
+static void test_difference()
+{
+    check_op(rset_difference, expect_difference);
+}
+
+static void test_xor()
+{
+    check_op(rset_xor, expect_xor);
+}
+
+static bool expect_intersection(bool a, bool b)
+{
+    return a && b;
+}
+
+static void test_mixed_intersection()
+{
+    check_op(rset_intersection, expect_intersection);
+
+    // A small array intersected with a bitset stays an array.
+    rset_t *a = rset_new_items(10, 0, 3, 6, 7, 9, 12, 1000, 1001, 1002, 1003);
+    rset_t *b = rset_new();
+    rset_t *result = rset_new();
+    assert(a && b && result);
+    for (unsigned i = 0; i < 65536; i += 3)
+        assert(rset_add(b, i));
+    assert(b->buffer[0] == RSET_BITSET);
+    assert(rset_intersection(a, b, result));
+    assert(result->buffer[0] == RSET_ARRAY);
+    assert(rset_length(result) == sizeof(uint16_t) * (4 + 6));
+    rset_t *expected = rset_new_items(6, 0, 3, 6, 9, 12, 1002);
+    assert(expected);
+    assert(rset_equals(result, expected));
+
+    // Sparse intersections of bitsets are converted back to an array.
+    rset_truncate(a);
+    for (unsigned i = 0; i < 65536; i += 7)
+        assert(rset_add(a, i));
+    assert(a->buffer[0] == RSET_BITSET);
+    assert(rset_intersection(a, b, result));
+    assert(result->buffer[0] == RSET_ARRAY);
+    assert(rset_cardinality(result) == 3121);
+
+    rset_free(a);
+    rset_free(b);
+    rset_free(result);
+    rset_free(expected);
+}
+
+static void test_skewed_intersection()
+{
+    // Small arrays are galloped through large arrays and inverted arrays.
+    rset_t *large = rset_new();
+    rset_t *inverted = rset_new();
+    rset_t *small = rset_new();
+    rset_t *result = rset_new();
+    assert(large && inverted && small && result);
+    for (unsigned i = 0; i < 4000; i++)
+        assert(rset_add(large, i * 7));
+    assert(rset_invert(large, inverted));
+    assert(inverted->buffer[0] == RSET_INVERTED_ARRAY);
+    for (unsigned count = 1; count <= 100; count *= 3) {
+        rset_truncate(small);
+        for (unsigned i = 0; i < count; i++)
+            assert(rset_add(small, i * 997 % 65536 + (i & 1)));
+        const rset_t *others[] = { large, inverted };
+        for (unsigned k = 0; k < 2; k++) {
+            const rset_t *other = others[k];
+            unsigned expected = 0;
+            for (unsigned i = 0; i < 65536; i++)
+                expected += rset_contains(small, i) && rset_contains(other, i);
+            assert(rset_intersection(small, other, result));
+            assert(rset_cardinality(result) == expected);
+            for (unsigned i = 0; i < 65536; i++)
+                assert(rset_contains(result, i) ==
+                       (rset_contains(small, i) && rset_contains(other, i)));
+            assert(rset_intersection(other, small, result));
+            assert(rset_cardinality(result) == expected);
+            assert(rset_intersection_cardinality(small, other) == expected);
+            assert(rset_intersection_cardinality(other, small) == expected);
+            assert(rset_difference(small, other, result));
+            assert(rset_cardinality(result) == count - expected);
+        }
+    }
+    rset_free(large);
+    rset_free(inverted);
+    rset_free(small);
+    rset_free(result);
+}
+
+static void test_cardinality_ops()
+{
+    rset_t *result = rset_new();
+    assert(result);
+    for (unsigned i = 0; i < pattern_count; i++) {
+        for (unsigned j = 0; j < pattern_count; j++) {
+            rset_t *a = rset_new_pattern(i, 1);
+            rset_t *b = rset_new_pattern(j, 2);
+            assert(a && b);
+            assert(rset_intersection(a, b, result));
+            unsigned intersection = rset_cardinality(result);
+            assert(rset_intersection_cardinality(a, b) == intersection);
+            assert(rset_intersects(a, b) == (intersection > 0));
+            assert(rset_union(a, b, result));
+            unsigned union_ = rset_cardinality(result);
+            assert(rset_union_cardinality(a, b) == union_);
+            assert(rset_difference(a, b, result));
+            assert(rset_difference_cardinality(a, b) ==
+                   rset_cardinality(result));
+            assert(rset_jaccard(a, b) ==
+                   (union_ ? (double)intersection / union_ : 1));
+
+            // A set never intersects its complement.
+            assert(rset_invert(a, b));
+            assert(!rset_intersection_cardinality(a, b));
+            assert(!rset_intersects(a, b));
+            assert(!rset_intersects(b, a));
+            assert(rset_union_cardinality(a, b) == 65536);
+            rset_free(a);
+            rset_free(b);
+        }
+    }
+    rset_free(result);
+}
+
+static void check_inplace(bool (*op)(const rset_t *, const rset_t *, rset_t *),
+                          bool (*inplace)(rset_t *, const rset_t *))
+{
+    rset_t *expected = rset_new();
+    assert(expected);
+    for (unsigned i = 0; i < pattern_count; i++) {
+        for (unsigned j = 0; j < pattern_count; j++) {
+            rset_t *a = rset_new_pattern(i, 1);
+            rset_t *b = rset_new_pattern(j, 2);
+            assert(a && b);
+            assert(op(a, b, expected));
+            assert(inplace(a, b));
+            assert(rset_equals(a, expected));
+            for (unsigned k = 0; k < 65536; k++)
+                assert(rset_contains(a, k) == rset_contains(expected, k));
+
+            assert(op(b, b, expected));
+            assert(inplace(b, b));
+            assert(rset_equals(b, expected));
+            rset_free(a);
+            rset_free(b);
+        }
+    }
+    rset_free(expected);
+}
+
+static void test_inplace_ops()
+{
+    check_inplace(rset_intersection, rset_and_inplace);
+    check_inplace(rset_union, rset_or_inplace);
+    check_inplace(rset_difference, rset_andnot_inplace);
+
+    // Arrays with overlapping items are merged without a temporary set.
+    rset_t *a = rset_new_items(5, 1, 3, 5, 7, 9);
+    rset_t *b = rset_new_items(5, 0, 3, 4, 9, 10);
+    rset_t *expected = rset_new_items(8, 0, 1, 3, 4, 5, 7, 9, 10);
+    assert(a && b && expected);
+    assert(rset_or_inplace(a, b));
+    assert(a->buffer[0] == RSET_ARRAY);
+    assert(rset_equals(a, expected));
+
+    // A bitset that stays a bitset keeps its buffer.
+    rset_truncate(a);
+    rset_truncate(b);
+    for (unsigned i = 0; i < 65536; i += 2) {
+        assert(rset_add(a, i));
+        assert(rset_add(b, i + (i % 6 == 0)));
+    }
+    uint16_t *buffer = a->buffer;
+    assert(rset_and_inplace(a, b));
+    assert(a->buffer == buffer && a->buffer[0] == RSET_BITSET);
+    assert(rset_cardinality(a) == 32768 - 10923);
+
+    rset_free(a);
+    rset_free(b);
+    rset_free(expected);
+}
+
+static size_t allocated_bytes;
+static unsigned allocation_count;
+
+static void *counting_allocate(void *context, size_t size)
+{
+    // Store the size in front of each block to check that blocks are freed
+    // and resized with the size they were allocated with.
+    (void)context;
+    size_t *block = malloc(sizeof(size_t) * 2 + size);
+    if (!block)
+        return NULL;
+    *block = size;
+    allocated_bytes += size;
+    allocation_count++;
+    return block + 2;
+}
+
+static void *counting_reallocate(void *context, void *pointer,
+                                 size_t old_size, size_t size)
+{
+    (void)context;
+    size_t *block = (size_t *)pointer - 2;
+    assert(*block == old_size);
+    block = realloc(block, sizeof(size_t) * 2 + size);
+    if (!block)
+        return NULL;
+    *block = size;
+    allocated_bytes += size - old_size;
+    allocation_count++;
+    return block + 2;
+}
+
+static void counting_deallocate(void *context, void *pointer, size_t size)
+{
+    (void)context;
+    size_t *block = (size_t *)pointer - 2;
+    assert(*block == size);
+    allocated_bytes -= size;
+    free(block);
+}
+
+static unsigned allocator_workload()
+{
+    // Exercise every path that allocates: growth, conversions, binary and
+    // in-place operations, N-ary operations and copies.
+    unsigned checksum = 0;
+    rset_t *result = rset_new();
+    assert(result);
+    for (unsigned i = 0; i < pattern_count; i++) {
+        for (unsigned j = 0; j < pattern_count; j++) {
+            rset_t *a = rset_new_pattern(i, 1);
+            rset_t *b = rset_new_pattern(j, 2);
+            assert(a && b);
+            assert(rset_union(a, b, result));
+            checksum += rset_cardinality(result);
+            assert(rset_xor(a, b, result));
+            checksum += rset_cardinality(result);
+            assert(rset_and_inplace(a, b));
+            assert(rset_or_inplace(b, a));
+            assert(rset_andnot_inplace(b, a));
+            checksum += rset_cardinality(a) + rset_cardinality(b);
+            const rset_t *sets[] = { a, b, result };
+            assert(rset_intersection_many(sets, 3, result));
+            checksum += rset_cardinality(result);
+            assert(rset_union_many(sets, 3, a));
+            checksum += rset_cardinality(a);
+            rset_t *copy = rset_copy(a);
+            assert(copy && rset_optimize(copy) && rset_equals(copy, a));
+            rset_free(copy);
+            rset_free(a);
+            rset_free(b);
+        }
+    }
+    rset_t set;
+    assert(rset_init(&set));
+    static uint16_t items[20000];
+    for (unsigned i = 0; i < 20000; i++)
+        items[i] = 3 * (19999 - i);
+    assert(rset_add_many(&set, items, 20000));
+    for (unsigned i = 0; i < 65536; i++)
+        assert(rset_add(&set, i));
+    for (unsigned i = 0; i < 65536; i += 2)
+        assert(rset_remove(&set, i));
+    checksum += rset_cardinality(&set);
+    rset_destroy(&set);
+    rset_free(result);
+    return checksum;
+}
+
+static void test_allocator()
+{
+    unsigned expected = allocator_workload();
+
+    // Every block is freed with the size it was allocated with.
+    rset_allocator_t counting = {
+        counting_allocate, counting_reallocate, counting_deallocate, NULL
+    };
+    rset_set_allocator(&counting);
+    assert(allocator_workload() == expected);
+    assert(allocated_bytes == 0);
+    rset_set_allocator(NULL);
+
+    // Freed blocks are recycled, and freeing the pool frees sets that
+    // weren't freed.
+    rset_pool_t *pool = rset_pool_new();
+    assert(pool);
+    rset_allocator_t pooled = rset_pool_allocator(pool);
+    rset_set_allocator(&pooled);
+    assert(allocator_workload() == expected);
+    rset_t *set = rset_new();
+    assert(set);
+    uint16_t *buffer = set->buffer;
+    rset_free(set);
+    rset_t *reused = rset_new();
+    assert(reused == set && reused->buffer == buffer);
+    rset_t *leaked = rset_new_pattern(2, 3);
+    assert(leaked && rset_cardinality(leaked));
+    rset_set_allocator(NULL);
+    rset_pool_free(pool);
+}
+
+static void test_conversions_without_allocation()
+{
+    rset_allocator_t counting = {
+        counting_allocate, counting_reallocate, counting_deallocate, NULL
+    };
+    rset_set_allocator(&counting);
+    rset_t *set = rset_new();
+    assert(set);
+
+    // Once the buffer has grown to its largest size, moving between arrays,
+    // bitsets and inverted arrays reuses it.
+    unsigned count = 0;
+    for (unsigned pass = 0; pass < 2; pass++) {
+        for (unsigned i = 0; i < 65536; i += 2)
+            assert(rset_add(set, i));
+        assert(set->buffer[0] == RSET_BITSET);
+        for (unsigned i = 0; i < 65536; i++)
+            assert(rset_add(set, i ^ 0x5555));
+        assert(set->buffer[0] == RSET_INVERTED_ARRAY);
+        for (unsigned i = 0; i < 65536; i += 3)
+            assert(rset_remove(set, i));
+        assert(set->buffer[0] == RSET_BITSET);
+        for (unsigned i = 0; i < 65536; i++)
+            if (i % 3 != 2)
+                assert(rset_remove(set, i));
+        assert(rset_cardinality(set) == 21845);
+        for (unsigned i = 2; i < 65536; i += 3)
+            assert(rset_contains(set, i));
+        for (unsigned i = 2; i < 65536; i += 3)
+            assert(rset_remove(set, i));
+        assert(set->buffer[0] == RSET_ARRAY && rset_cardinality(set) == 0);
+        if (pass)
+            assert(allocation_count == count);
+        count = allocation_count;
+    }
+
+    rset_free(set);
+    assert(allocated_bytes == 0);
+    rset_set_allocator(NULL);
+}
+
+static void test_result_sizes()
+{
+    // Results are never grown past the largest buffer, even when the
+    // operands combined have more items than fit, so every buffer comes from
+    // one of the pool's size classes.
+    rset_pool_t *pool = rset_pool_new();
+    assert(pool);
+    rset_allocator_t pooled = rset_pool_allocator(pool);
+    rset_set_allocator(&pooled);
+    rset_t *a = rset_new(), *b = rset_new(), *result = rset_new();
+    assert(a && b && result);
+    for (unsigned i = 0; i < 4000; i++)
+        assert(rset_add(a, 2 * i) && rset_add(b, 2 * i + 1));
+    assert(rset_union(a, b, result));
+    assert(rset_cardinality(result) == 8000 && result->size <= 4608);
+    assert(rset_xor(a, b, result));
+    assert(rset_cardinality(result) == 8000 && result->size <= 4608);
+    assert(rset_or_inplace(a, b));
+    assert(rset_cardinality(a) == 8000 && a->size <= 4608);
+    for (unsigned i = 0; i < 8000; i++)
+        assert(rset_contains(a, i));
+
+    // Runs of three items every four, against the same runs shifted by two,
+    // intersect in 3999 single-item runs.
+    assert(rset_truncate(a) && rset_truncate(b));
+    for (unsigned i = 0; i < 2000; i++) {
+        assert(rset_add_range(a, 4 * i, 4 * i + 3));
+        assert(rset_add_range(b, 4 * i + 2, 4 * i + 5));
+    }
+    assert(a->buffer[0] == RSET_RUN && b->buffer[0] == RSET_RUN);
+    assert(rset_intersection(a, b, result));
+    assert(rset_cardinality(result) == 3999 && result->size <= 4608);
+    for (unsigned i = 0; i < 8004; i++)
+        assert(rset_contains(result, i) == (i % 2 == 0 && i && i < 8000));
+    assert(!pool->large);
+
+    rset_set_allocator(NULL);
+    rset_pool_free(pool);
+}
+
+static void test_many_ops()
+{
+    const unsigned patterns[] = { 2, 3, 5, 4, 1, 6, 3, 5, 0, 2 };
+    const unsigned set_count = sizeof(patterns) / sizeof(*patterns);
+    const rset_t *sets[sizeof(patterns) / sizeof(*patterns)];
+    for (unsigned i = 0; i < set_count; i++) {
+        sets[i] = rset_new_pattern(patterns[i], i + 1);
+        assert(sets[i]);
+    }
+    rset_t *intersection = rset_new();
+    rset_t *union_ = rset_new();
+    rset_t *result = rset_new();
+    assert(intersection && union_ && result);
+
+    for (unsigned first = 0; first < set_count; first++) {
+        for (unsigned n = 0; first + n <= set_count; n++) {
+            const rset_t **window = sets + first;
+            assert(rset_fill(intersection));
+            assert(rset_truncate(union_));
+            for (unsigned i = 0; i < n; i++) {
+                assert(rset_and_inplace(intersection, window[i]));
+                assert(rset_or_inplace(union_, window[i]));
+            }
+            assert(rset_intersection_many(window, n, result));
+            assert(rset_equals(result, intersection));
+            assert(rset_union_many(window, n, result));
+            assert(rset_equals(result, union_));
+        }
+    }
+
+    // The output can be one of the inputs.
+    rset_t *out = rset_copy(sets[1]);
+    assert(out);
+    const rset_t *aliased[] = { sets[0], out, sets[3] };
+    assert(rset_intersection_many(sets, 2, intersection));
+    assert(rset_intersection_many(aliased, 2, out));
+    assert(rset_equals(out, intersection));
+    assert(rset_union_many(aliased, 3, union_));
+    assert(rset_union_many(aliased, 3, out));
+    assert(rset_equals(out, union_));
+
+    // A small array is galloped through a large one, in either direction.
+    rset_t *small = rset_new_items(6, 0, 3, 999, 1000, 3999, 65535);
+    rset_t *large = rset_new();
+    assert(small && large);
+    for (unsigned i = 0; i < 4000; i++)
+        assert(rset_add(large, i * 3));
+    rset_t *expected = rset_new_items(4, 0, 3, 999, 3999);
+    assert(expected && rset_truncate(out) && rset_or_inplace(out, small));
+    assert(rset_and_inplace(out, large));
+    assert(rset_equals(out, expected));
+    assert(rset_truncate(out) && rset_or_inplace(out, large));
+    assert(rset_and_inplace(out, small));
+    assert(rset_equals(out, expected));
+
+    for (unsigned i = 0; i < set_count; i++)
+        rset_free((rset_t *)sets[i]);
+    rset_free(intersection);
+    rset_free(union_);
+    rset_free(result);
+    rset_free(out);
+    rset_free(small);
+    rset_free(large);
+    rset_free(expected);
+}
+
+static void test_remove()
+{
+    for (unsigned pattern = 0; pattern < pattern_count; pattern++) {
+        rset_t *set = rset_new_pattern(pattern, 3);
+        rset_t *expected = rset_new_pattern(pattern, 3);
+        assert(set && expected);
+        for (unsigned i = 0; i < 65536; i += 7) {
+            assert(rset_remove(set, i));
+            assert(rset_remove(set, i)); // idempotent
+        }
+        for (unsigned i = 0; i < 65536; i++)
+            assert(rset_contains(set, i) ==
+                   (rset_contains(expected, i) && i % 7));
+        for (unsigned i = 0; i < 65536; i++)
+            assert(rset_remove(set, i));
+        assert(rset_cardinality(set) == 0);
+        rset_free(set);
+        rset_free(expected);
+    }
+
+    rset_t *set = rset_new_range(0, 1000);
+    assert(set);
+    assert(rset_optimize(set));
+    assert(set->buffer[0] == RSET_RUN);
+    assert(rset_remove(set, 500));
+    assert(set->buffer[0] == RSET_RUN);
+    assert(rset_length(set) == sizeof(uint16_t) * (4 + 4));
+    assert(rset_cardinality(set) == 999);
+    assert(!rset_contains(set, 500));
+    assert(rset_contains(set, 499) && rset_contains(set, 501));
+    rset_free(set);
+}
+
+static void test_remove_hysteresis()
+{
+    rset_t *set = rset_new();
+    assert(set);
+    for (unsigned i = 0; i <= 4096; i++)
+        assert(rset_add(set, i * 2));
+    assert(set->buffer[0] == RSET_BITSET);
+
+    // Hovering around the cut-off point doesn't convert back to an array.
+    for (unsigned i = 0; i < 100; i++) {
+        assert(rset_remove(set, 0));
+        assert(set->buffer[0] == RSET_BITSET);
+        assert(rset_add(set, 0));
+        assert(set->buffer[0] == RSET_BITSET);
+    }
+    for (unsigned i = 0; i < 512; i++)
+        assert(rset_remove(set, i * 2));
+    assert(set->buffer[0] == RSET_BITSET);
+    assert(rset_remove(set, 1024));
+    assert(set->buffer[0] == RSET_ARRAY);
+    assert(rset_cardinality(set) == 3584);
+    for (unsigned i = 0; i < 65536; i++)
+        assert(rset_contains(set, i) == (!(i % 2) && i > 1024 && i <= 8192));
+
+    // Inverted arrays can grow past the cut-off point before they become a
+    // bitset.
+    rset_truncate(set);
+    for (unsigned i = 0; i < 65536; i++)
+        if (i % 16 || i < 16)
+            assert(rset_add(set, i));
+    assert(set->buffer[0] == RSET_INVERTED_ARRAY);
+    for (unsigned i = 0; i < 100; i++) {
+        assert(rset_remove(set, 1));
+        assert(set->buffer[0] == RSET_INVERTED_ARRAY);
+        assert(rset_add(set, 1));
+        assert(set->buffer[0] == RSET_INVERTED_ARRAY);
+    }
+    for (unsigned i = 0; i < 513; i++)
+        assert(rset_remove(set, i * 16 + 1));
+    assert(set->buffer[0] == RSET_INVERTED_ARRAY);
+    assert(rset_length(set) == sizeof(uint16_t) * (4 + 4608));
+    rset_t *copy = rset_copy(set);
+    assert(copy && rset_equals(set, copy));
+    rset_free(copy);
+    assert(rset_remove(set, 2));
+    assert(set->buffer[0] == RSET_BITSET);
+    assert(rset_cardinality(set) == 65536 - 4609);
+
+    rset_free(set);
+}
+
+static void test_add_many()
+{
+    uint16_t items[20000];
+    uint32_t state = 1;
+    for (unsigned i = 0; i < 20000; i++) {
+        state = state * 1103515245 + 12345;
+        items[i] = state >> 16;
+    }
+    const unsigned counts[] = { 0, 1, 100, 3000, 4200, 20000 };
+
+    for (unsigned pattern = 0; pattern < pattern_count; pattern++) {
+        for (unsigned c = 0; c < sizeof(counts) / sizeof(*counts); c++) {
+            rset_t *set = rset_new_pattern(pattern, 4);
+            rset_t *expected = rset_new_pattern(pattern, 4);
+            assert(set && expected);
+            assert(rset_add_many(set, items, counts[c]));
+            for (unsigned i = 0; i < counts[c]; i++)
+                assert(rset_add(expected, items[i]));
+            assert(rset_equals(set, expected));
+            for (unsigned i = 0; i < 65536; i++)
+                assert(rset_contains(set, i) == rset_contains(expected, i));
+            rset_free(set);
+            rset_free(expected);
+        }
+    }
+
+    // Sorted input, including duplicates.
+    rset_t *set = rset_new_items(3, 1, 5, 9);
+    assert(set);
+    uint16_t sorted[] = { 0, 2, 4, 5, 5, 6, 8, 100 };
+    assert(rset_add_many(set, sorted, 8));
+    rset_t *expected = rset_new_items(9, 0, 1, 2, 4, 5, 6, 8, 9, 100);
+    assert(expected);
+    assert(rset_equals(set, expected));
+    assert(set->buffer[0] == RSET_ARRAY);
+    rset_free(expected);
+
+    // Input that passes the cut-off goes straight to a bitset.
+    rset_truncate(set);
+    uint16_t descending[10000];
+    for (unsigned i = 0; i < 10000; i++)
+        descending[i] = 60000 - i * 3;
+    assert(rset_add_many(set, descending, 10000));
+    assert(set->buffer[0] == RSET_BITSET);
+    assert(rset_cardinality(set) == 10000);
+    rset_free(set);
+}
+
+static void test_range_ops()
+{
+    const unsigned ranges[][2] = {
+        { 0, 0 }, { 5, 5 }, { 0, 1 }, { 100, 116 }, { 17, 4000 },
+        { 1000, 9000 }, { 30000, 65536 }, { 65535, 65536 }, { 0, 65536 },
+        { 12345, 12346 }, { 2000, 70000 }
+    };
+    const unsigned range_count = sizeof(ranges) / sizeof(*ranges);
+
+    for (unsigned pattern = 0; pattern < pattern_count; pattern++) {
+        for (unsigned r = 0; r < range_count; r++) {
+            unsigned start = ranges[r][0], end = ranges[r][1];
+            unsigned last = end < 65536 ? end : 65536;
+            rset_t *set = rset_new_pattern(pattern, 5);
+            assert(set);
+
+            unsigned cardinality = 0;
+            for (unsigned i = start; i < last; i++)
+                cardinality += rset_contains(set, i);
+            assert(rset_range_cardinality(set, start, end) == cardinality);
+            assert(rset_contains_range(set, start, end) ==
+                   (cardinality == last - start || start >= last));
+
+            rset_t *added = rset_copy(set);
+            rset_t *expected = rset_copy(set);
+            assert(added && expected);
+            assert(rset_add_range(added, start, end));
+            for (unsigned i = start; i < last; i++)
+                assert(rset_add(expected, i));
+            assert(rset_cardinality(added) == rset_cardinality(expected));
+            for (unsigned i = 0; i < 65536; i++)
+                assert(rset_contains(added, i) == rset_contains(expected, i));
+            assert(rset_contains_range(added, start, end));
+            rset_free(added);
+            rset_free(expected);
+
+            rset_t *removed = rset_copy(set);
+            expected = rset_copy(set);
+            assert(removed && expected);
+            assert(rset_remove_range(removed, start, end));
+            for (unsigned i = start; i < last; i++)
+                assert(rset_remove(expected, i));
+            assert(rset_cardinality(removed) == rset_cardinality(expected));
+            for (unsigned i = 0; i < 65536; i++)
+                assert(rset_contains(removed, i) == rset_contains(expected, i));
+            assert(!rset_range_cardinality(removed, start, end));
+            rset_free(removed);
+            rset_free(expected);
+            rset_free(set);
+        }
+    }
+
+    // Adjacent and overlapping ranges merge into a single run.
+    rset_t *set = rset_new();
+    assert(set);
+    assert(rset_add_range(set, 100, 5000));
+    assert(rset_add_range(set, 6000, 9000));
+    assert(rset_add_range(set, 5000, 6000));
+    assert(set->buffer[0] == RSET_RUN && set->buffer[1] == 2);
+    assert(rset_cardinality(set) == 8900);
+    assert(rset_contains_range(set, 100, 9000));
+    assert(!rset_contains_range(set, 99, 9000));
+    assert(rset_range_cardinality(set, 0, 200) == 100);
+
+    // Removing from the middle of a run splits it.
+    assert(rset_remove_range(set, 4000, 4010));
+    assert(set->buffer[0] == RSET_RUN && set->buffer[1] == 4);
+    assert(rset_cardinality(set) == 8890);
+    assert(!rset_contains(set, 4009) && rset_contains(set, 4010));
+    rset_free(set);
+}
+
+static void test_rank_select()
+{
+    for (unsigned pattern = 0; pattern < pattern_count; pattern++) {
+        rset_t *set = rset_new_pattern(pattern, 6);
+        assert(set);
+        unsigned rank = 0;
+        uint16_t item;
+        for (unsigned i = 0; i < 65536; i++) {
+            if (rset_contains(set, i)) {
+                assert(rset_select(set, rank, &item) && item == i);
+                rank++;
+            }
+            assert(rset_rank(set, i) == rank);
+        }
+        assert(rank == rset_cardinality(set));
+        assert(!rset_select(set, rank, &item));
+        rset_free(set);
+    }
+}
+
+static void test_iterator()
+{
+    for (unsigned pattern = 0; pattern < pattern_count; pattern++) {
+        rset_t *set = rset_new_pattern(pattern, 7);
+        assert(set);
+
+        // Sequential iteration visits every item in order.
+        rset_iterator_t iterator;
+        rset_iterator_init(&iterator, set);
+        uint16_t item;
+        for (unsigned i = 0; i < 65536; i++)
+            if (rset_contains(set, i))
+                assert(rset_iterator_next(&iterator, &item) && item == i);
+        assert(!rset_iterator_next(&iterator, &item));
+        assert(!rset_iterator_next(&iterator, &item));
+
+        // Skip ahead by varying distances.
+        rset_iterator_init(&iterator, set);
+        unsigned target = 0;
+        for (unsigned step = 1; target < 65536; step = step * 3 + 1) {
+            unsigned expected = target;
+            while (expected < 65536 && !rset_contains(set, expected))
+                expected++;
+            bool found = rset_iterator_advance_to(&iterator, target, &item);
+            assert(found == (expected < 65536));
+            if (found)
+                assert(item == expected);
+            target = (found ? item : target) + step;
+        }
+
+        // Page through the set.
+        unsigned cardinality = rset_cardinality(set);
+        rset_iterator_init(&iterator, set);
+        for (unsigned rank = 0; rank < cardinality; rank += 997) {
+            unsigned page = rank < cardinality / 2 ? cardinality - rank : rank;
+            if (page >= cardinality)
+                page = cardinality - 1;
+            uint16_t expected;
+            assert(rset_iterator_seek(&iterator, page));
+            assert(rset_select(set, page, &expected));
+            assert(rset_iterator_next(&iterator, &item) && item == expected);
+            if (page + 1 < cardinality) {
+                assert(rset_select(set, page + 1, &expected));
+                assert(rset_iterator_next(&iterator, &item));
+                assert(item == expected);
+            }
+        }
+        assert(!rset_iterator_seek(&iterator, cardinality));
+        rset_free(set);
+    }
+}
+
+static void test_to_array()
+{
+    static uint16_t items[65536 + 16];
+    static uint32_t items32[65536 + 16];
+    for (unsigned pattern = 0; pattern < pattern_count; pattern++) {
+        rset_t *set = rset_new_pattern(pattern, 8);
+        assert(set);
+        unsigned cardinality = rset_cardinality(set);
+        memset(items, 0xAA, sizeof(items));
+        memset(items32, 0xAA, sizeof(items32));
+        assert(rset_to_array(set, items) == cardinality);
+        assert(rset_to_array32(set, 7 << 16, items32) == cardinality);
+        unsigned count = 0;
+        for (unsigned i = 0; i < 65536; i++) {
+            if (rset_contains(set, i)) {
+                assert(items[count] == i);
+                assert(items32[count] == ((7 << 16) | i));
+                count++;
+            }
+        }
+        assert(count == cardinality);
+
+        // Nothing is written past the end of the output.
+        assert(items[cardinality] == 0xAAAA);
+        assert(items32[cardinality] == 0xAAAAAAAA);
+        rset_free(set);
+    }
+}
+
+static void test_view()
+{
+    // Views wrap exported buffers in place, at any 2-byte alignment.
+    static uint16_t storage[4 + 4096 + 1];
+    rset_t *result = rset_new();
+    rset_t *other = rset_new_pattern(3, 9);
+    assert(result && other);
+    for (unsigned pattern = 0; pattern < pattern_count; pattern++) {
+        rset_t *set = rset_new_pattern(pattern, 4);
+        assert(set);
+        unsigned length = rset_length(set);
+        memcpy(storage + 1, rset_export(set), length);
+        rset_view_t view;
+        const rset_t *wrapped = rset_view(&view, storage + 1, length);
+        assert(wrapped && wrapped->buffer == storage + 1);
+        assert(rset_cardinality(wrapped) == rset_cardinality(set));
+        assert(rset_equals(wrapped, set));
+        for (unsigned i = 0; i < 65536; i++)
+            assert(rset_contains(wrapped, i) == rset_contains(set, i));
+
+        rset_iterator_t iterator;
+        rset_iterator_init(&iterator, wrapped);
+        uint16_t item;
+        unsigned count = 0;
+        while (rset_iterator_next(&iterator, &item)) {
+            assert(rset_contains(set, item));
+            count++;
+        }
+        assert(count == rset_cardinality(set));
+
+        assert(rset_intersection(wrapped, other, result));
+        assert(rset_intersection_cardinality(set, other) ==
+               rset_cardinality(result));
+        assert(rset_union(other, wrapped, result));
+        assert(rset_union_cardinality(wrapped, other) ==
+               rset_cardinality(result));
+
+        // A copy of a view owns its buffer and can be modified.
+        rset_t *copy = rset_copy(wrapped);
+        assert(copy && copy->buffer != storage + 1);
+        assert(rset_add(copy, 12345) && rset_remove(copy, 54321));
+        assert(rset_equals(wrapped, set));
+        rset_free(copy);
+        rset_free(set);
+    }
+
+    // Buffers with an inconsistent header are rejected.
+    rset_view_t view;
+    rset_t *set = rset_new_items(3, 1, 2, 3);
+    assert(set);
+    memcpy(storage, rset_export(set), rset_length(set));
+    assert(rset_view(&view, storage, rset_length(set)));
+    assert(!rset_view(&view, storage, rset_length(set) - 2));
+    assert(!rset_view(&view, storage, 6));
+    assert(!rset_view(&view, (const char *)storage + 1, rset_length(set)));
+    assert(!rset_view(&view, NULL, rset_length(set)));
+    storage[2] = 4;
+    assert(!rset_view(&view, storage, rset_length(set)));
+    storage[2] = 3;
+    storage[0] = 7;
+    assert(!rset_view(&view, storage, rset_length(set)));
+
+    // So are buffers whose items break the invariants that set operations
+    // rely on, e.g. a run that runs past 65535, which would otherwise be
+    // written past the end of a bitset when the run is expanded.
+    const uint16_t past_end[] = { RSET_RUN, 2, 2001, 0, 65000, 2000 };
+    assert(!rset_view(&view, past_end, sizeof(past_end)));
+    const uint16_t overlapping[] = { RSET_RUN, 4, 5, 0, 10, 2, 12, 1 };
+    assert(!rset_view(&view, overlapping, sizeof(overlapping)));
+    const uint16_t adjacent[] = { RSET_RUN, 4, 20, 0, 0, 9, 10, 9 };
+    assert(!rset_view(&view, adjacent, sizeof(adjacent)));
+    const uint16_t apart[] = { RSET_RUN, 4, 19, 0, 0, 9, 11, 8 };
+    assert(rset_view(&view, apart, sizeof(apart)));
+    const uint16_t unsorted[] = { RSET_ARRAY, 3, 3, 0, 1, 3, 2 };
+    assert(!rset_view(&view, unsorted, sizeof(unsorted)));
+    const uint16_t runs[] = { RSET_RUN, 4, 5, 0, 10, 2, 65534, 1 };
+    const rset_t *wrapped = rset_view(&view, runs, sizeof(runs));
+    assert(wrapped && rset_contains(wrapped, 65535));
+    assert(rset_union(wrapped, other, result));
+    memset(storage, 0, sizeof(storage));
+    storage[0] = RSET_BITSET;
+    storage[1] = 4096;
+    storage[2] = 1;
+    assert(!rset_view(&view, storage, 2 * (4 + 4096)));
+    storage[4] = 1;
+    assert(rset_view(&view, storage, 2 * (4 + 4096)));
+
+    // Arrays can't hold more items than the largest buffer.
+    static uint16_t large[4 + 5000];
+    large[0] = RSET_ARRAY;
+    large[1] = large[2] = 5000;
+    for (unsigned i = 0; i < 5000; i++)
+        large[4 + i] = i;
+    assert(!rset_view(&view, large, sizeof(large)));
+    rset_free(set);
+    rset_free(result);
+    rset_free(other);
+}
+
+static void test_serialize()
+{
+    static unsigned char storage[16 + 2 * 4608 + 4];
+    for (unsigned pattern = 0; pattern < pattern_count; pattern++) {
+        rset_t *set = rset_new_pattern(pattern, 7);
+        assert(set);
+        for (unsigned flags = 0; flags <= RSET_CHECKSUM; flags++) {
+            unsigned length = rset_serialized_length(set, flags);
+            assert(rset_serialize(set, storage, flags) == length);
+            rset_t *copy = rset_import_checked(storage, length);
+            assert(copy && rset_equals(copy, set));
+            assert(rset_cardinality(copy) == rset_cardinality(set));
+            rset_free(copy);
+            assert(!rset_import_checked(storage, length - 1));
+            assert(!rset_import_checked(storage, length + 1));
+        }
+        // Any flipped bit is caught by the checksum.
+        unsigned length = rset_serialize(set, storage, RSET_CHECKSUM);
+        for (unsigned i = 0; i < length; i += 97) {
+            storage[i] ^= 0x10;
+            assert(!rset_import_checked(storage, length));
+            storage[i] ^= 0x10;
+        }
+        rset_free(set);
+    }
+
+    // The format is little-endian and stable across versions of the library.
+    const unsigned char expected[] = {
+        'R', 'S', 'E', 'T', 1, RSET_CHECKSUM, RSET_ARRAY, 0,
+        3, 0, 0, 0, 3, 0, 0, 0, 1, 0, 2, 0, 0x34, 0x12,
+        0xDB, 0x06, 0x19, 0x51
+    };
+    rset_t *set = rset_new_items(3, 0x1234, 1, 2);
+    assert(set);
+    assert(rset_serialized_length(set, RSET_CHECKSUM) == sizeof(expected));
+    assert(rset_serialize(set, storage, RSET_CHECKSUM) == sizeof(expected));
+    assert(!memcmp(storage, expected, sizeof(expected)));
+
+    // Without a checksum the items themselves are validated.
+    unsigned length = rset_serialize(set, storage, 0);
+    rset_t *copy = rset_import_checked(storage, length);
+    assert(copy && rset_equals(copy, set));
+    rset_free(copy);
+    storage[16] = 2;
+    assert(!rset_import_checked(storage, length));
+    storage[16] = 1;
+    storage[8] = 4;
+    assert(!rset_import_checked(storage, length));
+    storage[8] = 3;
+    storage[4] = 2;
+    assert(!rset_import_checked(storage, length));
+    storage[4] = 1;
+    storage[0] = 'X';
+    assert(!rset_import_checked(storage, length));
+    assert(!rset_import_checked(NULL, length));
+    assert(!rset_import_checked(storage, 15));
+
+    // A bitset whose cardinality doesn't match its bits is rejected.
+    for (unsigned i = 0; i < 20000; i += 2)
+        assert(rset_add(set, i));
+    length = rset_serialize(set, storage, 0);
+    assert(storage[6] == RSET_BITSET);
+    storage[16] ^= 0x80;
+    assert(!rset_import_checked(storage, length));
+    storage[16] ^= 0x80;
+
+    // Overlapping runs are rejected.
+    assert(rset_truncate(set) && rset_add_range(set, 100, 200) &&
+           rset_add_range(set, 300, 400) && rset_optimize(set));
+    length = rset_serialize(set, storage, 0);
+    assert(storage[6] == RSET_RUN);
+    copy = rset_import_checked(storage, length);
+    assert(copy && rset_equals(copy, set));
+    rset_free(copy);
+    storage[20] = 150 & 0xFF;
+    storage[21] = 150 >> 8;
+    assert(!rset_import_checked(storage, length));
+
+    // rset_import only trusts lengths that could belong to a set.
+    assert(!rset_import(storage, sizeof(storage)));
+    assert(!rset_import(rset_export(set), rset_length(set) - 2));
+    rset_free(set);
+}
+
+static void test_serialize_compressed()
+{
+    static unsigned char storage[16 + 2 * 4608 + 4];
+    for (unsigned pattern = 0; pattern < pattern_count; pattern++) {
+        rset_t *set = rset_new_pattern(pattern, 9);
+        assert(set);
+        for (unsigned flags = RSET_COMPRESS;
+             flags <= (RSET_COMPRESS | RSET_CHECKSUM); flags++) {
+            unsigned length = rset_serialized_length(set, flags);
+            assert(length <= rset_serialized_length(set, flags &
+                                                    ~RSET_COMPRESS));
+            assert(rset_serialize(set, storage, flags) == length);
+            rset_t *copy = rset_import_checked(storage, length);
+            assert(copy && rset_equals(copy, set));
+            rset_free(copy);
+            assert(!rset_import_checked(storage, length - 1));
+        }
+        rset_free(set);
+    }
+
+    // Consecutive items take a byte per block of 64.
+    const unsigned char expected[] = {
+        'R', 'S', 'E', 'T', 1, RSET_COMPRESS, RSET_ARRAY, 0,
+        100, 0, 0, 0, 100, 0, 0, 0, 0, 0
+    };
+    rset_t *set = rset_new();
+    assert(set);
+    for (unsigned i = 0; i < 100; i++)
+        assert(rset_add(set, i));
+    unsigned length = rset_serialize(set, storage, RSET_COMPRESS);
+    assert(length == sizeof(expected));
+    assert(!memcmp(storage, expected, sizeof(expected)));
+
+    // Gaps that overflow the last item or widths wider than an item are
+    // rejected.
+    rset_t *copy = rset_import_checked(storage, length);
+    assert(copy && rset_equals(copy, set));
+    rset_free(copy);
+    storage[16] = 17;
+    assert(!rset_import_checked(storage, length));
+    storage[16] = 0;
+    storage[17] = 16;
+    assert(!rset_import_checked(storage, length));
+    memset(storage + length, 0xFF, 72);
+    assert(!rset_import_checked(storage, length + 72));
+
+    // Sparse and dense bitsets only store their mixed words.
+    assert(rset_truncate(set));
+    for (unsigned i = 0; i < 5000; i++)
+        assert(rset_add(set, 13 * i));
+    assert(rset_add_range(set, 0, 16384));
+    length = rset_serialize(set, storage, RSET_COMPRESS);
+    assert(storage[5] == RSET_COMPRESS && storage[6] == RSET_BITSET);
+    assert(length < rset_length(set));
+    copy = rset_import_checked(storage, length);
+    assert(copy && rset_equals(copy, set));
+    rset_free(copy);
+    storage[16] = 0xFF;
+    assert(!rset_import_checked(storage, length));
+    rset_free(set);
+}
+
+static void test_index()
+{
+    const char *path = "tests.rindex";
+    rindex_writer_t *writer = rindex_writer_open(path);
+    assert(writer);
+    for (unsigned pattern = 0; pattern < pattern_count; pattern++) {
+        rset_t *set = rset_new_pattern(pattern, 8);
+        assert(set);
+        assert(rindex_writer_add(writer, 1000 * pattern + 1, set));
+        rset_free(set);
+    }
+    rset_t *empty = rset_new();
+    assert(empty);
+    assert(rindex_writer_add(writer, 0xFFFFFFFF, empty));
+    // Keys must be added in ascending order.
+    assert(!rindex_writer_add(writer, 5, empty));
+    assert(!rindex_writer_add(writer, 0xFFFFFFFF, empty));
+    assert(rindex_writer_close(writer));
+
+    rindex_t *index = rindex_open(path);
+    assert(index);
+    assert(rindex_count(index) == pattern_count + 1);
+    rset_view_t view;
+    for (unsigned pattern = 0; pattern < pattern_count; pattern++) {
+        rset_t *set = rset_new_pattern(pattern, 8);
+        assert(set);
+        const rset_t *stored = rindex_get(index, 1000 * pattern + 1, &view);
+        assert(stored && rset_equals(stored, set));
+        // Sets are viewed in place rather than copied out of the file.
+        assert((const unsigned char *)stored->buffer >= index->data &&
+               (const unsigned char *)stored->buffer < index->data +
+                                                      index->length);
+        uint32_t key;
+        stored = rindex_get_at(index, pattern, &key, &view);
+        assert(stored && key == 1000 * pattern + 1 && rset_equals(stored, set));
+        assert(!rindex_get(index, 1000 * pattern, &view));
+        assert(!rindex_get(index, 1000 * pattern + 2, &view));
+        rset_free(set);
+    }
+    const rset_t *stored = rindex_get(index, 0xFFFFFFFF, &view);
+    assert(stored && rset_equals(stored, empty));
+    uint32_t key;
+    assert(!rindex_get_at(index, pattern_count + 1, &key, &view));
+    const rset_t *runs = rindex_get(index, 5001, &view);
+    assert(runs && runs->buffer[0] == RSET_RUN);
+    long last_run = index->entries[5].offset +
+                    sizeof(uint16_t) * (4 + runs->buffer[1] - 2);
+    rindex_close(index);
+
+    // A set whose last run runs past 65535 is corrupt, even though its header
+    // is consistent.
+    FILE *file = fopen(path, "r+b");
+    assert(file);
+    const uint16_t start = 65000;
+    assert(!fseek(file, last_run, SEEK_SET));
+    assert(fwrite(&start, sizeof(start), 1, file) == 1);
+    assert(!fclose(file));
+    index = rindex_open(path);
+    assert(index);
+    assert(!rindex_get(index, 5001, &view));
+    assert(!rindex_get_at(index, 5, &key, &view));
+    assert(rindex_get(index, 4001, &view));
+    rindex_close(index);
+
+    // A file with a corrupt footer isn't an index.
+    file = fopen(path, "r+b");
+    assert(file);
+    assert(!fseek(file, -1, SEEK_END) && fputc('Y', file) != EOF);
+    assert(!fclose(file));
+    assert(!rindex_open(path));
+    assert(!rindex_open("missing.rindex"));
+
+    // An empty index is valid.
+    writer = rindex_writer_open(path);
+    assert(writer && rindex_writer_close(writer));
+    index = rindex_open(path);
+    assert(index && rindex_count(index) == 0);
+    assert(!rindex_get(index, 0, &view));
+    rindex_close(index);
+    assert(!remove(path));
+    rset_free(empty);
+}
+
+static bool shared_add_next(rset_t *set, void *context)
+{
+    (void)context;
+    return rset_add(set, 3 * rset_cardinality(set));
+}
+
+static bool shared_fail(rset_t *set, void *context)
+{
+    (void)set;
+    (void)context;
+    return false;
+}
+
+typedef struct {
+    rshared_t *shared;
+    bool done;
+} shared_reader_t;
+
+static void *shared_reader(void *argument)
+{
+    // Every version a reader sees is complete, and versions never go back.
+    shared_reader_t *reader = argument;
+    unsigned last = 0;
+    while (!__atomic_load_n(&reader->done, __ATOMIC_ACQUIRE)) {
+        unsigned epoch;
+        const rset_t *set = rshared_acquire(reader->shared, &epoch);
+        unsigned cardinality = rset_cardinality(set);
+        assert(cardinality >= last);
+        assert(!rset_contains(set, 3 * cardinality));
+        for (unsigned i = 0; i < cardinality; i += 97)
+            assert(rset_contains(set, 3 * i));
+        assert(!cardinality || rset_contains(set, 3 * (cardinality - 1)));
+        rshared_release(reader->shared, epoch);
+        last = cardinality;
+    }
+    return NULL;
+}
+
+static void test_shared()
+{
+    rshared_t shared;
+    assert(rshared_init(&shared));
+    unsigned epoch;
+    const rset_t *set = rshared_acquire(&shared, &epoch);
+    assert(rset_cardinality(set) == 0);
+    rshared_release(&shared, epoch);
+
+    // A failed update isn't published.
+    assert(rshared_update(&shared, shared_add_next, NULL));
+    assert(!rshared_update(&shared, shared_fail, NULL));
+    set = rshared_acquire(&shared, &epoch);
+    assert(rset_cardinality(set) == 1 && rset_contains(set, 0));
+    rshared_release(&shared, epoch);
+
+    rset_t *prefix = rset_new();
+    assert(prefix);
+    for (unsigned i = 0; i < 4000; i++)
+        assert(rset_add(prefix, 3 * i));
+    rshared_replace(&shared, prefix);
+
+    // Updates race with readers; the array becomes a bitset along the way.
+    shared_reader_t readers[4];
+    pthread_t threads[4];
+    for (unsigned i = 0; i < 4; i++) {
+        readers[i].shared = &shared;
+        readers[i].done = false;
+        assert(!pthread_create(&threads[i], NULL, shared_reader, &readers[i]));
+    }
+    for (unsigned i = 4000; i < 4200; i++)
+        assert(rshared_update(&shared, shared_add_next, NULL));
+    for (unsigned i = 0; i < 4; i++) {
+        __atomic_store_n(&readers[i].done, true, __ATOMIC_RELEASE);
+        assert(!pthread_join(threads[i], NULL));
+    }
+    set = rshared_acquire(&shared, &epoch);
+    assert(rset_cardinality(set) == 4200 && set->buffer[0] == RSET_BITSET);
+    rshared_release(&shared, epoch);
+
+    rset_t *replacement = rset_new_items(2, 7, 9);
+    assert(replacement);
+    rshared_replace(&shared, replacement);
+    set = rshared_acquire(&shared, &epoch);
+    assert(set == replacement);
+    rshared_release(&shared, epoch);
+    rshared_destroy(&shared);
+}
+
+static bool batch_visit(void *context, size_t index)
+{
+    unsigned *visits = context;
+    __atomic_add_fetch(&visits[index], 1, __ATOMIC_RELAXED);
+    return index != 777;
+}
+
+static size_t batch_skewed_cost(void *context, size_t index)
+{
+    (void)context;
+    return index < 10 ? 1000000 : 1;
+}
+
+static void test_batch()
+{
+    rbatch_pool_t *pool = rbatch_pool_new(4);
+    assert(pool && pool->thread_count == 4);
+
+    // Every call is made exactly once, however the costs are skewed, and a
+    // failed call fails the batch without stopping it.
+    static unsigned visits[5000];
+    assert(rbatch_run(pool, 777, batch_visit, NULL, visits));
+    assert(!rbatch_run(pool, 5000, batch_visit, batch_skewed_cost, visits));
+    assert(rbatch_run(pool, 0, batch_visit, NULL, visits));
+    for (unsigned i = 0; i < 5000; i++)
+        assert(visits[i] == 1 + (i < 777));
+
+    // Every pair of patterns, as tuples and as one set against many.
+    const unsigned count = pattern_count * pattern_count;
+    rset_t *a[pattern_count * pattern_count], *b[pattern_count * pattern_count];
+    rset_t *results[pattern_count * pattern_count];
+    rbatch_job_t jobs[pattern_count * pattern_count];
+    unsigned cardinalities[pattern_count * pattern_count];
+    for (unsigned i = 0; i < count; i++) {
+        a[i] = rset_new_pattern(i / pattern_count, 1);
+        b[i] = rset_new_pattern(i % pattern_count, 2);
+        results[i] = rset_new();
+        assert(a[i] && b[i] && results[i]);
+        jobs[i] = (rbatch_job_t){ a[i], b[i], results[i] };
+    }
+    rset_t *expected = rset_new();
+    assert(expected);
+    bool (*const ops[])(const rset_t *, const rset_t *, rset_t *) = {
+        rset_intersection, rset_union, rset_difference, rset_xor
+    };
+    for (unsigned op = RBATCH_INTERSECTION; op <= RBATCH_XOR; op++) {
+        assert(rbatch_apply(pool, op, jobs, count));
+        for (unsigned i = 0; i < count; i++) {
+            assert(ops[op](a[i], b[i], expected));
+            assert(rset_equals(results[i], expected));
+        }
+        assert(rbatch_apply_one(pool, op, a[count - 1], (const rset_t **)b,
+                                results, count));
+        for (unsigned i = 0; i < count; i++) {
+            assert(ops[op](a[count - 1], b[i], expected));
+            assert(rset_equals(results[i], expected));
+        }
+    }
+    rbatch_intersection_cardinality(pool, a[20], (const rset_t **)b,
+                                    cardinalities, count);
+    for (unsigned i = 0; i < count; i++)
+        assert(cardinalities[i] == rset_intersection_cardinality(a[20], b[i]));
+
+    // A many-way union matches the sequential one, including when the
+    // output is one of the inputs.
+    for (unsigned n = 0; n <= count; n += 7) {
+        assert(rbatch_union_many(pool, (const rset_t **)b, n, results[0]));
+        assert(rset_union_many((const rset_t **)b, n, expected));
+        assert(rset_equals(results[0], expected));
+    }
+    assert(rbatch_union_many(pool, (const rset_t **)a, 20, a[3]));
+    assert(rset_equals(a[3], a[14]));
+
+    for (unsigned i = 0; i < count; i++) {
+        rset_free(a[i]);
+        rset_free(b[i]);
+        rset_free(results[i]);
+    }
+    rset_free(expected);
+    rbatch_pool_free(pool);
+
+    // A single-threaded pool runs batches on the calling thread.
+    pool = rbatch_pool_new(1);
+    assert(pool);
+    memset(visits, 0, sizeof(visits));
+    assert(!rbatch_run(pool, 1000, batch_visit, NULL, visits));
+    for (unsigned i = 0; i < 1000; i++)
+        assert(visits[i] == 1);
+    rbatch_pool_free(pool);
+}
+
+static void test_bitmap_parallel()
+{
+    rbatch_pool_t *pool = rbatch_pool_new(4);
+    rbitmap_t *a = rbitmap_new();
+    rbitmap_t *b = rbitmap_new();
+    rbitmap_t *result = rbitmap_new();
+    rbitmap_t *expected = rbitmap_new();
+    assert(pool && a && b && result && expected);
+
+    // Keys with sparse arrays, bitsets and runs, some only in one bitmap.
+    uint32_t state = 1;
+    for (uint32_t key = 0; key < 120; key++) {
+        for (unsigned i = 0; i < 64 * (key % 100); i++) {
+            state = state * 1103515245 + 12345;
+            uint32_t item = key << 16 | (state >> 16);
+            if (key % 3)
+                assert(rbitmap_add(a, item));
+            if (key % 5)
+                assert(rbitmap_add(b, item ^ (key % 2)));
+        }
+    }
+    for (uint32_t i = 0; i < 100000; i++)
+        assert(rbitmap_add(a, 0x10000000 + i));
+
+    assert(rbitmap_intersection(a, b, expected));
+    assert(rbitmap_intersection_parallel(a, b, result, pool));
+    assert(rbitmap_equals(result, expected) && result->count);
+    assert(rbitmap_intersection_cardinality(a, b) ==
+           rbitmap_cardinality(expected));
+    assert(rbitmap_intersection_cardinality_parallel(a, b, pool) ==
+           rbitmap_cardinality(expected));
+
+    assert(rbitmap_union(a, b, expected));
+    assert(rbitmap_union_parallel(a, b, result, pool));
+    assert(rbitmap_equals(result, expected));
+    assert(rbitmap_cardinality(result) == rbitmap_cardinality(a) +
+           rbitmap_cardinality(b) - rbitmap_intersection_cardinality(a, b));
+    for (uint32_t i = 0; i < 120 << 16; i += 4099) {
+        bool contains = rbitmap_contains(a, i) || rbitmap_contains(b, i);
+        assert(rbitmap_contains(result, i) == contains);
+    }
+
+    // The result can alias an operand.
+    assert(rbitmap_union_parallel(a, b, a, pool));
+    assert(rbitmap_equals(a, expected));
+
+    // Serialization is the same with or without the pool.
+    for (unsigned flags = 0; flags <= (RSET_CHECKSUM | RSET_COMPRESS);
+         flags++) {
+        uint64_t length = rbitmap_serialized_length(a, flags);
+        unsigned char *serial = malloc(length);
+        unsigned char *parallel = malloc(length);
+        assert(serial && parallel);
+        assert(rbitmap_serialize(a, serial, flags) == length);
+        assert(rbitmap_serialize_parallel(a, parallel, flags, pool) == length);
+        assert(!memcmp(serial, parallel, length));
+        rbitmap_t *imported = rbitmap_import(serial, length);
+        assert(imported && rbitmap_equals(imported, a));
+        rbitmap_free(imported);
+        imported = rbitmap_import_parallel(serial, length, pool);
+        assert(imported && rbitmap_equals(imported, a));
+        rbitmap_free(imported);
+
+        // Truncated buffers, trailing bytes and corrupt keys are rejected.
+        assert(!rbitmap_import(serial, length - 1));
+        assert(!rbitmap_import_parallel(serial, length - 1, pool));
+        assert(!rbitmap_import(serial, 7));
+        serial[8] = 0xFF;
+        serial[9] = 0xFF;
+        serial[10] = 0xFF;
+        assert(!rbitmap_import(serial, length));
+        free(serial);
+        free(parallel);
+    }
+    unsigned char empty[8];
+    rbitmap_truncate(b);
+    assert(rbitmap_serialize(b, empty, 0) == sizeof(empty));
+    rbitmap_t *imported = rbitmap_import(empty, sizeof(empty));
+    assert(imported && imported->count == 0);
+    rbitmap_free(imported);
+
+    rbitmap_free(a);
+    rbitmap_free(b);
+    rbitmap_free(result);
+    rbitmap_free(expected);
+    rbatch_pool_free(pool);
+}
+
 int main()
 {
     test_new();
@@ -343,5 +2100,39 @@ int main()
     test_contains();
     test_invert();
     test_intersection();
+    test_array_to_run();
+    test_run_import_export();
+    test_run_invert();
+    test_run_intersection();
+    test_optimize();
+    test_union();
+    test_difference();
+    test_xor();
+    test_mixed_intersection();
+    test_skewed_intersection();
+    test_cardinality_ops();
+    test_inplace_ops();
+    test_many_ops();
+    test_allocator();
+    test_conversions_without_allocation();
+    test_result_sizes();
+    test_remove();
+    test_remove_hysteresis();
+    test_add_many();
+    test_range_ops();
+    test_rank_select();
+    test_iterator();
+    test_to_array();
+    test_view();
+    test_serialize();
+    test_serialize_compressed();
+    test_index();
+    test_shared();
+    test_batch();
+    test_bitmap_add_contains();
+    test_bitmap_intersection();
+    test_bitmap_invert();
+    test_bitmap_to_array();
+    test_bitmap_parallel();
     return 0;
 }